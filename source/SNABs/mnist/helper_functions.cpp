@@ -16,11 +16,19 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cypress/cypress.hpp>
 #include <fstream>
+#include <random>
 #include <string>
 #include <utility>  //std::pair
 
@@ -29,48 +37,149 @@
 namespace mnist_helper {
 using namespace cypress;
 
-MNIST_DATA loadMnistData(const size_t num_data, const std::string path)
+namespace {
+uint32_t read_big_endian(const uint8_t *data)
 {
-	MNIST_DATA res;
-	std::ifstream images, labels;
-	images.open(path + "-images-idx3-ubyte", std::ios::binary);
-	if (!images.good()) {
-		throw std::runtime_error("Could not open image file " + path +
-		                         "-images-idx3-ubyte!");
-	}
-	labels.open(path + "-labels-idx1-ubyte", std::ios::binary);
-	if (!images.good()) {
-		throw std::runtime_error("Could not open label file " + path +
-		                         "-labels-idx1-ubyte");
-	}
-
-	images.seekg(16, images.beg);
-	unsigned char tmp = 0;
-	for (size_t i = 0; i < num_data; i++) {
-		std::vector<Real> image;
-		for (size_t row = 0; row < 28; row++) {
-			for (size_t col = 0; col < 28; col++) {
-				images.read((char *)&tmp, sizeof(tmp));
-				if (images.eof()) {
-					throw std::runtime_error("Error reading file!");
-				}
-				image.push_back(((Real)tmp) / 255.0);
-			}
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) |
+	       (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+/**
+ * @brief Maps a whole file read-only, returns nullptr for empty files
+ */
+const uint8_t *map_readonly(const std::string &file, size_t &size)
+{
+	const uint8_t *data = nullptr;
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Could not open file " + file + "!");
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error("Could not stat file " + file + "!");
+	}
+	size = st.st_size;
+	if (size > 0) {
+		void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Could not map file " + file + "!");
+		}
+		data = static_cast<const uint8_t *>(ptr);
+	}
+	close(fd);
+	return data;
+}
+}  // namespace
+
+MnistIdx::Mapping MnistIdx::map_file(const std::string &file)
+{
+	Mapping res;
+	res.data = map_readonly(file, res.size);
+	return res;
+}
+
+void MnistIdx::unmap(Mapping &mapping)
+{
+	if (mapping.data) {
+		munmap(const_cast<uint8_t *>(mapping.data), mapping.size);
+	}
+	mapping = Mapping();
+}
+
+MnistIdx::MnistIdx(const std::string &path, size_t num_data)
+{
+	m_images = map_file(path + "-images-idx3-ubyte");
+	try {
+		m_labels = map_file(path + "-labels-idx1-ubyte");
+		if (m_images.size < 16 || read_big_endian(m_images.data) != 0x803) {
+			throw std::runtime_error("Invalid image file " + path +
+			                         "-images-idx3-ubyte!");
+		}
+		if (m_labels.size < 8 || read_big_endian(m_labels.data) != 0x801) {
+			throw std::runtime_error("Invalid label file " + path +
+			                         "-labels-idx1-ubyte!");
+		}
+		m_size = std::min(read_big_endian(m_images.data + 4),
+		                  read_big_endian(m_labels.data + 4));
+		m_rows = read_big_endian(m_images.data + 8);
+		m_cols = read_big_endian(m_images.data + 12);
+		if (pixels() == 0) {
+			throw std::runtime_error("Invalid image file " + path +
+			                         "-images-idx3-ubyte!");
+		}
+		m_size = std::min(m_size, (m_images.size - 16) / pixels());
+		m_size = std::min(m_size, m_labels.size - 8);
+		if (num_data > m_size) {
+			throw std::runtime_error("Error reading file!");
+		}
+		if (num_data > 0) {
+			m_size = num_data;
 		}
-		std::get<0>(res).push_back(image);
 	}
+	catch (...) {
+		unmap(m_images);
+		unmap(m_labels);
+		throw;
+	}
+}
+
+MnistIdx::MnistIdx(MnistIdx &&other) noexcept
+    : m_images(other.m_images),
+      m_labels(other.m_labels),
+      m_size(other.m_size),
+      m_rows(other.m_rows),
+      m_cols(other.m_cols)
+{
+	other.m_images = Mapping();
+	other.m_labels = Mapping();
+	other.m_size = 0;
+}
 
-	labels.seekg(8, labels.beg);
-	for (size_t i = 0; i < num_data; i++) {
-		labels.read((char *)&tmp, sizeof(tmp));
-		std::get<1>(res).push_back(uint16_t(tmp));
+MnistIdx::~MnistIdx()
+{
+	unmap(m_images);
+	unmap(m_labels);
+}
+
+void MnistIdx::normalize(size_t start, size_t n, Real *out) const
+{
+	const uint8_t *in = image(start);
+	const size_t len = n * pixels();
+	// Simple loop without dependencies, vectorized by the compiler
+	for (size_t i = 0; i < len; i++) {
+		out[i] = Real(in[i]) / 255.0;
 	}
+}
 
-	images.close();
-	labels.close();
+std::vector<Real> MnistIdx::normalize(size_t i) const
+{
+	std::vector<Real> res(pixels());
+	normalize(i, 1, res.data());
+	return res;
+}
 
+MNIST_DATA to_mnist_data(const MnistIdx &idx)
+{
+	MNIST_DATA res;
+	std::get<0>(res).reserve(idx.size());
+	std::get<1>(res).reserve(idx.size());
+	for (size_t i = 0; i < idx.size(); i++) {
+		std::get<0>(res).emplace_back(idx.normalize(i));
+		std::get<1>(res).push_back(idx.label(i));
+	}
 	return res;
 }
+
+MNIST_DATA loadMnistData(const size_t num_data, const std::string path)
+{
+	MnistIdx idx(path, num_data);
+	if (num_data == 0) {
+		return MNIST_DATA();
+	}
+	return to_mnist_data(idx);
+}
 void print_image(const std::vector<Real> &img, size_t wrap)
 {
 	size_t count = 0;
@@ -89,45 +198,40 @@ void print_image(const std::vector<Real> &img, size_t wrap)
 	}
 }
 
-std::vector<std::vector<std::vector<Real>>> image_to_rate(
-    const std::vector<std::vector<Real>> &images, const Real duration,
-    const Real max_freq, size_t num_images, bool poisson)
+SpikeStore image_to_rate(const std::vector<std::vector<Real>> &images,
+                         const Real duration, const Real max_freq,
+                         size_t num_images, bool poisson)
 {
-	std::vector<std::vector<std::vector<Real>>> rate_images;
+	SpikeStore rate_images(num_images ? images[0].size() : 0);
+	rate_images.reserve(num_images * rate_images.block_size(), 0);
 	for (size_t i = 0; i < num_images; i++) {
-		std::vector<std::vector<Real>> spike_image;
 		for (const auto &pixel : images[i]) {
 			if (poisson) {
-				spike_image.emplace_back(
+				rate_images.push_back(
 				    cypress::spikes::poisson(0.0, duration, max_freq * pixel));
 			}
 			else {
-				spike_image.emplace_back(cypress::spikes::constant_frequency(
+				rate_images.push_back(cypress::spikes::constant_frequency(
 				    0.0, duration, max_freq * pixel));
 			}
 		}
-		rate_images.emplace_back(spike_image);
 	}
 	return rate_images;
 }
 
-std::vector<std::vector<std::vector<Real>>> image_to_TTFS(
-    const std::vector<std::vector<Real>> &images, const Real duration,
-    size_t num_images)
+SpikeStore image_to_TTFS(const std::vector<std::vector<Real>> &images,
+                         const Real duration, size_t num_images)
 {
-	std::vector<std::vector<std::vector<Real>>> TTFS_images;
+	SpikeStore TTFS_images(num_images ? images[0].size() : 0);
+	TTFS_images.reserve(num_images * TTFS_images.block_size(),
+	                    num_images * TTFS_images.block_size());
 	for (size_t i = 0; i < num_images; i++) {
-		std::vector<std::vector<Real>> spike_image;
 		for (const auto &pixel : images[i]) {
 			if (pixel > 0) {
-				spike_image.emplace_back(
-				    std::vector<Real>{(1.0 - pixel) * duration});
-			}
-			else {
-				spike_image.emplace_back(std::vector<Real>{});
+				TTFS_images.add_spike((1.0 - pixel) * duration);
 			}
+			TTFS_images.close_train();
 		}
-		TTFS_images.emplace_back(spike_image);
 	}
 	return TTFS_images;
 }
@@ -149,12 +253,13 @@ SPIKING_MNIST mnist_to_spike(const MNIST_DATA &mnist_data, const Real duration,
 	return res;
 }
 
-std::vector<MNIST_DATA> create_batches(const SPIKING_MNIST &mnist_data,
-                                       const size_t batch_size, Real duration,
-                                       Real pause, const bool shuffle,
-                                       unsigned seed)
+std::vector<SPIKING_MNIST> create_batches(const SPIKING_MNIST &mnist_data,
+                                          const size_t batch_size,
+                                          Real duration, Real pause,
+                                          const bool shuffle, unsigned seed)
 {
-	std::vector<size_t> indices(std::get<0>(mnist_data).size());
+	const SpikeStore &images = std::get<0>(mnist_data);
+	std::vector<size_t> indices(images.blocks());
 	for (size_t i = 0; i < indices.size(); i++) {
 		indices[i] = i;
 	}
@@ -166,36 +271,36 @@ std::vector<MNIST_DATA> create_batches(const SPIKING_MNIST &mnist_data,
 		std::shuffle(indices.begin(), indices.end(), rng);
 	}
 	size_t counter = 0;
-	size_t image_size = std::get<0>(mnist_data)[0].size();
-	std::vector<MNIST_DATA> res;
+	size_t image_size = images.block_size();
+	std::vector<SPIKING_MNIST> res;
 	while (counter < indices.size()) {
-		MNIST_DATA single_batch_combined;
+		size_t n_images = std::min(batch_size, indices.size() - counter);
+		SPIKING_MNIST single_batch_combined;
+		SpikeStore &single_batch = std::get<0>(single_batch_combined);
+		single_batch = SpikeStore(image_size);
 
-		std::vector<std::vector<Real>> &single_batch =
-		    std::get<0>(single_batch_combined);
+		size_t n_spikes = 0;
+		for (size_t index = 0; index < n_images; index++) {
+			size_t shfld_index = indices[counter + index];
+			n_spikes += images.end(shfld_index, image_size - 1) -
+			            images.begin(shfld_index, 0);
+		}
+		single_batch.reserve(image_size, n_spikes);
+
+		// Spikes of image #index are shifted to its presentation window
 		for (size_t pixel = 0; pixel < image_size; pixel++) {
-			std::vector<Real> spike_pxl;
-			for (size_t index = 0; index < batch_size; index++) {
-				if (counter + index >= indices.size()) {
-					break;
-				}
+			for (size_t index = 0; index < n_images; index++) {
 				size_t shfld_index = indices[counter + index];
-
-				auto pxl_spk = std::get<0>(mnist_data)[shfld_index][pixel];
-				std::for_each(pxl_spk.begin(), pxl_spk.end(),
-				              [&duration, &pause, &index](Real &d) {
-					              d += (duration + pause) * index;
-				              });
-				spike_pxl.insert(spike_pxl.end(), pxl_spk.begin(),
-				                 pxl_spk.end());
+				Real offset = (duration + pause) * index;
+				for (auto spike = images.begin(shfld_index, pixel);
+				     spike != images.end(shfld_index, pixel); spike++) {
+					single_batch.add_spike(*spike + offset);
+				}
 			}
-			single_batch.emplace_back(spike_pxl);
+			single_batch.close_train();
 		}
 		std::vector<uint16_t> &labels = std::get<1>(single_batch_combined);
-		for (size_t index = 0; index < batch_size; index++) {
-			if (counter + index >= indices.size()) {
-				break;
-			}
+		for (size_t index = 0; index < n_images; index++) {
 			size_t shfld_index = indices[counter + index];
 			labels.emplace_back(std::get<1>(mnist_data)[shfld_index]);
 		}
@@ -205,8 +310,172 @@ std::vector<MNIST_DATA> create_batches(const SPIKING_MNIST &mnist_data,
 	return res;
 }
 
+namespace {
+/**
+ * @brief Poisson spike train in [0, duration) drawn from the given generator
+ *
+ * @param rate rate in Hz, times are given in ms
+ */
+std::vector<Real> poisson_train(Real duration, Real rate, std::mt19937 &gen)
+{
+	std::vector<Real> res;
+	if (rate <= 0.0) {
+		return res;
+	}
+	std::exponential_distribution<Real> isi(rate * 1e-3);
+	for (Real t = isi(gen); t < duration; t += isi(gen)) {
+		res.push_back(t);
+	}
+	return res;
+}
+}  // namespace
+
+SPIKING_MNIST encode_batch(const MnistView &mnist_data,
+                           const std::vector<size_t> &indices, size_t start,
+                           size_t n, Real duration, Real max_freq, Real pause,
+                           bool poisson, bool ttfs, unsigned poisson_seed)
+{
+	size_t image_size = n ? mnist_data.pixels() : 0;
+	// Only the images of this batch are converted to Real
+	std::vector<Real> images(n * image_size);
+	for (size_t index = 0; index < n; index++) {
+		mnist_data.image(indices[start + index],
+		                 images.data() + index * image_size);
+	}
+	// One generator per image, independent of batch and position
+	std::vector<std::mt19937> gens;
+	if (poisson && !ttfs && poisson_seed != 0) {
+		for (size_t index = 0; index < n; index++) {
+			std::seed_seq seq{poisson_seed, unsigned(indices[start + index])};
+			gens.emplace_back(seq);
+		}
+	}
+	SPIKING_MNIST res;
+	SpikeStore &spikes = std::get<0>(res);
+	spikes = SpikeStore(image_size);
+	spikes.reserve(image_size, 0);
+	for (size_t pixel = 0; pixel < image_size; pixel++) {
+		for (size_t index = 0; index < n; index++) {
+			Real value = images[index * image_size + pixel];
+			Real offset = (duration + pause) * index;
+			if (ttfs) {
+				if (value > 0) {
+					spikes.add_spike((1.0 - value) * duration + offset);
+				}
+				continue;
+			}
+			std::vector<Real> train;
+			if (!gens.empty()) {
+				train = poisson_train(duration, max_freq * value, gens[index]);
+			}
+			else if (poisson) {
+				train = cypress::spikes::poisson(0.0, duration,
+				                                 max_freq * value);
+			}
+			else {
+				train = cypress::spikes::constant_frequency(0.0, duration,
+				                                            max_freq * value);
+			}
+			for (auto spike : train) {
+				spikes.add_spike(spike + offset);
+			}
+		}
+		spikes.close_train();
+	}
+	for (size_t index = 0; index < n; index++) {
+		std::get<1>(res).push_back(mnist_data.label(indices[start + index]));
+	}
+	return res;
+}
+
+SpikeBatchStream::SpikeBatchStream(const MnistView &mnist_data,
+                                   size_t num_images, size_t batch_size,
+                                   Real duration, Real max_freq, Real pause,
+                                   bool poisson, bool ttfs, bool shuffle,
+                                   unsigned seed, size_t depth,
+                                   unsigned poisson_seed)
+    : m_data(mnist_data),
+      m_indices(std::min(num_images, mnist_data.size())),
+      m_batch_size(std::max(batch_size, size_t(1))),
+      m_batches((m_indices.size() + m_batch_size - 1) / m_batch_size),
+      m_depth(std::max(depth, size_t(1))),
+      m_duration(duration),
+      m_max_freq(max_freq),
+      m_pause(pause),
+      m_poisson(poisson),
+      m_ttfs(ttfs),
+      m_poisson_seed(poisson_seed)
+{
+	for (size_t i = 0; i < m_indices.size(); i++) {
+		m_indices[i] = i;
+	}
+	if (shuffle) {
+		if (seed == 0) {
+			seed = std::chrono::system_clock::now().time_since_epoch().count();
+		}
+		auto rng = std::default_random_engine{seed};
+		std::shuffle(m_indices.begin(), m_indices.end(), rng);
+	}
+	m_thread = std::thread([this]() { produce(); });
+}
+
+SpikeBatchStream::~SpikeBatchStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+}
+
+void SpikeBatchStream::produce()
+{
+	try {
+		for (size_t batch = 0; batch < m_batches; batch++) {
+			size_t start = batch * m_batch_size;
+			auto data = encode_batch(
+			    m_data, m_indices, start,
+			    std::min(m_batch_size, m_indices.size() - start), m_duration,
+			    m_max_freq, m_pause, m_poisson, m_ttfs, m_poisson_seed);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock,
+			            [this]() { return m_stop || m_queue.size() < m_depth; });
+			if (m_stop) {
+				return;
+			}
+			m_queue.emplace_back(std::move(data));
+			m_cond.notify_all();
+		}
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_error = std::current_exception();
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_done = true;
+	m_cond.notify_all();
+}
+
+bool SpikeBatchStream::next(SPIKING_MNIST &batch)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]() { return m_done || !m_queue.empty(); });
+	if (!m_queue.empty()) {
+		batch = std::move(m_queue.front());
+		m_queue.pop_front();
+		m_cond.notify_all();
+		return true;
+	}
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+	return false;
+}
+
 cypress::Population<SpikeSourceArray> create_spike_source(
-    Network &netw, const MNIST_DATA &spikes)
+    Network &netw, const SPIKING_MNIST &spikes)
 {
 	size_t size = std::get<0>(spikes).size();
 
@@ -214,13 +483,13 @@ cypress::Population<SpikeSourceArray> create_spike_source(
 	    size, SpikeSourceArrayParameters(), SpikeSourceArraySignals(),
 	    "input_layer");
 	for (size_t nid = 0; nid < size; nid++) {
-		pop[nid].parameters().spike_times(std::get<0>(spikes)[nid]);
+		pop[nid].parameters().spike_times(std::get<0>(spikes).train(nid));
 	}
 	return pop;
 }
 
 cypress::Population<SpikeSourceArray> &update_spike_source(
-    cypress::Population<SpikeSourceArray> &source, const MNIST_DATA &spikes)
+    cypress::Population<SpikeSourceArray> &source, const SPIKING_MNIST &spikes)
 {
 	size_t size = std::get<0>(spikes).size();
 
@@ -229,7 +498,7 @@ cypress::Population<SpikeSourceArray> &update_spike_source(
 		    "Spike source array size does not equal image size!");
 	}
 	for (size_t nid = 0; nid < size; nid++) {
-		source[nid].parameters().spike_times(std::get<0>(spikes)[nid]);
+		source[nid].parameters().spike_times(std::get<0>(spikes).train(nid));
 	}
 	return source;
 }
@@ -264,22 +533,304 @@ Json read_network(std::string path, bool msgpack)
 	return json;
 }
 
-std::vector<LocalConnection> dense_weights_to_conn(const Matrix<Real> &mat,
-                                                   Real scale, Real delay)
+namespace {
+const char network_magic[8] = {'S', 'N', 'A', 'B', 'N', 'E', 'T', 'W'};
+const uint32_t network_version = 1;
+const size_t network_header = 24;
+static_assert(sizeof(NetworkFile::Layer) % 8 == 0,
+              "Layer records have to keep the weights aligned");
+}  // namespace
+
+NetworkFile::NetworkFile(const std::string &path)
 {
-	std::vector<LocalConnection> conns;
+	m_data = map_readonly(path, m_size);
+	auto invalid = [&](const std::string &reason) {
+		if (m_data) {
+			munmap(const_cast<uint8_t *>(m_data), m_size);
+		}
+		return std::runtime_error("Invalid network file " + path + ": " +
+		                          reason);
+	};
+	if (m_size < network_header ||
+	    !std::equal(network_magic, network_magic + 8, m_data)) {
+		throw invalid("wrong magic number");
+	}
+	const uint32_t *header = reinterpret_cast<const uint32_t *>(m_data + 8);
+	if (header[0] != network_version || header[2] != sizeof(Real)) {
+		throw invalid("unsupported version or number format");
+	}
+	m_layers = header[1];
+	if (network_header + m_layers * sizeof(Layer) > m_size) {
+		throw invalid("truncated layer table");
+	}
+	for (size_t i = 0; i < m_layers; i++) {
+		const auto &l = layer(i);
+		if (l.type > LAYER_TYPE::Pooling || l.offset % 8 != 0 ||
+		    l.offset > m_size || l.count > (m_size - l.offset) / sizeof(Real)) {
+			throw invalid("corrupt layer " + std::to_string(i));
+		}
+		size_t expected = 0;
+		if (l.type == LAYER_TYPE::Dense) {
+			expected = l.shape[0] * l.shape[1];
+		}
+		else if (l.type == LAYER_TYPE::Conv) {
+			expected = l.shape[0] * l.shape[1] * l.shape[2] * l.shape[3];
+		}
+		if (l.count != expected || (l.type != LAYER_TYPE::Dense &&
+		                            l.stride == 0)) {
+			throw invalid("corrupt layer " + std::to_string(i));
+		}
+	}
+}
+
+NetworkFile::NetworkFile(NetworkFile &&other) noexcept
+    : m_data(other.m_data), m_size(other.m_size), m_layers(other.m_layers)
+{
+	other.m_data = nullptr;
+	other.m_size = 0;
+	other.m_layers = 0;
+}
+
+NetworkFile::~NetworkFile()
+{
+	if (m_data) {
+		munmap(const_cast<uint8_t *>(m_data), m_size);
+	}
+}
+
+bool NetworkFile::is_network_file(const std::string &path)
+{
+	std::ifstream file_in(path, std::ios::binary);
+	char magic[8];
+	if (!file_in.read(magic, 8)) {
+		return false;
+	}
+	return std::equal(network_magic, network_magic + 8, magic);
+}
+
+namespace {
+void flatten_json(const Json &json, std::vector<Real> &res)
+{
+	if (!json.is_array()) {
+		res.push_back(json.get<Real>());
+		return;
+	}
+	for (const auto &i : json) {
+		flatten_json(i, res);
+	}
+}
+}  // namespace
+
+void write_network_file(const Json &data, const std::string &path)
+{
+	std::vector<NetworkFile::Layer> layers;
+	std::vector<std::vector<Real>> weights;
+	for (const auto &json : data.at("netw")) {
+		NetworkFile::Layer layer = {};
+		std::vector<Real> w;
+		const auto class_name = json.at("class_name").get<std::string>();
+		if (class_name == "Dense") {
+			const auto &mat = json.at("weights");
+			layer.type = LAYER_TYPE::Dense;
+			layer.shape[0] = mat.size();
+			layer.shape[1] = mat.at(0).size();
+			flatten_json(mat, w);
+		}
+		else if (class_name == "Conv2D") {
+			const auto &filter = json.at("weights");
+			layer.type = LAYER_TYPE::Conv;
+			layer.shape[0] = filter.size();
+			layer.shape[1] = filter.at(0).size();
+			layer.shape[2] = filter.at(0).at(0).size();
+			layer.shape[3] = filter.at(0).at(0).at(0).size();
+			layer.stride = json.at("stride").get<size_t>();
+			layer.padding = json.at("padding") == "valid" ? 0 : 1;
+			if (json.find("input_shape_x") != json.end() &&
+			    !json["input_shape_x"].is_null()) {
+				layer.input_shape[0] = json["input_shape_x"].get<size_t>();
+				layer.input_shape[1] = json["input_shape_y"].get<size_t>();
+				layer.input_shape[2] = json["input_shape_z"].get<size_t>();
+			}
+			flatten_json(filter, w);
+		}
+		else if (class_name == "MaxPooling2D") {
+			auto size = json.at("size").get<std::vector<size_t>>();
+			layer.type = LAYER_TYPE::Pooling;
+			layer.shape[0] = size.at(0);
+			layer.shape[1] = size.at(1);
+			layer.stride = json.at("stride").get<size_t>();
+		}
+		else {
+			throw std::runtime_error("Unknown layer type " + class_name);
+		}
+		layer.count = w.size();
+		layers.push_back(layer);
+		weights.emplace_back(std::move(w));
+	}
+
+	uint64_t offset = network_header + layers.size() * sizeof(NetworkFile::Layer);
+	for (auto &layer : layers) {
+		layer.offset = offset;
+		offset += layer.count * sizeof(Real);
+	}
+	std::ofstream file_out(path, std::ios::binary);
+	uint32_t header[4] = {network_version, uint32_t(layers.size()),
+	                      uint32_t(sizeof(Real)), 0};
+	file_out.write(network_magic, 8);
+	file_out.write(reinterpret_cast<const char *>(header), sizeof(header));
+	file_out.write(reinterpret_cast<const char *>(layers.data()),
+	               layers.size() * sizeof(NetworkFile::Layer));
+	for (const auto &w : weights) {
+		file_out.write(reinterpret_cast<const char *>(w.data()),
+		               w.size() * sizeof(Real));
+	}
+	if (!file_out.good()) {
+		throw std::runtime_error("Could not write network file " + path);
+	}
+}
+
+std::string network_path(const std::string &path)
+{
+	std::ifstream file_in(path, std::ios::binary);
+	if (file_in.good()) {
+		return path;
+	}
+	file_in.open("../" + path, std::ios::binary);
+	if (file_in.good()) {
+		return "../" + path;
+	}
+	throw std::runtime_error("Could not open deep network file " + path);
+}
+
+std::string file_hash(const std::string &path)
+{
+	std::ifstream file_in(path, std::ios::binary);
+	if (!file_in.good()) {
+		throw std::runtime_error("Could not open file " + path);
+	}
+	uint64_t hash = 14695981039346656037ull;
+	std::array<char, 1 << 16> buffer;
+	while (file_in) {
+		file_in.read(buffer.data(), buffer.size());
+		for (std::streamsize i = 0; i < file_in.gcount(); i++) {
+			hash ^= uint64_t(uint8_t(buffer[i]));
+			hash *= 1099511628211ull;
+		}
+	}
+	char res[17];
+	snprintf(res, sizeof(res), "%016llx", (unsigned long long)hash);
+	return std::string(res);
+}
+
+namespace {
+Json read_scale_cache(const std::string &cache)
+{
+	std::ifstream file_in(cache);
+	if (!file_in.good()) {
+		return Json();
+	}
+	try {
+		return Json::parse(file_in);
+	}
+	catch (...) {
+		global_logger().warn("SNABSuite",
+		                     "Ignoring corrupt scale factor cache " + cache);
+		return Json();
+	}
+}
+}  // namespace
+
+bool load_scale_factors(const std::string &cache, const std::string &hash,
+                        const std::string &key, std::vector<Real> &factors)
+{
+	Json json = read_scale_cache(cache);
+	if (!json.is_object() || json.find("hash") == json.end() ||
+	    json["hash"] != hash || json.find("factors") == json.end() ||
+	    json["factors"].find(key) == json["factors"].end()) {
+		return false;
+	}
+	factors = json["factors"][key].get<std::vector<Real>>();
+	return true;
+}
+
+void store_scale_factors(const std::string &cache, const std::string &hash,
+                         const std::string &key,
+                         const std::vector<Real> &factors)
+{
+	Json json = read_scale_cache(cache);
+	if (!json.is_object() || json.find("hash") == json.end() ||
+	    json["hash"] != hash) {
+		json = Json();
+		json["hash"] = hash;
+	}
+	json["factors"][key] = factors;
+
+	// Write to a temporary file first, concurrent runs only ever see
+	// complete cache files
+	std::string tmp = cache + ".tmp" + std::to_string(getpid());
+	{
+		std::ofstream file_out(tmp);
+		file_out << json.dump(4);
+		if (!file_out.good()) {
+			global_logger().warn("SNABSuite",
+			                     "Could not write scale factor cache " + tmp);
+			return;
+		}
+	}
+	if (std::rename(tmp.c_str(), cache.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		global_logger().warn("SNABSuite",
+		                     "Could not write scale factor cache " + cache);
+	}
+}
+
+void fill_dense_conns(const Matrix<Real> &mat, Real scale, Real delay,
+                      Real threshold, std::vector<LocalConnection> &conns,
+                      size_t *pruned)
+{
+	// Count the surviving synapses per row first, so that the list is
+	// allocated at most once
+	std::vector<size_t> row_ptr(mat.rows() + 1, 0);
+	for (size_t i = 0; i < mat.rows(); i++) {
+		size_t kept = 0;
+		for (size_t j = 0; j < mat.cols(); j++) {
+			if (!prune_weight(mat(i, j), threshold)) {
+				kept++;
+			}
+		}
+		row_ptr[i + 1] = row_ptr[i] + kept;
+	}
+	conns.clear();
+	conns.reserve(row_ptr.back());
 	for (size_t i = 0; i < mat.rows(); i++) {
+		if (row_ptr[i + 1] == row_ptr[i]) {
+			continue;
+		}
 		for (size_t j = 0; j < mat.cols(); j++) {
 			Real w = mat(i, j);
-			conns.emplace_back(LocalConnection(i, j, scale * w, delay));
+			if (!prune_weight(w, threshold)) {
+				conns.emplace_back(LocalConnection(i, j, scale * w, delay));
+			}
 		}
 	}
+	if (pruned) {
+		*pruned = mat.size() - conns.size();
+	}
+}
+
+std::vector<LocalConnection> dense_weights_to_conn(const Matrix<Real> &mat,
+                                                   Real scale, Real delay,
+                                                   Real threshold,
+                                                   size_t *pruned)
+{
+	std::vector<LocalConnection> conns;
+	fill_dense_conns(mat, scale, delay, threshold, conns, pruned);
 	return conns;
 }
 
 std::vector<LocalConnection> conv_weights_to_conn(
     const mnist_helper::CONVOLUTION_LAYER &layer,
-    Real scale, Real delay)
+    Real scale, Real delay, Real threshold, size_t *pruned)
 {
     std::vector<LocalConnection> conns;
 	size_t stride = layer.stride;
@@ -289,26 +840,45 @@ std::vector<LocalConnection> conv_weights_to_conn(
 	size_t max_x = layer.input_sizes[0] - kernel_size_x + 1;
     size_t max_y = layer.input_sizes[1] - kernel_size_y + 1;
 
+	// Every kernel position shares the same filter, so the surviving kernel
+	// entries are collected once
+	std::vector<std::array<size_t, 4>> kept;
+	size_t total = 0;
+	for (size_t filter = 0; filter < layer.output_sizes[2]; filter++) {
+		for (size_t x = 0; x < kernel_size_x; x++) {
+			for (size_t y = 0; y < kernel_size_y; y++) {
+				for (size_t z = 0; z < kernel_size_z; z++) {
+					total++;
+					if (!prune_weight(layer.filter[x][y][z][filter],
+					                  threshold)) {
+						kept.push_back({filter, x, y, z});
+					}
+				}
+			}
+		}
+	}
+	size_t positions = ((max_x + stride - 1) / stride) *
+	                   ((max_y + stride - 1) / stride);
+	conns.reserve(positions * kept.size());
+
     for (size_t i = 0; i < max_x; i += stride) {
         for (size_t j = 0; j < max_y; j += stride) {
-            for (size_t filter = 0; filter < layer.output_sizes[2]; filter++){
-                for (size_t x = 0; x < kernel_size_x; x++) {
-                    for (size_t y = 0; y < kernel_size_y; y++) {
-                        for (size_t z = 0; z < kernel_size_z; z++) {
-                            conns.emplace_back((LocalConnection(
-                                (i + x) * layer.input_sizes[1] * layer.input_sizes[2] +
-                                (j + y) * layer.input_sizes[2] +
-                                z,
-                                i * layer.output_sizes[2] * layer.output_sizes[1] +
-                                j * layer.output_sizes[2] +
-                                filter,
-                                scale * layer.filter[x][y][z][filter], delay)));
-						}
-                    }
-                }
+            for (const auto &k : kept) {
+                size_t filter = k[0], x = k[1], y = k[2], z = k[3];
+                conns.emplace_back((LocalConnection(
+                    (i + x) * layer.input_sizes[1] * layer.input_sizes[2] +
+                    (j + y) * layer.input_sizes[2] +
+                    z,
+                    i * layer.output_sizes[2] * layer.output_sizes[1] +
+                    j * layer.output_sizes[2] +
+                    filter,
+                    scale * layer.filter[x][y][z][filter], delay)));
             }
         }
     }
+	if (pruned) {
+		*pruned = positions * (total - kept.size());
+	}
     return conns;
 }
 
@@ -358,120 +928,127 @@ std::vector<std::vector<LocalConnection>> pool_to_conn(
 	return conns;
 }
 
-std::vector<uint16_t> spikes_to_labels(const PopulationBase &pop, Real duration,
-                                       Real pause, size_t batch_size, bool ttfs)
+SpikeBins::SpikeBins(size_t neurons, Real duration, Real pause,
+                     size_t batch_size, bool ttfs)
+    : m_neurons(neurons),
+      m_samples(batch_size),
+      m_duration(duration),
+      m_start(ttfs ? 0.0 : -pause * 0.5),
+      m_bin_size(duration + pause),
+      m_ttfs(ttfs),
+      m_best(batch_size, ttfs ? std::numeric_limits<Real>::max() : 0.0),
+      m_labels(batch_size, std::numeric_limits<uint16_t>::max())
 {
-	std::vector<uint16_t> res(batch_size);
-	if (!ttfs) {
-		std::vector<std::vector<uint16_t>> binned_spike_counts;
-		for (const auto &neuron : pop) {
-			binned_spike_counts.push_back(
-			    SpikingUtils::spike_time_binning<uint16_t>(
-			        -pause * 0.5,
-			        batch_size * (duration + pause) - (pause * 0.5), batch_size,
-			        neuron.signals().data(0)));
-		}
-
-		for (size_t sample = 0; sample < batch_size; sample++) {
-			uint16_t max = 0;
-			uint16_t index = std::numeric_limits<uint16_t>::max();
-			for (size_t neuron = 0; neuron < binned_spike_counts.size();
-			     neuron++) {
-				if (binned_spike_counts[neuron][sample] > max) {
-					index = neuron;
-					max = binned_spike_counts[neuron][sample];
-				}
-				else if (binned_spike_counts[neuron][sample] == max) {
-					// Multiple neurons have the same decision
-					index = std::numeric_limits<uint16_t>::max();
-				}
-			}
-			res[sample] = index;
-		}
+	if (ttfs) {
+		m_times.assign(neurons * batch_size, std::numeric_limits<Real>::max());
 	}
 	else {
-		std::vector<std::vector<Real>> binned_spike_times;
-		for (const auto &neuron : pop) {
-			binned_spike_times.push_back(SpikingUtils::spike_time_binning_TTFS(
-			    0.0, Real(batch_size) * (duration + pause), batch_size,
-			    neuron.signals().data(0)));
-		}
-
-		for (size_t sample = 0; sample < batch_size; sample++) {
-			Real min = std::numeric_limits<Real>::max();
-			uint16_t index = std::numeric_limits<uint16_t>::max();
-			for (size_t neuron = 0; neuron < binned_spike_times.size();
-			     neuron++) {
-				if (binned_spike_times[neuron][sample] < min) {
-					index = neuron;
-					min = binned_spike_times[neuron][sample];
-				}
-				else if (binned_spike_times[neuron][sample] == min) {
-					// Multiple neurons have the same decision
-					index = std::numeric_limits<uint16_t>::max();
-				}
-			}
-			res[sample] = index;
+		m_counts.assign(neurons * batch_size, 0);
+	}
+}
+
+SpikeBins::SpikeBins(const PopulationBase &pop, Real duration, Real pause,
+                     size_t batch_size, bool ttfs)
+    : SpikeBins(pop.size(), duration, pause, batch_size, ttfs)
+{
+	for (const auto &neuron : pop) {
+		add_train(neuron.signals().data(0));
+	}
+}
+
+void SpikeBins::add_train(const std::vector<Real> &spikes)
+{
+	if (m_added >= m_neurons) {
+		throw std::runtime_error("SpikeBins: too many spike trains!");
+	}
+	size_t neuron = m_added++;
+	Real stop = m_start + Real(m_samples) * m_bin_size;
+	for (auto spike : spikes) {
+		if (spike < m_start) {
+			continue;
+		}
+		if (spike >= stop) {
+			break;
+		}
+		size_t sample = size_t((spike - m_start) / m_bin_size);
+		if (sample >= m_samples) {
+			break;
+		}
+		if (m_ttfs) {
+			Real &time = m_times[sample * m_neurons + neuron];
+			time = std::min(time, spike - m_start - Real(sample) * m_bin_size);
+		}
+		else {
+			m_counts[sample * m_neurons + neuron]++;
+		}
+	}
+
+	// Decision per sample, ties between neurons invalidate the label
+	for (size_t sample = 0; sample < m_samples; sample++) {
+		Real value = m_ttfs ? m_times[sample * m_neurons + neuron]
+		                    : Real(m_counts[sample * m_neurons + neuron]);
+		bool better = m_ttfs ? value < m_best[sample] : value > m_best[sample];
+		if (better) {
+			m_best[sample] = value;
+			m_labels[sample] = neuron;
+		}
+		else if (value == m_best[sample]) {
+			m_labels[sample] = std::numeric_limits<uint16_t>::max();
 		}
 	}
-	return res;
 }
 
-std::vector<std::vector<Real>> spikes_to_rates_ttfs(const PopulationBase pop,
-                                                    Real duration, Real pause,
-                                                    size_t batch_size)
+std::vector<std::vector<Real>> SpikeBins::rates(Real norm) const
 {
-	std::vector<std::vector<Real>> binned_spike_times;
-	std::vector<std::vector<Real>> res(batch_size,
-	                                   std::vector<Real>(pop.size()));
+	std::vector<std::vector<Real>> res(m_samples,
+	                                   std::vector<Real>(m_neurons));
+	for (size_t sample = 0; sample < m_samples; sample++) {
+		const uint16_t *row = m_counts.data() + sample * m_neurons;
+		for (size_t neuron = 0; neuron < m_neurons; neuron++) {
+			res[sample][neuron] =
+			    norm > 0.0 ? Real(row[neuron]) / norm : Real(row[neuron]);
+		}
+	}
+	return res;
+}
 
-	Real new_duration = duration;
-	for (const auto &neuron : pop) {
-		binned_spike_times.push_back(SpikingUtils::spike_time_binning_TTFS(
-		    0.0, Real(batch_size) * (duration + pause), batch_size,
-		    neuron.signals().data(0)));
-	}
-	for (size_t sample = 0; sample < batch_size; sample++) {
-		Real min = std::numeric_limits<Real>::max();
-		// Real max = 0.0;
-		for (size_t neuron = 0; neuron < binned_spike_times.size(); neuron++) {
-			if (binned_spike_times[neuron][sample] < min) {
-				min = binned_spike_times[neuron][sample];
-			}
-			/*if (binned_spike_times[neuron][sample] > max &&
-			    binned_spike_times[neuron][sample] <
-			std::numeric_limits<Real>::max() -10) { max =
-			binned_spike_times[neuron][sample];
-			}*/
-		}
-		// std::cout << "Max - Min for Population " << pop.pid()<< ": "<<
-		// max-min << ", " << max << ", "<<min<<std::endl;
+std::vector<std::vector<Real>> SpikeBins::ttfs_rates() const
+{
+	std::vector<std::vector<Real>> res(m_samples,
+	                                   std::vector<Real>(m_neurons, 0.0));
+	for (size_t sample = 0; sample < m_samples; sample++) {
+		Real min = m_best[sample];
 		if (min == std::numeric_limits<Real>::max()) {
 			// There was no spike
-			for (size_t neuron = 0; neuron < binned_spike_times.size();
-			     neuron++) {
-				res[sample][neuron] = 0.0;
-			}
+			continue;
 		}
-		else {
-			for (size_t neuron = 0; neuron < binned_spike_times.size();
-			     neuron++) {
-				// Substract min --> first spike is zero, last spike might be
-				// larger then duration
-				Real tmp = binned_spike_times[neuron][sample] - min;
-				if (tmp >= new_duration) {
-					res[sample][neuron] = 0.0;
-				}
-				else {
-					res[sample][neuron] = 1.0 - (tmp / new_duration);
-					assert(res[sample][neuron] > 0);
-				}
+		const Real *row = m_times.data() + sample * m_neurons;
+		for (size_t neuron = 0; neuron < m_neurons; neuron++) {
+			// Substract min --> first spike is zero, last spike might be
+			// larger then duration
+			Real tmp = row[neuron] - min;
+			if (tmp < m_duration) {
+				res[sample][neuron] = 1.0 - (tmp / m_duration);
+				assert(res[sample][neuron] > 0);
 			}
 		}
 	}
 	return res;
 }
 
+std::vector<uint16_t> spikes_to_labels(const PopulationBase &pop, Real duration,
+                                       Real pause, size_t batch_size, bool ttfs)
+{
+	return SpikeBins(pop, duration, pause, batch_size, ttfs).labels();
+}
+
+std::vector<std::vector<Real>> spikes_to_rates_ttfs(const PopulationBase pop,
+                                                    Real duration, Real pause,
+                                                    size_t batch_size)
+{
+	return SpikeBins(pop, duration, pause, batch_size, true).ttfs_rates();
+}
+
 void conv_spikes_per_kernel(const std::string& filename, const PopulationBase& pop,
                             Real duration, Real pause, size_t batch_size, Real norm)
 {
@@ -504,33 +1081,7 @@ std::vector<std::vector<Real>> spikes_to_rates(const PopulationBase pop,
                                                Real duration, Real pause,
                                                size_t batch_size, Real norm)
 {
-	std::vector<std::vector<Real>> res(batch_size,
-	                                   std::vector<Real>(pop.size()));
-	std::vector<std::vector<uint16_t>> binned_spike_counts;
-	for (const auto &neuron : pop) {
-		binned_spike_counts.push_back(
-		    SpikingUtils::spike_time_binning<uint16_t>(
-		        -pause * 0.5, batch_size * (duration + pause) - (pause * 0.5),
-		        batch_size, neuron.signals().data(0)));
-	}
-	if (norm > 0.0) {
-		for (size_t sample = 0; sample < batch_size; sample++) {
-			for (size_t neuron = 0; neuron < binned_spike_counts.size();
-			     neuron++) {
-				res[sample][neuron] =
-				    Real(binned_spike_counts[neuron][sample]) / norm;
-			}
-		}
-	}
-	else {
-		for (size_t sample = 0; sample < batch_size; sample++) {
-			for (size_t neuron = 0; neuron < binned_spike_counts.size();
-			     neuron++) {
-				res[sample][neuron] = Real(binned_spike_counts[neuron][sample]);
-			}
-		}
-	}
-	return res;
+	return SpikeBins(pop, duration, pause, batch_size).rates(norm);
 }
 
 size_t compare_labels(std::vector<uint16_t> &label, std::vector<uint16_t> &res)
@@ -581,13 +1132,15 @@ std::vector<Real> av_pooling_image(std::vector<Real> &image, size_t height,
 	return res;
 }
 
-MNIST_DATA scale_mnist(MNIST_DATA &data, size_t pooling_size)
+MNIST_DATA scale_mnist(const MnistView &data, size_t pooling_size)
 {
 	MNIST_DATA res;
-	std::get<1>(res) = std::get<1>(data);
 	auto &tar_images = std::get<0>(res);
-	for (auto &image : std::get<0>(data)) {
+	std::vector<Real> image(data.pixels());
+	for (size_t i = 0; i < data.size(); i++) {
+		data.image(i, image.data());
 		tar_images.emplace_back(av_pooling_image(image, 28, 28, pooling_size));
+		std::get<1>(res).push_back(data.label(i));
 	}
 	return res;
 }
@@ -611,33 +1164,48 @@ SPIKING_MNIST read_data_to_spike(const size_t num_images, bool train_data,
 }
 
 std::vector<LocalConnection> conns_from_mat(
-    const cypress::Matrix<Real> &weights, Real delay, Real scale_factor)
-{
-	std::vector<LocalConnection> res;
-	if (scale_factor > 0) {
-		for (size_t i = 0; i < weights.rows(); i++) {
-			for (size_t j = 0; j < weights.cols(); j++) {
-				res.emplace_back(
-				    LocalConnection(i, j, weights(i, j) * scale_factor, delay));
-			}
-		}
-		return res;
-	}
-	for (size_t i = 0; i < weights.rows(); i++) {
-		for (size_t j = 0; j < weights.cols(); j++) {
-			res.emplace_back(LocalConnection(i, j, weights(i, j), delay));
-		}
-	}
-	return res;
+    const cypress::Matrix<Real> &weights, Real delay, Real scale_factor,
+    Real threshold)
+{
+	return dense_weights_to_conn(weights, scale_factor > 0 ? scale_factor : 1.0,
+	                             delay, threshold);
 }
 
 void update_conns_from_mat(const std::vector<cypress::Matrix<Real>> &weights,
-                           Network &netw, Real delay, Real scale_factor)
+                           Network &netw, Real delay, Real scale_factor,
+                           const std::vector<Real> &thresholds)
 {
+	ConnectionUpdater(delay, scale_factor, thresholds).update(weights, netw);
+}
+
+void ConnectionUpdater::reset(const std::vector<cypress::Matrix<Real>> &weights)
+{
+	m_sent = weights;
+}
+
+size_t ConnectionUpdater::update(
+    const std::vector<cypress::Matrix<Real>> &weights, Network &netw)
+{
+	if (m_sent.size() != weights.size()) {
+		m_sent.clear();
+		m_sent.resize(weights.size());
+	}
+	size_t updated = 0;
 	for (size_t i = 0; i < weights.size(); i++) {
-		netw.update_connection(Connector::from_list(conns_from_mat(
-		                           weights[i], delay, scale_factor)),
+		const auto &mat = weights[i];
+		auto &sent = m_sent[i];
+		if (sent.rows() == mat.rows() && sent.cols() == mat.cols() &&
+		    std::equal(mat.begin(), mat.end(), sent.begin())) {
+			continue;
+		}
+		Real threshold = i < m_thresholds.size() ? m_thresholds[i] : -1.0;
+		fill_dense_conns(mat, m_scale_factor > 0 ? m_scale_factor : 1.0,
+		                 m_delay, threshold, m_buffer);
+		netw.update_connection(Connector::from_list(m_buffer),
 		                       ("dense_" + std::to_string(i)).c_str());
+		sent = mat;
+		updated++;
 	}
+	return updated;
 }
 }  // namespace mnist_helper
@@ -18,11 +18,21 @@
 #pragma once
 #include <assert.h>
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cypress/cypress.hpp>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>  //std::pair
 
 namespace mnist_helper {
@@ -30,9 +40,113 @@ using namespace cypress;
 
 typedef std::pair<std::vector<std::vector<Real>>, std::vector<uint16_t>>
     MNIST_DATA;
-typedef std::pair<std::vector<std::vector<std::vector<Real>>>,
-                  std::vector<uint16_t>>
-    SPIKING_MNIST;
+
+/**
+ * @brief Flat (CSR-like) container for spike trains. All spike times are
+ * stored in one contiguous array, an offset array marks the start of every
+ * train. Trains are grouped into blocks of block_size() trains, e.g. one block
+ * per image with one train per pixel.
+ */
+class SpikeStore {
+public:
+	SpikeStore(size_t block_size = 1) : m_block_size(block_size) {}
+
+	size_t size() const { return m_offsets.size() - 1; }
+	size_t block_size() const { return m_block_size; }
+	size_t blocks() const { return m_block_size ? size() / m_block_size : 0; }
+	size_t spike_count() const { return m_times.size(); }
+
+	void reserve(size_t trains, size_t spikes)
+	{
+		m_offsets.reserve(trains + 1);
+		m_times.reserve(spikes);
+	}
+
+	/**
+	 * @brief Appends a spike to the train that is currently filled
+	 */
+	void add_spike(Real time) { m_times.push_back(time); }
+
+	/**
+	 * @brief Finishes the current train, following spikes go to the next one
+	 */
+	void close_train() { m_offsets.push_back(m_times.size()); }
+
+	/**
+	 * @brief Appends a complete train
+	 */
+	template <typename Iterator>
+	void push_back(Iterator begin, Iterator end)
+	{
+		m_times.insert(m_times.end(), begin, end);
+		close_train();
+	}
+	void push_back(const std::vector<Real> &train)
+	{
+		push_back(train.begin(), train.end());
+	}
+
+	const Real *begin(size_t train) const
+	{
+		return m_times.data() + m_offsets[train];
+	}
+	const Real *end(size_t train) const
+	{
+		return m_times.data() + m_offsets[train + 1];
+	}
+	size_t count(size_t train) const
+	{
+		return m_offsets[train + 1] - m_offsets[train];
+	}
+
+	/**
+	 * @brief Access to train @param train of block @param block
+	 */
+	const Real *begin(size_t block, size_t train) const
+	{
+		return begin(block * m_block_size + train);
+	}
+	const Real *end(size_t block, size_t train) const
+	{
+		return end(block * m_block_size + train);
+	}
+	size_t count(size_t block, size_t train) const
+	{
+		return count(block * m_block_size + train);
+	}
+
+	/**
+	 * @brief Copy of a single train, e.g. for handing it to cypress
+	 */
+	std::vector<Real> train(size_t train) const
+	{
+		return std::vector<Real>(begin(train), end(train));
+	}
+
+	/**
+	 * @brief Copy of all trains in nested form
+	 */
+	std::vector<std::vector<Real>> to_vector() const
+	{
+		std::vector<std::vector<Real>> res;
+		for (size_t i = 0; i < size(); i++) {
+			res.emplace_back(train(i));
+		}
+		return res;
+	}
+
+private:
+	size_t m_block_size;
+	std::vector<Real> m_times;
+	std::vector<size_t> m_offsets = {0};
+};
+
+/**
+ * @brief Spiking images with labels. Block i of the store contains the
+ * spike trains of all pixels of image i. A batch (see create_batches) is a
+ * single block containing the spikes of all its images.
+ */
+typedef std::pair<SpikeStore, std::vector<uint16_t>> SPIKING_MNIST;
 typedef std::vector<std::vector<std::vector<std::vector<Real>>>>
     CONVOLUTION_FILTER;
 struct CONVOLUTION_LAYER {
@@ -51,6 +165,120 @@ struct POOLING_LAYER {
 };
 typedef struct POOLING_LAYER POOLING_LAYER;
 enum LAYER_TYPE {Dense, Conv, Pooling};
+/**
+ * @brief Read-only memory mapping of a pair of MNIST IDX files. Images stay a
+ * contiguous uint8 tensor (image, row, column) backed by the page cache,
+ * nothing is copied before images are normalized to [0, 1].
+ */
+class MnistIdx {
+public:
+	/**
+	 * @brief Maps the image and label file and checks their headers
+	 *
+	 * @param path path to file, without end, e.g. /path/to/data/train
+	 * @param num_data Number of images to use, 0 uses all images in the file
+	 */
+	MnistIdx(const std::string &path, size_t num_data = 0);
+	MnistIdx(const MnistIdx &) = delete;
+	MnistIdx &operator=(const MnistIdx &) = delete;
+	MnistIdx(MnistIdx &&other) noexcept;
+	~MnistIdx();
+
+	size_t size() const { return m_size; }
+	size_t rows() const { return m_rows; }
+	size_t cols() const { return m_cols; }
+	size_t pixels() const { return m_rows * m_cols; }
+
+	/**
+	 * @brief Raw pixels of image i, pixels() bytes
+	 */
+	const uint8_t *image(size_t i) const
+	{
+		return m_images.data + 16 + i * pixels();
+	}
+	uint16_t label(size_t i) const { return m_labels.data[8 + i]; }
+
+	/**
+	 * @brief Converts n consecutive images starting at image start to Real
+	 * values in [0, 1]
+	 *
+	 * @param start first image
+	 * @param n number of images
+	 * @param out output buffer of size n * pixels()
+	 */
+	void normalize(size_t start, size_t n, Real *out) const;
+
+	/**
+	 * @brief Converts image i to Real values in [0, 1]
+	 */
+	std::vector<Real> normalize(size_t i) const;
+
+private:
+	struct Mapping {
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+	};
+	Mapping m_images, m_labels;
+	size_t m_size = 0, m_rows = 0, m_cols = 0;
+
+	static Mapping map_file(const std::string &file);
+	static void unmap(Mapping &mapping);
+};
+
+/**
+ * @brief Read-only view of a data set, either a mapped MnistIdx (normalized
+ * on access) or images already converted to Real, e.g. by scale_mnist. Cheap
+ * to copy, the viewed data has to outlive the view.
+ */
+class MnistView {
+public:
+	MnistView(const MnistIdx &idx) : m_idx(&idx) {}
+	MnistView(const MNIST_DATA &data) : m_data(&data) {}
+
+	size_t size() const
+	{
+		return m_idx ? m_idx->size() : std::get<0>(*m_data).size();
+	}
+
+	/**
+	 * @brief Number of pixels of every image
+	 */
+	size_t pixels() const
+	{
+		if (m_idx) {
+			return m_idx->pixels();
+		}
+		return size() ? std::get<0>(*m_data)[0].size() : 0;
+	}
+
+	uint16_t label(size_t i) const
+	{
+		return m_idx ? m_idx->label(i) : std::get<1>(*m_data)[i];
+	}
+
+	/**
+	 * @brief Writes image i with values in [0, 1] to out (pixels() values)
+	 */
+	void image(size_t i, Real *out) const
+	{
+		if (m_idx) {
+			m_idx->normalize(i, 1, out);
+			return;
+		}
+		const auto &img = std::get<0>(*m_data)[i];
+		std::copy(img.begin(), img.end(), out);
+	}
+
+private:
+	const MnistIdx *m_idx = nullptr;
+	const MNIST_DATA *m_data = nullptr;
+};
+
+/**
+ * @brief Converts all images of a mapped data set to Real values
+ */
+MNIST_DATA to_mnist_data(const MnistIdx &idx);
+
 /**
  * @brief Read in MNIST data from files
  *
@@ -78,9 +306,9 @@ void print_image(const std::vector<Real> &img, size_t wrap);
  * @param max_freq maximal rate/frequency
  * @param num_images number of images to read in
  * @param poisson False: regular spiking. True: poisson rates. Defaults to true.
- * @return vector (images) of vector (pixel) of spikes
+ * @return spike store with one block (image) of spike trains (pixel)
  */
-std::vector<std::vector<std::vector<Real>>> image_to_rate(
+SpikeStore image_to_rate(
     const std::vector<std::vector<Real>> &images, const Real duration,
     const Real max_freq, size_t num_images, bool poisson = true);
 
@@ -92,10 +320,9 @@ std::vector<std::vector<std::vector<Real>>> image_to_rate(
  * @param duration duration of the rate
  * @param max_freq maximal rate/frequency
  * @param num_images number of images to read in
- * @param poisson False: regular spiking. True: poisson rates. Defaults to true.
- * @return vector (images) of vector (pixel) of spikes
+ * @return spike store with one block (image) of spike trains (pixel)
  */
-std::vector<std::vector<std::vector<Real>>> image_to_TTFS(
+SpikeStore image_to_TTFS(
     const std::vector<std::vector<Real>> &images, const Real duration,
     size_t num_images);
 
@@ -125,14 +352,104 @@ SPIKING_MNIST mnist_to_spike(const MNIST_DATA &mnist_data, const Real duration,
  * @param shuffle True for shuffling images. Defaults to false.
  * @param seed Seed for shuffling images Defaults to 0.
  * @return A vector of spike batches, every vector entry gives a container.
- * std::get<0> give spikes for every pixel representing all images in one batch,
- * std::get<1> returns labels
+ * std::get<0> is a single block with spikes for every pixel representing all
+ * images in one batch, std::get<1> returns labels
  */
-std::vector<MNIST_DATA> create_batches(const SPIKING_MNIST &mnist_data,
+std::vector<SPIKING_MNIST> create_batches(const SPIKING_MNIST &mnist_data,
                                        const size_t batch_size, Real duration,
                                        Real pause, const bool shuffle = false,
                                        unsigned seed = 0);
 
+/**
+ * @brief Encodes a single batch of images directly into the batch layout of
+ * create_batches, without converting the full data set first
+ *
+ * @param mnist_data data set, mapped (MnistIdx) or converted
+ * @param indices (shuffled) image indices
+ * @param start the batch contains images indices[start] until
+ * indices[start + n - 1]
+ * @param n number of images in the batch
+ * @param duration duration of every image
+ * @param max_freq Maximal rate (e.g. for px = 1)
+ * @param pause time in between images
+ * @param poisson False: regular spiking. True: poisson rates.
+ * @param ttfs use time-to-first-spike encoding. Invalidates poisson.
+ * @param poisson_seed if not 0, the poisson spike trains of every image are
+ * drawn from a generator seeded with this seed and the index of the image.
+ * Encoding an image again then gives the same spike trains.
+ * @return batch with a single block of spikes and the labels
+ */
+SPIKING_MNIST encode_batch(const MnistView &mnist_data,
+                           const std::vector<size_t> &indices, size_t start,
+                           size_t n, Real duration, Real max_freq, Real pause,
+                           bool poisson, bool ttfs, unsigned poisson_seed = 0);
+
+/**
+ * @brief Produces the spike batches of a data set on a background thread.
+ * Batch k+1 is encoded while batch k is used (e.g. simulated); at most
+ * "depth" encoded batches are kept in memory at any time. The data set has
+ * to outlive the stream.
+ */
+class SpikeBatchStream {
+public:
+	/**
+	 * @brief Starts encoding in the background
+	 *
+	 * @param mnist_data data set, mapped (MnistIdx) or converted
+	 * @param num_images number of images to use
+	 * @param batch_size number of images per batch
+	 * @param duration duration of every image
+	 * @param max_freq Maximal rate (e.g. for px = 1)
+	 * @param pause time in between images
+	 * @param poisson False: regular spiking. True: poisson rates.
+	 * @param ttfs use time-to-first-spike encoding. Invalidates poisson.
+	 * @param shuffle True for shuffling images
+	 * @param seed Seed for shuffling images, 0 uses the current time
+	 * @param depth maximal number of prefetched batches
+	 * @param poisson_seed Seed for the poisson spike trains, see
+	 * encode_batch(). Streams with the same seed present every image with the
+	 * same spike trains. 0 draws new spike trains.
+	 */
+	SpikeBatchStream(const MnistView &mnist_data, size_t num_images,
+	                 size_t batch_size, Real duration, Real max_freq,
+	                 Real pause, bool poisson, bool ttfs, bool shuffle = false,
+	                 unsigned seed = 0, size_t depth = 2,
+	                 unsigned poisson_seed = 0);
+	SpikeBatchStream(const SpikeBatchStream &) = delete;
+	SpikeBatchStream &operator=(const SpikeBatchStream &) = delete;
+	~SpikeBatchStream();
+
+	/**
+	 * @brief Total number of batches in the stream
+	 */
+	size_t batches() const { return m_batches; }
+
+	/**
+	 * @brief Waits for the next batch
+	 *
+	 * @param batch is set to the next batch
+	 * @return false if all batches have been consumed
+	 */
+	bool next(SPIKING_MNIST &batch);
+
+private:
+	MnistView m_data;
+	std::vector<size_t> m_indices;
+	size_t m_batch_size, m_batches, m_depth;
+	Real m_duration, m_max_freq, m_pause;
+	bool m_poisson, m_ttfs;
+	unsigned m_poisson_seed;
+
+	std::deque<SPIKING_MNIST> m_queue;
+	bool m_done = false, m_stop = false;
+	std::exception_ptr m_error;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::thread m_thread;
+
+	void produce();
+};
+
 /**
  * @brief Creates Spike sources in network from spikes
  *
@@ -141,7 +458,7 @@ std::vector<MNIST_DATA> create_batches(const SPIKING_MNIST &mnist_data,
  * @return SpikeSourceArray Population
  */
 cypress::Population<SpikeSourceArray> create_spike_source(
-    Network &netw, const MNIST_DATA &spikes);
+    Network &netw, const SPIKING_MNIST &spikes);
 
 /**
  * @brief Update Spike sources in network from spikes
@@ -151,7 +468,7 @@ cypress::Population<SpikeSourceArray> create_spike_source(
  * @return SpikeSourceArray Population
  */
 cypress::Population<SpikeSourceArray> &update_spike_source(
-    cypress::Population<SpikeSourceArray> &source, const MNIST_DATA &spikes);
+    cypress::Population<SpikeSourceArray> &source, const SPIKING_MNIST &spikes);
 
 /**
  * @brief Read in the network file from json of msgpack. The Repo provides a
@@ -163,6 +480,175 @@ cypress::Population<SpikeSourceArray> &update_spike_source(
  */
 Json read_network(std::string path, bool msgpack = true);
 
+/**
+ * @brief Read-only memory mapping of a network in the native binary format
+ * written by write_network_file. The weights of every layer are a contiguous
+ * Real tensor in host byte order, in the same index order as in the json
+ * format (dense: input x output, conv: kernel x, y, z, filter), so they can be
+ * copied block-wise without any parsing.
+ *
+ * Layout: 24 byte header ("SNABNETW", version, #layers, sizeof(Real), 0),
+ * one Layer record per layer, followed by the weights. All offsets are
+ * multiples of 8 byte.
+ */
+class NetworkFile {
+public:
+	struct Layer {
+		uint32_t type;            // LAYER_TYPE
+		uint32_t padding;         // Conv: 0 for "valid", 1 otherwise
+		uint64_t stride;          // Conv and pooling
+		uint64_t shape[4];        // Dense: rows, cols; Conv: x, y, z, filters;
+		                          // Pooling: size x, y
+		uint64_t input_shape[3];  // Conv: input (x, y, z), 0 if given by the
+		                          // previous layer
+		uint64_t offset;          // Byte offset of the weights in the file
+		uint64_t count;           // Number of weights
+	};
+
+	/**
+	 * @brief Maps the file and checks header and layer table
+	 *
+	 * @param path full path to the file
+	 */
+	NetworkFile(const std::string &path);
+	NetworkFile(const NetworkFile &) = delete;
+	NetworkFile &operator=(const NetworkFile &) = delete;
+	NetworkFile(NetworkFile &&other) noexcept;
+	~NetworkFile();
+
+	/**
+	 * @brief Number of layers
+	 */
+	size_t size() const { return m_layers; }
+	const Layer &layer(size_t i) const
+	{
+		return reinterpret_cast<const Layer *>(m_data + 24)[i];
+	}
+
+	/**
+	 * @brief Weights of layer i, layer(i).count values
+	 */
+	const Real *weights(size_t i) const
+	{
+		return reinterpret_cast<const Real *>(m_data + layer(i).offset);
+	}
+
+	/**
+	 * @brief Checks the magic number of a file
+	 *
+	 * @param path full path to the file
+	 * @return true if the file is in the native binary format
+	 */
+	static bool is_network_file(const std::string &path);
+
+private:
+	const uint8_t *m_data = nullptr;
+	size_t m_size = 0, m_layers = 0;
+};
+
+/**
+ * @brief Converts a network read with read_network to the native binary
+ * format, see NetworkFile
+ *
+ * @param data json object containing the network information
+ * @param path target file
+ */
+void write_network_file(const Json &data, const std::string &path);
+
+/**
+ * @brief Path under which the network file is found, either @p path itself
+ * or "../" + @p path (same search as in read_network)
+ *
+ * @param path path to the network file
+ * @return the path that could be opened
+ */
+std::string network_path(const std::string &path);
+
+/**
+ * @brief 64 bit FNV-1a hash of the content of a file, as hex string
+ *
+ * @param path full path to the file
+ * @return hash of the file content
+ */
+std::string file_hash(const std::string &path);
+
+/**
+ * @brief Look up layer-wise scale factors in the cache file @p cache. Entries
+ * are only valid for the network with content hash @p hash.
+ *
+ * @param cache path to the json cache file
+ * @param hash content hash of the network file, see file_hash
+ * @param key identifies the calibration (percentile, schedule, ...)
+ * @param factors target for the scale factors
+ * @return true if a matching entry was found
+ */
+bool load_scale_factors(const std::string &cache, const std::string &hash,
+                        const std::string &key, std::vector<Real> &factors);
+
+/**
+ * @brief Store layer-wise scale factors in the cache file @p cache. Entries
+ * of a different network hash are dropped. Failing to write the cache is not
+ * an error, only a warning is emitted.
+ *
+ * @param cache path to the json cache file
+ * @param hash content hash of the network file, see file_hash
+ * @param key identifies the calibration (percentile, schedule, ...)
+ * @param factors the scale factors
+ */
+void store_scale_factors(const std::string &cache, const std::string &hash,
+                         const std::string &key,
+                         const std::vector<Real> &factors);
+
+/**
+ * @brief Exact order statistic of a stream of values: after exactly @p count
+ * calls of push, value() returns the element at position @p rank of the
+ * sorted stream. Only min(rank + 1, count - rank) values are kept, which is a
+ * small fraction of the stream for high percentiles.
+ */
+class StreamingRank {
+private:
+	size_t m_keep;
+	bool m_lower;  // Keep the smallest values, else the largest
+	std::vector<Real> m_heap;
+
+	bool before(Real a, Real b) const { return m_lower ? a < b : a > b; }
+
+public:
+	/**
+	 * @param count total number of values
+	 * @param rank position of the requested value, clamped to count - 1
+	 */
+	StreamingRank(size_t count, size_t rank)
+	{
+		if (count == 0) {
+			throw std::invalid_argument("StreamingRank: empty stream");
+		}
+		rank = std::min(rank, count - 1);
+		m_lower = rank + 1 <= count - rank;
+		m_keep = m_lower ? rank + 1 : count - rank;
+		m_heap.reserve(m_keep);
+	}
+
+	void push(Real value)
+	{
+		auto comp = [this](Real a, Real b) { return before(a, b); };
+		if (m_heap.size() < m_keep) {
+			m_heap.push_back(value);
+			std::push_heap(m_heap.begin(), m_heap.end(), comp);
+		}
+		else if (before(value, m_heap.front())) {
+			std::pop_heap(m_heap.begin(), m_heap.end(), comp);
+			m_heap.back() = value;
+			std::push_heap(m_heap.begin(), m_heap.end(), comp);
+		}
+	}
+
+	/**
+	 * @brief The requested order statistic of all values pushed so far
+	 */
+	Real value() const { return m_heap.empty() ? 0.0 : m_heap.front(); }
+};
+
 /**
  * @brief Calculate the max weight, ignore negative values
  *
@@ -283,16 +769,50 @@ Real max_weight_abs(const Matrix<T> &json)
 	return max;
 }
 
+/**
+ * @brief Decides whether a synapse is pruned during conversion
+ *
+ * @param weight the (unscaled) weight
+ * @param threshold synapses with |weight| <= threshold are pruned, a negative
+ * threshold disables pruning
+ * @return true if the synapse should be dropped
+ */
+inline bool prune_weight(Real weight, Real threshold)
+{
+	return threshold >= 0 && std::abs(weight) <= threshold;
+}
+
+/**
+ * @brief Converts a dense layer into a given list of Local Connections. The
+ * list is cleared first, its capacity is reused.
+ *
+ * @param mat cypress matrix of weights
+ * @param scale scale factor for weights
+ * @param delay synaptic delay
+ * @param threshold pruning threshold on the unscaled weights, see
+ * prune_weight. Negative values keep all synapses
+ * @param conns target list
+ * @param pruned if given, set to the number of pruned synapses
+ */
+void fill_dense_conns(const Matrix<Real> &mat, Real scale, Real delay,
+                      Real threshold, std::vector<LocalConnection> &conns,
+                      size_t *pruned = nullptr);
+
 /**
  * @brief Convert a dense layer to list of Local Connections.
  *
  * @param mat cypress matrix of weights
  * @param scale scale factor for weights
  * @param delay synaptic delay
+ * @param threshold pruning threshold on the unscaled weights, see
+ * prune_weight. Negative values keep all synapses
+ * @param pruned if given, set to the number of pruned synapses
  * @return vector of connections
  */
 std::vector<LocalConnection> dense_weights_to_conn(const Matrix<Real> &mat,
-                                                   Real scale, Real delay);
+                                                   Real scale, Real delay,
+                                                   Real threshold = -1.0,
+                                                   size_t *pruned = nullptr);
 
 /**
  * @brief Converts a conv layer to list of Local Connections.
@@ -300,10 +820,15 @@ std::vector<LocalConnection> dense_weights_to_conn(const Matrix<Real> &mat,
  * @param layer struct of convolution layer information
  * @param scale scale factor for weights
  * @param delay synaptic delay
+ * @param threshold pruning threshold on the unscaled weights, see
+ * prune_weight. Negative values keep all synapses
+ * @param pruned if given, set to the number of pruned synapses
  * @return vector of connections
  */
 std::vector<LocalConnection> conv_weights_to_conn(const mnist_helper::CONVOLUTION_LAYER &layer,
-                                                  Real scale, Real delay);
+                                                  Real scale, Real delay,
+                                                  Real threshold = -1.0,
+                                                  size_t *pruned = nullptr);
 
 /**
  * @brief
@@ -319,6 +844,155 @@ std::vector<std::vector<LocalConnection>> pool_to_conn(
     const mnist_helper::POOLING_LAYER &layer,Real max_pool_weight,
     Real pool_inhib_weight, Real delay, Real pool_delay);
 
+/**
+ * @brief Cache of connection tables shared by the replicas of a network, e.g.
+ * the batches of a batch parallel network. A table is generated once per layer
+ * and scale factor, every further request returns the same immutable list.
+ * Access is thread safe.
+ */
+class ConnectionCache {
+public:
+	typedef std::vector<std::vector<LocalConnection>> Tables;
+
+	/**
+	 * @brief Returns the cached tables of a layer, creating them on first use
+	 *
+	 * @param layer position of the layer in the network
+	 * @param scale scale factor the weights were multiplied with
+	 * @param generate functor returning the Tables of the layer
+	 * @return shared pointer to the immutable tables
+	 */
+	template <typename F>
+	std::shared_ptr<const Tables> get(size_t layer, Real scale, F generate)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto &entry = m_tables[std::make_pair(layer, scale)];
+		if (!entry) {
+			entry = std::make_shared<const Tables>(generate());
+			m_misses++;
+		}
+		else {
+			m_hits++;
+		}
+		return entry;
+	}
+
+	/**
+	 * @brief Releases all tables. Has to be called whenever the weights change
+	 */
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tables.clear();
+		m_hits = 0;
+		m_misses = 0;
+	}
+
+	size_t hits() const { return m_hits; }
+	size_t misses() const { return m_misses; }
+
+	/**
+	 * @brief Number of connections held by the cache
+	 */
+	size_t connections() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t res = 0;
+		for (const auto &entry : m_tables) {
+			for (const auto &table : *entry.second) {
+				res += table.size();
+			}
+		}
+		return res;
+	}
+
+private:
+	std::map<std::pair<size_t, Real>, std::shared_ptr<const Tables>> m_tables;
+	size_t m_hits = 0, m_misses = 0;
+	mutable std::mutex m_mutex;
+};
+
+/**
+ * @brief Bins the spikes of a population into samples in a single pass. Every
+ * spike train is walked once, counts (or TTFS first spike times) are written
+ * into a flat sample-major matrix and the decision of every sample (argmax of
+ * counts or argmin of first spike times) is updated on the fly.
+ */
+class SpikeBins {
+public:
+	/**
+	 * @brief Prepares binning, trains are added with add_train
+	 *
+	 * @param neurons number of trains that will be added
+	 * @param duration presentation time of a sample
+	 * @param pause pause time in between samples
+	 * @param batch_size number of samples (bins)
+	 * @param ttfs record first spike times instead of spike counts
+	 */
+	SpikeBins(size_t neurons, Real duration, Real pause, size_t batch_size,
+	          bool ttfs = false);
+
+	/**
+	 * @brief Bins all spikes recorded by the population
+	 */
+	SpikeBins(const PopulationBase &pop, Real duration, Real pause,
+	          size_t batch_size, bool ttfs = false);
+
+	/**
+	 * @brief Bins the (sorted) spike train of the next neuron
+	 */
+	void add_train(const std::vector<Real> &spikes);
+
+	size_t samples() const { return m_samples; }
+	size_t neurons() const { return m_neurons; }
+
+	/**
+	 * @brief Number of spikes of neuron in sample (rate mode)
+	 */
+	uint16_t count(size_t sample, size_t neuron) const
+	{
+		return m_counts[sample * m_neurons + neuron];
+	}
+
+	/**
+	 * @brief First spike of neuron in sample relative to the start of the
+	 * sample, std::numeric_limits<Real>::max() if there was none (TTFS mode)
+	 */
+	Real first_spike(size_t sample, size_t neuron) const
+	{
+		return m_times[sample * m_neurons + neuron];
+	}
+
+	/**
+	 * @brief Per sample index of the neuron with most spikes (rate mode) or
+	 * the earliest spike (TTFS mode), std::numeric_limits<uint16_t>::max() if
+	 * there was no unique decision
+	 */
+	const std::vector<uint16_t> &labels() const { return m_labels; }
+
+	/**
+	 * @brief Spike counts as rates (vec[sample][neuron])
+	 *
+	 * @param norm divide the counts by this value, ignore if it is zero
+	 */
+	std::vector<std::vector<Real>> rates(Real norm = 0.0) const;
+
+	/**
+	 * @brief First spike times as values in [0, 1] relative to the earliest
+	 * spike of the sample (vec[sample][neuron])
+	 */
+	std::vector<std::vector<Real>> ttfs_rates() const;
+
+private:
+	size_t m_neurons, m_samples, m_added = 0;
+	Real m_duration, m_start, m_bin_size;
+	bool m_ttfs;
+	std::vector<uint16_t> m_counts;
+	std::vector<Real> m_times;
+	std::vector<Real> m_best;  // Max count or min first spike per sample
+	std::vector<uint16_t> m_labels;
+};
+
 /**
  * @brief Converts the simulation results into label data
  *
@@ -394,10 +1068,10 @@ std::vector<Real> av_pooling_image(std::vector<Real> &image, size_t height,
 /**
  * @brief downscale the complete MNIST dataset
  *
- * @param data The MNIST dataset in a container
+ * @param data The MNIST dataset, mapped or in a container
  * @return downscaled MNIST dataset in a container
  */
-MNIST_DATA scale_mnist(MNIST_DATA &data, size_t pooling_size = 3);
+MNIST_DATA scale_mnist(const MnistView &data, size_t pooling_size = 3);
 
 /**
  * @brief Reads in MNIST test or train data.
@@ -421,10 +1095,12 @@ SPIKING_MNIST read_data_to_spike(const size_t num_images, bool train_data,
  * @param weights the weight matrix, type cypress::Matrix<double>
  * @param delay synaptic delay, use 1.0 is unsure
  * @param scale_factor scale all weights, do not scale if set to zero
+ * @param threshold pruning threshold, see prune_weight
  * @return a list of connections
  */
 std::vector<LocalConnection> conns_from_mat(
-    const cypress::Matrix<Real> &weights, Real delay, Real scale_factor = 0.0);
+    const cypress::Matrix<Real> &weights, Real delay, Real scale_factor = 0.0,
+    Real threshold = -1.0);
 
 /**
  * @brief Updates the connector is a given network with the weights provided
@@ -434,8 +1110,56 @@ std::vector<LocalConnection> conns_from_mat(
  * @param delay synaptic delay Defaults to 1.0.
  * @param scale_factor Scales the weights during conversion, no scale if set to
  * zero
+ * @param thresholds pruning threshold per layer, missing entries disable
+ * pruning
  */
 void update_conns_from_mat(const std::vector<cypress::Matrix<Real>> &weights,
                            Network &netw, Real delay = 1.0,
-                           Real scale_factor = 0.0);
+                           Real scale_factor = 0.0,
+                           const std::vector<Real> &thresholds = {});
+
+/**
+ * @brief Incremental version of update_conns_from_mat. Remembers the weights
+ * last sent to the network and only regenerates the connectors of layers whose
+ * weights changed since then. Conversion reuses a persistent buffer.
+ */
+class ConnectionUpdater {
+public:
+	/**
+	 * @param delay synaptic delay
+	 * @param scale_factor Scales the weights during conversion, no scale if
+	 * set to zero
+	 * @param thresholds pruning threshold per layer, missing entries disable
+	 * pruning
+	 */
+	ConnectionUpdater(Real delay = 1.0, Real scale_factor = 0.0,
+	                  std::vector<Real> thresholds = {})
+	    : m_delay(delay),
+	      m_scale_factor(scale_factor),
+	      m_thresholds(std::move(thresholds))
+	{
+	}
+
+	/**
+	 * @brief Marks the given weights as the current state of the network,
+	 * e.g. after the network was created from them
+	 */
+	void reset(const std::vector<cypress::Matrix<Real>> &weights);
+
+	/**
+	 * @brief Updates the connectors "dense_<i>" of all changed layers
+	 *
+	 * @param weights the new weight in weights[layer](input, output)
+	 * @param netw the network to alter
+	 * @return number of updated layers
+	 */
+	size_t update(const std::vector<cypress::Matrix<Real>> &weights,
+	              Network &netw);
+
+private:
+	Real m_delay, m_scale_factor;
+	std::vector<Real> m_thresholds;
+	std::vector<cypress::Matrix<Real>> m_sent;
+	std::vector<LocalConnection> m_buffer;
+};
 }  // namespace mnist_helper
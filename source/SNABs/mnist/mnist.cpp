@@ -18,6 +18,9 @@
 
 #include <cypress/backend/power/power.hpp>
 #include <cypress/cypress.hpp>  // Neural network frontend
+#include <array>
+#include <chrono>
+#include <future>
 #include <memory>
 #include <random>
 #include <string>
@@ -29,6 +32,30 @@
 
 namespace SNAB {
 using namespace cypress;
+
+namespace {
+/**
+ * @brief Constructs an MLP from a network file. Files in the native binary
+ * format (see mnist_helper::NetworkFile) are mapped and copied directly,
+ * everything else is read as msgpack.
+ */
+template <typename MLPType>
+std::shared_ptr<MNIST::MLPBase> load_mlp(const std::string &dnn_file,
+                                         size_t epochs, size_t batchsize,
+                                         Real learn_rate, bool random = false)
+{
+	auto path = mnist_helper::network_path(dnn_file);
+	if (mnist_helper::NetworkFile::is_network_file(path)) {
+		return std::make_shared<MLPType>(mnist_helper::NetworkFile(path),
+		                                 epochs, batchsize, learn_rate,
+		                                 random);
+	}
+	auto kerasdata = mnist_helper::read_network(path, true);
+	return std::make_shared<MLPType>(kerasdata, epochs, batchsize, learn_rate,
+	                                 random);
+}
+}  // namespace
+
 MNIST_BASE::MNIST_BASE(const std::string backend, size_t bench_index)
     : MNIST_BASE(backend, bench_index, __func__)
 {
@@ -90,63 +117,143 @@ void MNIST_BASE::read_config()
 		m_activity_based_scaling =
 		    m_config_file["activity_based_scaling"].get<size_t>();
 	}
+	if (m_config_file.find("mlp_threads") != m_config_file.end()) {
+		m_mlp_threads = m_config_file["mlp_threads"].get<size_t>();
+	}
+	if (m_config_file.find("prefetch_batches") != m_config_file.end()) {
+		m_prefetch = m_config_file["prefetch_batches"].get<size_t>();
+	}
+	if (m_config_file.find("quantized_reference") != m_config_file.end()) {
+		m_quantized_bits = m_config_file["quantized_reference"].get<size_t>();
+	}
+	if (m_config_file.find("scale_cache") != m_config_file.end()) {
+		m_scale_cache = m_config_file["scale_cache"].get<bool>();
+	}
+	m_prune_thresholds.clear();
+	if (m_config_file.find("prune_threshold") != m_config_file.end()) {
+		if (m_config_file["prune_threshold"].is_array()) {
+			m_prune_thresholds =
+			    m_config_file["prune_threshold"].get<std::vector<Real>>();
+		}
+		else {
+			m_prune_thresholds = {
+			    m_config_file["prune_threshold"].get<Real>()};
+		}
+	}
 }
 
-cypress::Network &MNIST_BASE::build_netw_int(cypress::Network &netw)
+Real MNIST_BASE::prune_threshold(size_t layer) const
 {
-	read_config();
-	auto kerasdata = mnist_helper::read_network(m_dnn_file, true);
-	m_mlp = std::make_shared<MNIST::MLP<>>(kerasdata, 0, m_batchsize, 0.0);
-	if (m_scaled_image) {
-		m_mlp->scale_down_images();
+	if (m_prune_thresholds.size() == 1) {
+		return m_prune_thresholds[0];
 	}
-	mnist_helper::SPIKING_MNIST spike_mnist;
-	if (m_train_data) {
-		spike_mnist = mnist_helper::mnist_to_spike(m_mlp->mnist_train_set(),
-		                                           m_duration, m_max_freq,
-		                                           m_images, m_poisson, m_ttfs);
+	if (layer < m_prune_thresholds.size()) {
+		return m_prune_thresholds[layer];
+	}
+	return -1.0;
+}
+
+void MNIST_BASE::rescale_mlp(bool use_cache)
+{
+	if (!use_cache || !m_scale_cache) {
+		m_layer_scale_factors = m_mlp->rescale_weights(m_activity_based_scaling);
 	}
 	else {
-		spike_mnist = mnist_helper::mnist_to_spike(m_mlp->mnist_test_set(),
-		                                           m_duration, m_max_freq,
-		                                           m_images, m_poisson, m_ttfs);
+		std::string path = mnist_helper::network_path(m_dnn_file);
+		std::string cache = path + ".scales.json";
+		std::string hash = mnist_helper::file_hash(path);
+		std::string key = "p" + std::to_string(m_activity_based_scaling) +
+		                  "_s0_i" + std::to_string(m_scaled_image);
+		std::vector<Real> factors;
+		if (mnist_helper::load_scale_factors(cache, hash, key, factors)) {
+			global_logger().debug("SNABSuite",
+			                      "Using cached scale factors from " + cache);
+			m_layer_scale_factors = m_mlp->rescale_weights(factors);
+		}
+		else {
+			m_layer_scale_factors =
+			    m_mlp->rescale_weights(m_activity_based_scaling);
+			mnist_helper::store_scale_factors(cache, hash, key,
+			                                  m_layer_scale_factors);
+		}
+	}
+	std::string message;
+	for (auto i : m_layer_scale_factors) {
+		message += std::to_string(i);
+		message += ", ";
 	}
-	m_batch_data = mnist_helper::create_batches(spike_mnist, m_batchsize,
-	                                            m_duration, m_pause, false);
+	global_logger().debug("SNABSuite", "SNN rescale factors: " + message);
+}
 
+void MNIST_BASE::report_pruning(const std::string &name, size_t kept,
+                                size_t pruned) const
+{
+	if (!pruned) {
+		return;
+	}
+	global_logger().info(
+	    "SNABSuite", "Pruned " + std::to_string(pruned) + " of " +
+	                     std::to_string(kept + pruned) + " synapses (" +
+	                     std::to_string(100.0 * Real(pruned) /
+	                                    Real(kept + pruned)) +
+	                     "%) in layer " + name);
+}
+
+cypress::Network &MNIST_BASE::build_netw_int(cypress::Network &netw)
+{
+	read_config();
+	m_mlp = load_mlp<MNIST::MLP<>>(m_dnn_file, 0, m_batchsize, 0.0);
+	m_mlp->set_threads(m_mlp_threads);
+	if (m_scaled_image) {
+		m_mlp->scale_down_images();
+	}
 	if (m_activity_based_scaling) {
-		m_layer_scale_factors =
-		    m_mlp->rescale_weights(m_activity_based_scaling);
-		std::string message;
-		for (auto i : m_layer_scale_factors) {
-			message += std::to_string(i);
-			message += ", ";
-		}
-		global_logger().debug("SNABSuite", "SNN rescale factors: " + message);
+		rescale_mlp();
+	}
+	if (m_quantized_bits) {
+		// Fixed-point reference for the weight scaling of the SNN
+		global_logger().info(
+		    "SNABSuite",
+		    "MLP test accuracy: float " +
+		        std::to_string(m_mlp->forward_path_test()) + ", int" +
+		        std::to_string(m_quantized_bits) + " " +
+		        std::to_string(m_mlp->forward_path_test_quantized(
+		            m_quantized_bits, m_activity_based_scaling
+		                                  ? m_activity_based_scaling
+		                                  : 100)));
 	}
 
 	m_label_pops.clear();
 	m_networks.clear();
 	m_all_pops.clear();
-	if (m_batch_parallel) {
-		for (auto &i : m_batch_data) {
-			mnist_helper::create_spike_source(netw, i);
+	m_batch_labels.clear();
+	m_conn_cache.clear();
+	// Batch k+1 is encoded while the network for batch k is created
+	mnist_helper::SpikeBatchStream stream(
+	    m_train_data ? m_mlp->mnist_train_view() : m_mlp->mnist_test_view(),
+	    m_images, m_batchsize, m_duration, m_max_freq, m_pause, m_poisson,
+	    m_ttfs, false, 0, m_prefetch);
+	mnist_helper::SPIKING_MNIST batch;
+	while (stream.next(batch)) {
+#if SNAB_DEBUG
+		if (m_batch_labels.empty()) {
+			Utilities::write_vector2_to_csv(
+			    std::get<0>(batch).to_vector(),
+			    _debug_filename("spikes_input.csv"));
+			Utilities::plot_spikes(_debug_filename("spikes_input.csv"),
+			                       m_backend);
+		}
+#endif
+		m_batch_labels.emplace_back(std::get<1>(batch));
+		if (m_batch_parallel) {
+			mnist_helper::create_spike_source(netw, batch);
 			create_deep_network(netw, m_max_weight, m_max_pool_weight,
 			                    m_pool_inhib_weight);
 			m_label_pops.emplace_back(netw.populations().back());
 		}
-
-		if (m_count_spikes) {
-			for (auto pop : netw.populations()) {
-				pop.signals().record(0);
-				m_all_pops.emplace_back(pop);
-			}
-		}
-	}
-	else {
-		for (auto &i : m_batch_data) {
+		else {
 			m_networks.push_back(cypress::Network());
-			mnist_helper::create_spike_source(m_networks.back(), i);
+			mnist_helper::create_spike_source(m_networks.back(), batch);
 			create_deep_network(m_networks.back(), m_max_weight,
 			                    m_max_pool_weight, m_pool_inhib_weight);
 			m_label_pops.emplace_back(m_networks.back().populations().back());
@@ -158,16 +265,26 @@ cypress::Network &MNIST_BASE::build_netw_int(cypress::Network &netw)
 			}
 		}
 	}
+	global_logger().debug(
+	    "SNABSuite", "Connection tables: " +
+	                     std::to_string(m_conn_cache.misses()) +
+	                     " generated, " + std::to_string(m_conn_cache.hits()) +
+	                     " reused, " +
+	                     std::to_string(m_conn_cache.connections()) +
+	                     " cached connections");
+	// Tables were copied into the connectors
+	m_conn_cache.clear();
+	if (m_batch_parallel && m_count_spikes) {
+		for (auto pop : netw.populations()) {
+			pop.signals().record(0);
+			m_all_pops.emplace_back(pop);
+		}
+	}
 
 	for (auto &pop : m_label_pops) {
 		pop.signals().record(0);
 	}
 
-#if SNAB_DEBUG
-	Utilities::write_vector2_to_csv(std::get<0>(m_batch_data[0]),
-	                                _debug_filename("spikes_input.csv"));
-	Utilities::plot_spikes(_debug_filename("spikes_input.csv"), m_backend);
-#endif
 	return netw;
 }
 
@@ -244,7 +361,7 @@ std::vector<std::array<cypress::Real, 4>> MNIST_BASE::evaluate()
 		auto pop = m_label_pops[batch];
 		auto labels = mnist_helper::spikes_to_labels(pop, m_duration, m_pause,
 		                                             m_batchsize, m_ttfs);
-		auto &orig_labels = std::get<1>(m_batch_data[batch]);
+		auto &orig_labels = m_batch_labels[batch];
 		auto correct = mnist_helper::compare_labels(orig_labels, labels);
 		global_correct += correct;
 		images += orig_labels.size();
@@ -407,18 +524,27 @@ size_t MNIST_BASE::create_deep_network(Network &netw, Real max_weight,
 	size_t dense_counter = 0;
 	size_t conv_counter = 0;
 	size_t pool_counter = 0;
+	size_t position = 0;
 	for (const auto &layer : m_mlp->get_layer_types()) {
 		if (layer == mnist_helper::Dense) {
 			const auto &layer_weights = m_mlp->get_weights()[dense_counter];
 			size_t size = layer_weights.cols();
 			auto pop = SpikingUtils::add_population(m_neuron_type_str, netw,
 			                                        m_neuro_params, size, "");
-			auto conns = mnist_helper::dense_weights_to_conn(
-			    layer_weights, m_weights_scale_factor, 1.0);
+			std::string name = "dense_" + std::to_string(dense_counter);
+			auto conns = m_conn_cache.get(
+			    position, m_weights_scale_factor, [&]() {
+				    size_t pruned = 0;
+				    mnist_helper::ConnectionCache::Tables res{
+				        mnist_helper::dense_weights_to_conn(
+				            layer_weights, m_weights_scale_factor, 1.0,
+				            prune_threshold(position), &pruned)};
+				    report_pruning(name, res[0].size(), pruned);
+				    return res;
+			    });
 			netw.add_connection(
 			    netw.populations()[layer_id - 1], pop,
-			    Connector::from_list(conns),
-			    ("dense_" + std::to_string(dense_counter)).c_str());
+			    Connector::from_list((*conns)[0]), name.c_str());
 
 			global_logger().debug(
 			    "SNABSuite",
@@ -433,12 +559,20 @@ size_t MNIST_BASE::create_deep_network(Network &netw, Real max_weight,
 			              layer_weights.output_sizes[2];
 			auto pop = SpikingUtils::add_population(m_neuron_type_str, netw,
 			                                        m_neuro_params, size, "");
-			auto conns = mnist_helper::conv_weights_to_conn(
-			    layer_weights, m_conv_weights_scale_factors[conv_counter], 1.0);
-			netw.add_connection(
-			    netw.populations()[layer_id - 1], pop,
-			    Connector::from_list(conns),
-			    ("conv_" + std::to_string(conv_counter)).c_str());
+			Real scale = m_conv_weights_scale_factors[conv_counter];
+			std::string name = "conv_" + std::to_string(conv_counter);
+			auto conns = m_conn_cache.get(position, scale, [&]() {
+				size_t pruned = 0;
+				mnist_helper::ConnectionCache::Tables res{
+				    mnist_helper::conv_weights_to_conn(
+				        layer_weights, scale, 1.0, prune_threshold(position),
+				        &pruned)};
+				report_pruning(name, res[0].size(), pruned);
+				return res;
+			});
+			netw.add_connection(netw.populations()[layer_id - 1], pop,
+			                    Connector::from_list((*conns)[0]),
+			                    name.c_str());
 			global_logger().debug("SNABSuite",
 			                      "Convolution layer constructed with size " +
 			                          std::to_string(size));
@@ -451,24 +585,27 @@ size_t MNIST_BASE::create_deep_network(Network &netw, Real max_weight,
 			              pool_layer.output_sizes[2];
 			auto pop = SpikingUtils::add_population(m_neuron_type_str, netw,
 			                                        m_neuro_params, size, "");
-			auto conns = mnist_helper::pool_to_conn(pool_layer, max_pool_weight,
-			                                        pool_inhib_weight, 1.0,
-			                                        m_pool_delay);
+			auto conns = m_conn_cache.get(position, max_pool_weight, [&]() {
+				return mnist_helper::pool_to_conn(pool_layer, max_pool_weight,
+				                                  pool_inhib_weight, 1.0,
+				                                  m_pool_delay);
+			});
 			netw.add_connection(netw.populations()[layer_id - 1],
 			                    netw.populations()[layer_id - 1],
-			                    Connector::from_list(conns[0]), "dummy_name");
+			                    Connector::from_list((*conns)[0]), "dummy_name");
 			netw.add_connection(
 			    netw.populations()[layer_id - 1], pop,
-			    Connector::from_list(conns[1]),
+			    Connector::from_list((*conns)[1]),
 			    ("pool_" + std::to_string(pool_counter)).c_str());
 			global_logger().debug("SNABSuite",
 			                      "Pooling layer constructed with size " +
 			                          std::to_string(size) + " and " +
-			                          std::to_string(conns[0].size()) +
+			                          std::to_string((*conns)[0].size()) +
 			                          " inhibitory connections");
 			pool_counter++;
 		}
 		layer_id++;
+		position++;
 	}
 	return dense_counter + conv_counter + pool_counter;
 }
@@ -498,6 +635,9 @@ cypress::Network &MnistITLLastLayer::build_netw(cypress::Network &netw)
 	if (m_config_file.find("num_test_images") != m_config_file.end()) {
 		m_num_test_images = m_config_file["num_test_images"].get<size_t>();
 	}
+	if (m_config_file.find("pipeline") != m_config_file.end()) {
+		m_pipeline = m_config_file["pipeline"].get<bool>();
+	}
 	if (m_config_file.find("test_batchsize") != m_config_file.end()) {
 		m_test_batchsize = m_config_file["test_batchsize"].get<size_t>();
 	}
@@ -507,18 +647,17 @@ cypress::Network &MnistITLLastLayer::build_netw(cypress::Network &netw)
 
 	// TODO ? Required -> constructor
 
-	auto kerasdata = mnist_helper::read_network(m_dnn_file, true);
+	size_t epochs = m_config_file["epochs"].get<size_t>();
+	Real learn_rate = m_config_file["learn_rate"].get<Real>();
 	if (m_positive) {
 		if (m_loss_function == "CatHinge")
-			m_mlp = std::make_shared<MNIST::MLP<MNIST::CatHinge, MNIST::ReLU,
-			                                    MNIST::PositiveLimitedWeights>>(
-			    kerasdata, m_config_file["epochs"].get<size_t>(), m_batchsize,
-			    m_config_file["learn_rate"].get<Real>(), random_init);
+			m_mlp = load_mlp<MNIST::MLP<MNIST::CatHinge, MNIST::ReLU,
+			                            MNIST::PositiveLimitedWeights>>(
+			    m_dnn_file, epochs, m_batchsize, learn_rate, random_init);
 		else if (m_loss_function == "MSE")
-			m_mlp = std::make_shared<MNIST::MLP<MNIST::MSE, MNIST::ReLU,
-			                                    MNIST::PositiveLimitedWeights>>(
-			    kerasdata, m_config_file["epochs"].get<size_t>(), m_batchsize,
-			    m_config_file["learn_rate"].get<Real>(), random_init);
+			m_mlp = load_mlp<MNIST::MLP<MNIST::MSE, MNIST::ReLU,
+			                            MNIST::PositiveLimitedWeights>>(
+			    m_dnn_file, epochs, m_batchsize, learn_rate, random_init);
 		else {
 			throw std::runtime_error("Unknown loss function " +
 			                         m_loss_function);
@@ -526,36 +665,26 @@ cypress::Network &MnistITLLastLayer::build_netw(cypress::Network &netw)
 	}
 	else {
 		if (m_loss_function == "CatHinge")
-			m_mlp = std::make_shared<
+			m_mlp = load_mlp<
 			    MNIST::MLP<MNIST::CatHinge, MNIST::ReLU, MNIST::NoConstraint>>(
-			    kerasdata, m_config_file["epochs"].get<size_t>(), m_batchsize,
-			    m_config_file["learn_rate"].get<Real>(), random_init);
+			    m_dnn_file, epochs, m_batchsize, learn_rate, random_init);
 		else if (m_loss_function == "MSE")
-			m_mlp = std::make_shared<
+			m_mlp = load_mlp<
 			    MNIST::MLP<MNIST::MSE, MNIST::ReLU, MNIST::NoConstraint>>(
-			    kerasdata, m_config_file["epochs"].get<size_t>(), m_batchsize,
-			    m_config_file["learn_rate"].get<Real>(), random_init);
+			    m_dnn_file, epochs, m_batchsize, learn_rate, random_init);
 		else {
 			throw std::runtime_error("Unknown loss function " +
 			                         m_loss_function);
 		}
 	}
 
+	m_mlp->set_threads(m_mlp_threads);
 	if (m_scaled_image) {
 		m_mlp->scale_down_images();
 	}
-	m_spmnist =
-	    mnist_helper::mnist_to_spike(m_mlp->mnist_train_set(), m_duration,
-	                                 m_max_freq, m_images, m_poisson, m_ttfs);
 	if (m_activity_based_scaling) {
-		m_layer_scale_factors =
-		    m_mlp->rescale_weights(m_activity_based_scaling);  // TODO
-		std::string message;
-		for (auto i : m_layer_scale_factors) {
-			message += std::to_string(i);
-			message += ", ";
-		}
-		global_logger().debug("SNABSuite", "SNN rescale factors: " + message);
+		// Randomly initialised weights are not described by the network file
+		rescale_mlp(!random_init);  // TODO
 	}
 	return netw;
 }
@@ -571,6 +700,8 @@ void MnistITLLastLayer::run_netw(cypress::Network &netw)
 
 	create_deep_network(netw, m_max_weight, m_max_pool_weight,
 	                    m_pool_inhib_weight);
+	// Weights are updated in place during training, the tables are stale
+	m_conn_cache.clear();
 	m_label_pops = {netw.populations().back()};
 
 	auto pre_last_pop = netw.populations()[netw.populations().size() - 2];
@@ -586,55 +717,103 @@ void MnistITLLastLayer::run_netw(cypress::Network &netw)
 		}
 	}
 
+	std::vector<Real> thresholds;
+	for (size_t layer = 0; layer < m_mlp->get_weights().size(); layer++) {
+		thresholds.push_back(prune_threshold(layer));
+	}
+	mnist_helper::ConnectionUpdater updater(1.0, m_weights_scale_factor,
+	                                        thresholds);
+	// Layers untouched by training (e.g. the hidden layers with
+	// last_layer_only) are skipped by the updater
+	updater.reset(m_mlp->get_weights());
+
 	std::vector<std::vector<Real>> accuracies;
 	size_t counter = 0;
+	// Wall time per stage: spike sources, simulation, binning, learning and
+	// connection update
+	std::array<Real, 5> stage_time = {0.0, 0.0, 0.0, 0.0, 0.0};
+	auto now = []() { return std::chrono::steady_clock::now(); };
+	auto elapsed = [&now](std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<Real>(now() - start).count();
+	};
+	// Every image keeps its spike trains over all epochs, only the order of
+	// images changes
+	std::random_device rd;
+	unsigned poisson_seed = std::uniform_int_distribution<unsigned>(1)(rd);
 	for (size_t train_run = 0; train_run < m_config_file["epochs"];
 	     train_run++) {
-		m_batch_data = mnist_helper::create_batches(m_spmnist, m_batchsize,
-		                                            m_duration, m_pause, true);
-		for (auto &i : m_batch_data) {
-			if (std::get<1>(i).size() != m_batchsize) {
-				continue;
+		// Batch k+1 is encoded while batch k is simulated
+		mnist_helper::SpikeBatchStream stream(
+		    m_mlp->mnist_train_view(), m_images, m_batchsize, m_duration,
+		    m_max_freq, m_pause, m_poisson, m_ttfs, true, 0, m_prefetch,
+		    poisson_seed);
+		// Fetches the next complete batch and loads it into the source
+		auto prepare = [&](mnist_helper::SPIKING_MNIST &batch) {
+			while (stream.next(batch)) {
+				if (std::get<1>(batch).size() == m_batchsize) {
+					mnist_helper::update_spike_source(source_n, batch);
+					return true;
+				}
 			}
-			mnist_helper::update_spike_source(source_n, i);
+			return false;
+		};
+		mnist_helper::SPIKING_MNIST i, next;
+		auto start = now();
+		bool valid = prepare(i);
+		stage_time[0] += elapsed(start);
+		while (valid) {
+			start = now();
 			netw.run(pwbackend, m_batchsize * (m_duration + m_pause));
+			stage_time[1] += elapsed(start);
 
+			start = now();
 			std::vector<std::vector<std::vector<Real>>> output_rates;
+			std::vector<uint16_t> labels;
 			for (auto &pop : netw.populations()) {
 				if (pop.signals().is_recording(0)) {
+					// Rates and labels of the last layer come from one pass
+					bool last = pop.pid() == netw.populations().back().pid();
+					mnist_helper::SpikeBins bins(pop, m_duration, m_pause,
+					                             m_batchsize, m_ttfs);
 					if (!m_ttfs) {
-						if (pop.pid() != netw.populations().back().pid()) {
-							output_rates.emplace_back(
-							    mnist_helper::spikes_to_rates(
-							        pop, m_duration, m_pause, m_batchsize,
-							        m_norm_rate_hidden));
-						}
-						else {
-							output_rates.emplace_back(
-							    mnist_helper::spikes_to_rates(
-							        pop, m_duration, m_pause, m_batchsize,
-							        m_norm_rate_last));
-						}
+						output_rates.emplace_back(bins.rates(
+						    last ? m_norm_rate_last : m_norm_rate_hidden));
 					}
 					else {
-						output_rates.emplace_back(
-						    mnist_helper::spikes_to_rates_ttfs(
-						        pop, m_duration, m_pause, m_batchsize));
+						output_rates.emplace_back(bins.ttfs_rates());
+					}
+					if (last) {
+						labels = bins.labels();
 					}
 				}
 				else {
 					output_rates.emplace_back(std::vector<std::vector<Real>>());
 				}
 			}
+			stage_time[2] += elapsed(start);
+
+			// All results are read, the spike source of the next batch may be
+			// set while the host is learning. Weights are only sent to the
+			// network afterwards, so results do not change.
+			std::future<bool> prepared;
+			if (m_pipeline) {
+				prepared = std::async(std::launch::async,
+				                      [&]() { return prepare(next); });
+			}
+			start = now();
 			m_mlp->backward_path_2(std::get<1>(i), output_rates,
 			                       m_last_layer_only);
+			stage_time[3] += elapsed(start);
 
-			mnist_helper::update_conns_from_mat(m_mlp->get_weights(), netw, 1.0,
-			                                    m_weights_scale_factor);
+			start = now();
+			valid = m_pipeline ? prepared.get() : prepare(next);
+			stage_time[0] += elapsed(start);
+
+			start = now();
+			updater.update(m_mlp->get_weights(), netw);
+			stage_time[4] += elapsed(start);
 
 			// Calculate batch accuracy
-			auto labels = mnist_helper::spikes_to_labels(
-			    m_label_pops[0], m_duration, m_pause, m_batchsize, m_ttfs);
 			m_global_correct =
 			    mnist_helper::compare_labels(std::get<1>(i), labels);
 			m_num_images = std::get<1>(i).size();
@@ -645,32 +824,34 @@ void MnistITLLastLayer::run_netw(cypress::Network &netw)
 			                                        Real(m_num_images)));
 
 			accuracies.emplace_back(
-			    std::vector<Real>{Real(counter) / Real(m_batch_data.size()),
+			    std::vector<Real>{Real(counter) / Real(stream.batches()),
 			                      Real(m_global_correct) / Real(m_num_images)});
 			counter++;
+			std::swap(i, next);
 		}
 	}
+	global_logger().info(
+	    "SNABSuite",
+	    std::string("Training time per stage") +
+	        (m_pipeline ? " (pipelined)" : "") +
+	        ": spike sources: " + std::to_string(stage_time[0]) +
+	        " s, simulation: " + std::to_string(stage_time[1]) +
+	        " s, binning: " + std::to_string(stage_time[2]) +
+	        " s, learning: " + std::to_string(stage_time[3]) +
+	        " s, weight update: " + std::to_string(stage_time[4]) + " s");
 
 	m_global_correct = 0;
 	m_num_images = 0;
 	m_sim_time = 0.0;
 	size_t global_count = 0;
 	std::vector<size_t> local_count, pop_size, pids;
-	mnist_helper::SPIKING_MNIST test_data;
-	if (m_train_data == false) {
-		test_data = mnist_helper::mnist_to_spike(
-		    m_mlp->mnist_test_set(), m_duration, m_max_freq, m_num_test_images,
-		    m_poisson, m_ttfs);
-	}
-	else {
-		test_data = mnist_helper::mnist_to_spike(
-		    m_mlp->mnist_train_set(), m_duration, m_max_freq, m_num_test_images,
-		    m_poisson, m_ttfs);
-	}
-	m_batch_data = mnist_helper::create_batches(test_data, m_test_batchsize,
-	                                            m_duration, m_pause, true);
+	mnist_helper::SpikeBatchStream test_stream(
+	    m_train_data ? m_mlp->mnist_train_view() : m_mlp->mnist_test_view(),
+	    m_num_test_images, m_test_batchsize, m_duration, m_max_freq, m_pause,
+	    m_poisson, m_ttfs, true, 0, m_prefetch);
 	m_time_to_sol.clear();
-	for (auto &i : m_batch_data) {
+	mnist_helper::SPIKING_MNIST i;
+	while (test_stream.next(i)) {
 		mnist_helper::update_spike_source(source_n, i);
 		netw.run(pwbackend, m_test_batchsize * (m_duration + m_pause));
 
@@ -61,8 +61,9 @@ protected:
 	cypress::Real m_pool_inhib_weight;
 	cypress::Real m_pool_delay;
 
-	std::vector<mnist_helper::MNIST_DATA>
-	    m_batch_data;  // Spiking data for the network
+	std::vector<std::vector<uint16_t>>
+	    m_batch_labels;  // Labels of the batches in the network
+	size_t m_prefetch = 2;  // Batches encoded in advance, see SpikeBatchStream
 
 	bool m_batch_parallel = true;  // Run batches parallel (in one network)
 
@@ -83,6 +84,39 @@ protected:
 
 	bool m_count_spikes = false;
 	std::vector<cypress::PopulationBase> m_all_pops;
+	size_t m_mlp_threads = 1;  // Threads used by the MLP, 0 = all cores
+	mnist_helper::ConnectionCache
+	    m_conn_cache;  // Connection tables shared by all batch replicas
+	std::vector<Real> m_prune_thresholds;  // Pruning threshold per layer
+	size_t m_quantized_bits = 0;  // Report int8/int16 MLP accuracy, 0 = off
+	bool m_scale_cache = true;    // Cache activity based scale factors
+
+	/**
+	 * @brief Pruning threshold of a layer, see mnist_helper::prune_weight.
+	 * Config key "prune_threshold" is either a single value for all layers or
+	 * a list with one value per layer.
+	 *
+	 * @param layer position of the layer in the network
+	 * @return threshold, negative if the layer is not pruned
+	 */
+	Real prune_threshold(size_t layer) const;
+
+	/**
+	 * @brief Activity based rescaling of m_mlp with percentile
+	 * m_activity_based_scaling. The scale factors are cached in
+	 * "<m_dnn_file>.scales.json", keyed by the hash of the network file, so
+	 * that the calibration is only done once per network and percentile.
+	 *
+	 * @param use_cache false if the weights of m_mlp do not stem from
+	 * m_dnn_file
+	 */
+	void rescale_mlp(bool use_cache = true);
+
+	/**
+	 * @brief Logs the fraction of pruned synapses of a layer
+	 */
+	void report_pruning(const std::string &name, size_t kept,
+	                    size_t pruned) const;
 
 	/**
 	 * @brief Converts a prepared json to a network
@@ -243,7 +277,6 @@ protected:
 	    : MNIST_BASE(backend, bench_index, name)
 	{
 	}
-	mnist_helper::SPIKING_MNIST m_spmnist;
 
 	bool m_positive = false;
 	cypress::Real m_norm_rate_hidden = 1.0;
@@ -256,6 +289,7 @@ protected:
 	size_t m_num_test_images = 10000;
 	size_t m_test_batchsize = 0;
 	std::vector<Real> m_time_to_sol;
+	bool m_pipeline = false;  // Set spike sources of batch k+1 while learning
 };
 
 /**
@@ -17,9 +17,14 @@
  */
 
 #pragma once
+#include <Eigen/Dense>
 #include <algorithm>
 #include <cmath>
 #include <cypress/cypress.hpp>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include <type_traits>
 
 #include "helper_functions.hpp"
 namespace MNIST {
@@ -27,6 +32,51 @@ using cypress::Json;
 using cypress::Matrix;
 using cypress::Real;
 
+/**
+ * @brief Row-major Eigen matrix, same memory layout as cypress::Matrix. Used
+ * for the batched kernels of the MLP, where every row is one sample.
+ */
+using EMatrix =
+    Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using EVector = Eigen::Matrix<Real, Eigen::Dynamic, 1>;
+
+/**
+ * @brief Row-major Eigen matrix of any scalar type, used for the integer
+ * matrices of the quantized inference
+ */
+template <typename S>
+using RowMatrix =
+    Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+/**
+ * @brief Views a cypress matrix as Eigen matrix without copying
+ *
+ * @param mat the weight matrix
+ * @return Eigen::Map pointing to the memory of mat
+ */
+inline Eigen::Map<const EMatrix> to_eigen(const Matrix<Real> &mat)
+{
+	return Eigen::Map<const EMatrix>(&mat(0, 0), mat.rows(), mat.cols());
+}
+inline Eigen::Map<EMatrix> to_eigen(Matrix<Real> &mat)
+{
+	return Eigen::Map<EMatrix>(&mat(0, 0), mat.rows(), mat.cols());
+}
+
+/**
+ * @brief Views a vector as Eigen vector without copying
+ */
+inline Eigen::Map<const EVector> to_eigen(const std::vector<Real> &vec)
+{
+	return Eigen::Map<const EVector>(vec.data(), vec.size());
+}
+
+/**
+ * Policies below provide an in-place interface working on raw spans
+ * (pointer, size) which is used by the MLP kernels and does not allocate. The
+ * std::vector versions are convenience wrappers.
+ */
+
 /**
  * @brief Root Mean Squared Error
  *
@@ -48,18 +98,18 @@ public:
 		res = sqrt(res / Real(output.size()));
 		return res;
 	}
+	static inline void calc_error(const uint16_t label, const Real *output,
+	                              Real *error, size_t size)
+	{
+		for (size_t neuron = 0; neuron < size; neuron++) {
+			error[neuron] = output[neuron] - (label == neuron ? 1.0 : 0.0);
+		}
+	}
 	static inline std::vector<Real> calc_error(const uint16_t label,
 	                                           const std::vector<Real> &output)
 	{
 		std::vector<Real> res(output.size(), 0.0);
-		for (size_t neuron = 0; neuron < output.size(); neuron++) {
-			if (label == neuron) {
-				res[neuron] = output[neuron] - 1.0;
-			}
-			else {
-				res[neuron] = output[neuron] - 0.0;
-			}
-		}
+		calc_error(label, output.data(), res.data(), res.size());
 		return res;
 	}
 };
@@ -84,87 +134,104 @@ public:
 		}
 		return res;
 	}
-	static inline std::vector<Real> calc_error(const uint16_t label,
-	                                           const std::vector<Real> &output)
+	static inline void calc_error(const uint16_t label, const Real *output,
+	                              Real *error, size_t size)
 	{
-		// Real pos = output[label];
-		std::vector<Real> vec = output;
-		vec[label] = -0.0;
-		auto neg_elem = std::max_element(vec.begin(), vec.end());
-		auto index = std::distance(vec.begin(), neg_elem);
-		auto res = std::vector<Real>(output.size(), 0.0);
+		// Most active neuron, the label neuron counts as -0.0
+		size_t index = 0;
+		Real max = label == 0 ? -0.0 : output[0];
+		for (size_t neuron = 0; neuron < size; neuron++) {
+			Real value = label == neuron ? -0.0 : output[neuron];
+			if (value > max) {
+				max = value;
+				index = neuron;
+			}
+			error[neuron] = 0.0;
+		}
 
 		// Require that label neuron and the next most active neuron have at
 		// least a difference of 1
-		if ((*neg_elem) - output[label] + 1 >= 0.0) {
-			res[label] = -1.0;
+		if (max - output[label] + 1 >= 0.0) {
+			error[label] = -1.0;
 			if (label != index) {
-				res[index] = +1;
+				error[index] = +1;
 			}
 		}
+	}
+	static inline std::vector<Real> calc_error(const uint16_t label,
+	                                           const std::vector<Real> &output)
+	{
+		std::vector<Real> res(output.size(), 0.0);
+		calc_error(label, output.data(), res.data(), res.size());
 		return res;
 	}
 };
 
 /**
- * @brief ActivationFunction ReLU: Rectified Linear Unit
- *
+ * @brief Provides the in-place span and the std::vector interface of an
+ * activation function from its scalar function() and derivative()
  */
-class ReLU {
+template <typename Derived>
+class ElementwiseActivation {
 public:
-	static inline std::vector<Real> function(std::vector<Real> input)
+	static inline void function(Real *data, size_t size)
 	{
-		for (auto &i : input) {
-			i = std::max(0.0, i);
+		for (size_t i = 0; i < size; i++) {
+			data[i] = Derived::function(data[i]);
 		}
-		return input;
 	}
-	static inline std::vector<Real> derivative(std::vector<Real> input)
+	static inline void derivative(Real *data, size_t size)
 	{
-		for (auto &i : input) {
-			i = i >= 0 ? 1.0 : 0.0;
+		for (size_t i = 0; i < size; i++) {
+			data[i] = Derived::derivative(data[i]);
 		}
-		return input;
 	}
-};
-
-class Sigmoid {
-public:
 	static inline std::vector<Real> function(std::vector<Real> input)
 	{
-		for (auto &i : input) {
-			i = 1.0 / (1.0 + std::exp(-i));
-		}
+		function(input.data(), input.size());
 		return input;
 	}
 	static inline std::vector<Real> derivative(std::vector<Real> input)
 	{
-		for (auto &i : input) {
-			Real temp = std::exp(i);
-			i = temp / ((1.0 + temp) * (1.0 + temp));
-		}
+		derivative(input.data(), input.size());
 		return input;
-		// function(input) * (1.0-function(input));
 	}
 };
 
+/**
+ * @brief ActivationFunction ReLU: Rectified Linear Unit
+ *
+ */
+class ReLU : public ElementwiseActivation<ReLU> {
+public:
+	using ElementwiseActivation<ReLU>::function;
+	using ElementwiseActivation<ReLU>::derivative;
+	static inline Real function(Real x) { return std::max(0.0, x); }
+	static inline Real derivative(Real x) { return x >= 0 ? 1.0 : 0.0; }
+};
 
-class Tanh {
+class Sigmoid : public ElementwiseActivation<Sigmoid> {
 public:
-	static inline std::vector<Real> function(std::vector<Real> input)
+	using ElementwiseActivation<Sigmoid>::function;
+	using ElementwiseActivation<Sigmoid>::derivative;
+	static inline Real function(Real x) { return 1.0 / (1.0 + std::exp(-x)); }
+	static inline Real derivative(Real x)
 	{
-		for (auto &i : input) {
-			i = std::tanh(i);
-		}
-		return input;
+		Real temp = std::exp(x);
+		return temp / ((1.0 + temp) * (1.0 + temp));
+		// function(input) * (1.0-function(input));
 	}
-	static inline std::vector<Real> derivative(std::vector<Real> input)
+};
+
+class Tanh : public ElementwiseActivation<Tanh> {
+public:
+	using ElementwiseActivation<Tanh>::function;
+	using ElementwiseActivation<Tanh>::derivative;
+	static inline Real function(Real x) { return std::tanh(x); }
+	static inline Real derivative(Real x)
 	{
-		for (auto &i : input) {
-			Real temp = std::tanh(i);
-			i = 1.0 - temp*temp;
-		}
-		return input;
+		Real temp = std::tanh(x);
+		return 1.0 - temp * temp;
 		// function(input) * (1.0-function(input));
 	}
 };
@@ -243,8 +310,12 @@ public:
 	virtual const size_t &epochs() const = 0;
 	virtual const size_t &batchsize() const = 0;
 	virtual const Real &learnrate() const = 0;
+	virtual const size_t &threads() const = 0;
+	virtual void set_threads(size_t threads) = 0;
 	virtual const mnist_helper::MNIST_DATA &mnist_train_set() = 0;
 	virtual const mnist_helper::MNIST_DATA &mnist_test_set() = 0;
+	virtual mnist_helper::MnistView mnist_train_view() const = 0;
+	virtual mnist_helper::MnistView mnist_test_view() const = 0;
 	virtual const std::vector<cypress::Matrix<Real>> &get_weights() = 0;
 	virtual const std::vector<mnist_helper::CONVOLUTION_LAYER> &get_conv_layers() = 0;
 	virtual const std::vector<mnist_helper::POOLING_LAYER> &get_pooling_layers() = 0;
@@ -256,6 +327,8 @@ public:
 	virtual std::vector<std::vector<std::vector<Real>>> forward_path(
 	    const std::vector<size_t> &indices, const size_t start) const = 0;
 	virtual Real forward_path_test() const = 0;
+	virtual Real forward_path_test_quantized(size_t bits = 8,
+	                                         size_t percentile = 100) const = 0;
 	virtual void backward_path(
 	    const std::vector<size_t> &indices, const size_t start,
 	    const std::vector<std::vector<std::vector<Real>>> &activations,
@@ -271,6 +344,8 @@ public:
 	virtual ~MLPBase() = default;
 	virtual const std::vector<Real> &rescale_weights(size_t percentile,
 	                                                 bool schedule = false) = 0;
+	virtual const std::vector<Real> &rescale_weights(
+	    const std::vector<Real> &scale_factors) = 0;
 };
 
 /**
@@ -291,19 +366,133 @@ protected:
 	size_t m_epochs = 20;
 	size_t m_batchsize = 100;
 	Real learn_rate = 0.01;
+	size_t m_threads = 1;  // Worker threads for batch-parallel training
+	// Mapped data sets, images are normalized when they are used
+	std::shared_ptr<mnist_helper::MnistIdx> m_mnist_idx;
+	std::shared_ptr<mnist_helper::MnistIdx> m_mnist_test_idx;
+	// Converted data sets, only filled on request or by scale_down_images
 	mnist_helper::MNIST_DATA m_mnist;
 	mnist_helper::MNIST_DATA m_mnist_test;
 
 	void load_data(std::string path)
 	{
-		m_mnist = mnist_helper::loadMnistData(60000, path + "train");
-		m_mnist_test = mnist_helper::loadMnistData(10000, path + "t10k");
+		m_mnist_idx =
+		    std::make_shared<mnist_helper::MnistIdx>(path + "train", 60000);
+		m_mnist_test_idx =
+		    std::make_shared<mnist_helper::MnistIdx>(path + "t10k", 10000);
+		m_mnist = mnist_helper::MNIST_DATA();
+		m_mnist_test = mnist_helper::MNIST_DATA();
 	}
 
 	Constraint m_constraint;
 	bool m_scaled_layerwise = false;
 	std::vector<Real> m_scale_factors;
 
+	/**
+	 * @brief Output sizes (x, y, z) of the last layer, which has to be a
+	 * convolution or pooling layer
+	 *
+	 * @param name name of the following layer, used in error messages
+	 */
+	std::vector<size_t> last_output_sizes(const std::string &name) const
+	{
+		if (m_layer_types.empty()) {
+			throw std::runtime_error(name +
+			                         " layer must not be the first layer!");
+		}
+		if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Conv) {
+			return m_filters.back().output_sizes;
+		}
+		if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Pooling) {
+			return m_pools.back().output_sizes;
+		}
+		throw std::runtime_error(name + " after Dense layer not implemented!");
+	}
+
+	/**
+	 * @brief Appends a dense layer with uninitialized weights
+	 *
+	 * @return the weight matrix (input x output)
+	 */
+	Matrix<Real> &add_dense_layer(size_t rows, size_t cols)
+	{
+		m_layers.emplace_back(Matrix<Real>(rows, cols));
+		m_layer_sizes.emplace_back(rows);
+		m_layer_types.push_back(mnist_helper::LAYER_TYPE::Dense);
+		cypress::global_logger().debug(
+		    "MNIST", "Dense layer detected with size " + std::to_string(rows) +
+		                 " times " + std::to_string(cols));
+		return m_layers.back();
+	}
+
+	/**
+	 * @brief Appends a convolution layer with zero weights
+	 *
+	 * @param shape kernel size x, y, z and number of filters
+	 * @param stride stride of the kernel
+	 * @param padding 0 for "valid" padding
+	 * @param input_sizes input size (x, y, z), empty to use the output of the
+	 * previous layer
+	 * @return the filter (x, y, z, filter)
+	 */
+	mnist_helper::CONVOLUTION_FILTER &add_conv_layer(
+	    const std::vector<size_t> &shape, size_t stride, size_t padding,
+	    std::vector<size_t> input_sizes)
+	{
+		if (input_sizes.empty()) {
+			input_sizes = last_output_sizes("Conv");
+		}
+		std::vector<size_t> output_sizes;
+		output_sizes.push_back((input_sizes[0] - shape[0] + 2 * padding) /
+		                           stride +
+		                       1);
+		output_sizes.push_back((input_sizes[1] - shape[0] + 2 * padding) /
+		                           stride +
+		                       1);
+		output_sizes.push_back(shape[3]);
+		mnist_helper::CONVOLUTION_FILTER conv_filter(
+		    shape[0], std::vector<std::vector<std::vector<Real>>>(
+		                  shape[1], std::vector<std::vector<Real>>(
+		                                shape[2], std::vector<Real>(shape[3]))));
+		m_filters.emplace_back(mnist_helper::CONVOLUTION_LAYER{
+		    conv_filter, input_sizes, output_sizes, stride, padding});
+		m_layer_sizes.emplace_back(input_sizes[0] * input_sizes[1] *
+		                           input_sizes[2]);
+		m_layer_types.push_back(mnist_helper::LAYER_TYPE::Conv);
+		cypress::global_logger().debug(
+		    "MNIST", "Conv layer detected with size (" +
+		                 std::to_string(shape[0]) + "," +
+		                 std::to_string(shape[1]) + "," +
+		                 std::to_string(shape[2]) + "," +
+		                 std::to_string(shape[3]) + ")");
+		return m_filters.back().filter;
+	}
+
+	/**
+	 * @brief Appends a max pooling layer after a convolution or pooling layer
+	 *
+	 * @param size size (x, y) of the pooling window
+	 * @param stride stride of the window
+	 */
+	void add_pool_layer(const std::vector<size_t> &size, size_t stride)
+	{
+		auto input_sizes = last_output_sizes("Pooling");
+		std::vector<size_t> output_sizes;
+		output_sizes.push_back((input_sizes[0] - size[0]) / stride + 1);
+		output_sizes.push_back((input_sizes[1] - size[1]) / stride + 1);
+		output_sizes.push_back(input_sizes[2]);
+		m_pools.emplace_back(mnist_helper::POOLING_LAYER{
+		    input_sizes, output_sizes, size, stride});
+		m_layer_sizes.emplace_back(input_sizes[0] * input_sizes[1] *
+		                           input_sizes[2]);
+		m_layer_types.emplace_back(mnist_helper::LAYER_TYPE::Pooling);
+		cypress::global_logger().debug(
+		    "MNIST", "Pooling layer detected with size (" +
+		                 std::to_string(size[0]) + ", " +
+		                 std::to_string(size[1]) + ") and stride " +
+		                 std::to_string(stride));
+	}
+
 public:
 	/**
 	 * @brief Constructor for random init
@@ -326,6 +515,7 @@ public:
 		for (size_t i = 0; i < layer_sizes.size() - 1; i++) {
 			m_layers.emplace_back(
 			    Matrix<Real>(layer_sizes[i], layer_sizes[i + 1]));
+			m_layer_types.push_back(mnist_helper::LAYER_TYPE::Dense);
 		}
 
 		int seed = std::chrono::system_clock::now().time_since_epoch().count();
@@ -382,9 +572,7 @@ public:
 		for (auto &layer : data["netw"]) {
 			if (layer["class_name"].get<std::string>() == "Dense") {
 				auto &json = layer["weights"];
-				m_layers.emplace_back(
-				    Matrix<Real>(json.size(), json[0].size()));
-				auto &weights = m_layers.back();
+				auto &weights = add_dense_layer(json.size(), json[0].size());
 				auto scale = std::sqrt(2.0 / double(weights.rows()));
 				for (size_t i = 0; i < json.size(); i++) {
 					for (size_t j = 0; j < json[i].size(); j++) {
@@ -396,115 +584,120 @@ public:
 						}
 					}
 				}
-                m_layer_sizes.emplace_back(m_layers.back().rows());
-                m_layer_types.push_back(mnist_helper::LAYER_TYPE::Dense);
-				cypress::global_logger().debug(
-				    "MNIST", "Dense layer detected with size " +
-				                 std::to_string(weights.rows()) + " times " +
-				                 std::to_string(weights.cols()));
 			}
 			else if (layer["class_name"].get<std::string>() == "Conv2D") {
-                auto &json = layer["weights"];
-				size_t kernel_x = json.size();
-				size_t kernel_y = json[0].size();
-				size_t kernel_z = json[0][0].size();
-				size_t output = json[0][0][0].size();
-				size_t stride = layer["stride"];
-                size_t padding = layer["padding"] == "valid" ? 0 : 1;
+				auto &json = layer["weights"];
 				std::vector<size_t> input_sizes;
-				std::vector<size_t> output_sizes;
-                if (!layer["input_shape_x"].empty()){
-                    input_sizes.push_back(layer["input_shape_x"]);
-                    input_sizes.push_back(layer["input_shape_y"]);
-                    input_sizes.push_back(layer["input_shape_z"]);
-                } else {
-					if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Conv) {
-						input_sizes.push_back(m_filters.back().output_sizes[0]);
-						input_sizes.push_back(m_filters.back().output_sizes[1]);
-						input_sizes.push_back(m_filters.back().output_sizes[2]);
-					} else if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Pooling) {
-						input_sizes.push_back(m_pools.back().output_sizes[0]);
-						input_sizes.push_back(m_pools.back().output_sizes[1]);
-						input_sizes.push_back(m_pools.back().output_sizes[2]);
-					} else if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Dense) {
-						throw std::runtime_error("Conv after Dense layer not implemented!");
-					}
+				if (!layer["input_shape_x"].empty()) {
+					input_sizes.push_back(layer["input_shape_x"]);
+					input_sizes.push_back(layer["input_shape_y"]);
+					input_sizes.push_back(layer["input_shape_z"]);
 				}
-				output_sizes.push_back((input_sizes[0] - kernel_x + 2*padding)/stride+1);
-				output_sizes.push_back((input_sizes[1] - kernel_x + 2*padding)/stride+1);
-				output_sizes.push_back(output);
-				mnist_helper::CONVOLUTION_FILTER conv_filter(
-				    kernel_x,
-				    std::vector<std::vector<std::vector<Real>>>(kernel_y,
-				    std::vector<std::vector<Real>>(kernel_z,
-				    std::vector<Real>(output)))
-				    );
-				mnist_helper::CONVOLUTION_LAYER conv = {
-				    conv_filter,
-				    input_sizes,
-				    output_sizes,
-				    stride,
-				    padding};
-				m_filters.emplace_back(conv);
-				auto &weights = m_filters.back().filter;
-				//auto scale = std::sqrt(2.0 / double(weights.rows()));
-				for (size_t i = 0; i < json.size(); i++){
-					for (size_t j = 0; j < json[i].size(); j++){
-						for (size_t k = 0; k < json[i][j].size(); k++){
-							for (size_t l = 0 ; l < json[i][j][k].size(); l++){
-								weights[i][j][k][l] = json[i][j][k][l].get<Real>();
+				auto &weights = add_conv_layer(
+				    {json.size(), json[0].size(), json[0][0].size(),
+				     json[0][0][0].size()},
+				    layer["stride"].get<size_t>(),
+				    layer["padding"] == "valid" ? 0 : 1, input_sizes);
+				for (size_t i = 0; i < json.size(); i++) {
+					for (size_t j = 0; j < json[i].size(); j++) {
+						for (size_t k = 0; k < json[i][j].size(); k++) {
+							for (size_t l = 0; l < json[i][j][k].size(); l++) {
+								weights[i][j][k][l] =
+								    json[i][j][k][l].get<Real>();
 							}
 						}
 					}
 				}
-				m_layer_sizes.emplace_back(input_sizes[0] * input_sizes[1] * input_sizes[2]);
-                m_layer_types.push_back(mnist_helper::LAYER_TYPE::Conv);
-				cypress::global_logger().debug(
-				    "MNIST", "Conv layer detected with size ("+
-				        std::to_string(json.size())+","+std::to_string(json[0].size())+
-				        ","+std::to_string(json[0][0].size())+","+std::to_string(json[0][0][0].size())+")");
-			} else if(layer["class_name"].get<std::string>() == "MaxPooling2D"){
-				std::vector<size_t> size = layer["size"];
-				size_t stride = layer["stride"];
-				std::vector<size_t> input_sizes;
-				std::vector<size_t> output_sizes;
-				if (m_layer_types.empty()){
-					throw std::runtime_error("Pooling layer must not be the first layer!");
-				}
-                if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Conv){
-                    input_sizes.push_back(m_filters.back().output_sizes[0]);
-                    input_sizes.push_back(m_filters.back().output_sizes[1]);
-                    input_sizes.push_back(m_filters.back().output_sizes[2]);
-                } else if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Pooling){
-                    input_sizes.push_back(m_pools.back().output_sizes[0]);
-                    input_sizes.push_back(m_pools.back().output_sizes[1]);
-                    input_sizes.push_back(m_pools.back().output_sizes[2]);
-                } else if (m_layer_types.back() == mnist_helper::LAYER_TYPE::Dense){
-                    throw std::runtime_error("Pooling after Dense not implemented!");
-                }
-				output_sizes.push_back((input_sizes[0] - size[0] + 2*0)/stride+1);
-				output_sizes.push_back((input_sizes[1] - size[1] + 2*0)/stride+1);
-				output_sizes.push_back(input_sizes[2]);
-				mnist_helper::POOLING_LAYER pool = {input_sizes, output_sizes, size, stride};
-                m_pools.emplace_back(pool);
-                m_layer_sizes.emplace_back(input_sizes[0] * input_sizes[1] * input_sizes[2]);
-				m_layer_types.emplace_back(mnist_helper::LAYER_TYPE::Pooling);
-				cypress::global_logger().debug(
-				    "MNIST", "Pooling layer detected with size (" +
-				                 std::to_string(size[0]) + ", " + std::to_string(size[1]) +
-				                ") and stride " + std::to_string(stride));
+			}
+			else if (layer["class_name"].get<std::string>() ==
+			         "MaxPooling2D") {
+				add_pool_layer(layer["size"].get<std::vector<size_t>>(),
+				               layer["stride"].get<size_t>());
 			}
 			else {
 				throw std::runtime_error("Unknown layer type");
 			}
 		}
 		m_layer_sizes.push_back(m_layers.back().cols());
-//		for (auto &layer : m_layers) {
-//			m_layer_sizes.emplace_back(layer.cols());
-//		}
 
-		m_mnist = mnist_helper::loadMnistData(60000, "train");
-		m_mnist_test = mnist_helper::loadMnistData(10000, "t10k");
+		load_data("");
+		m_constraint.setup(m_layers);
+	}
+
+	/**
+	 * @brief Constructs the network from a file in the native binary format,
+	 * see mnist_helper::NetworkFile. Weights are copied block-wise from the
+	 * mapped file, no parsing is involved.
+	 *
+	 * @param file mapped network file
+	 * @param epochs number of epochs to train
+	 * @param batchsize mini batchsize before updating the weights
+	 * @param learn_rate gradients are multiplied with this rate
+	 * @param random Use structure from file, initialize weights random if true
+	 * @param constrain constrains the weights during training, defaults to no
+	 * constraint
+	 */
+	MLP(const mnist_helper::NetworkFile &file, size_t epochs = 20,
+	    size_t batchsize = 100, Real learn_rate = 0.01, bool random = false,
+	    Constraint constraint = Constraint())
+	    : m_epochs(epochs),
+	      m_batchsize(batchsize),
+	      learn_rate(learn_rate),
+	      m_constraint(constraint)
+	{
+		int seed = std::chrono::system_clock::now().time_since_epoch().count();
+		auto rng = std::default_random_engine(seed);
+		std::normal_distribution<Real> distribution(0.0, 1.0);
+		for (size_t id = 0; id < file.size(); id++) {
+			const auto &layer = file.layer(id);
+			const Real *data = file.weights(id);
+			switch (layer.type) {
+				case mnist_helper::LAYER_TYPE::Dense: {
+					auto &weights =
+					    add_dense_layer(layer.shape[0], layer.shape[1]);
+					if (!random) {
+						std::copy(data, data + weights.size(),
+						          weights.begin());
+						break;
+					}
+					auto scale = std::sqrt(2.0 / double(weights.rows()));
+					for (auto &w : weights) {
+						w = distribution(rng) * scale;
+					}
+					break;
+				}
+				case mnist_helper::LAYER_TYPE::Conv: {
+					std::vector<size_t> input_sizes;
+					if (layer.input_shape[0]) {
+						input_sizes.assign(layer.input_shape,
+						                   layer.input_shape + 3);
+					}
+					auto &weights = add_conv_layer(
+					    std::vector<size_t>(layer.shape, layer.shape + 4),
+					    layer.stride, layer.padding, input_sizes);
+					for (auto &x : weights) {
+						for (auto &y : x) {
+							for (auto &z : y) {
+								std::copy(data, data + z.size(), z.begin());
+								data += z.size();
+							}
+						}
+					}
+					break;
+				}
+				case mnist_helper::LAYER_TYPE::Pooling:
+					add_pool_layer(
+					    std::vector<size_t>(layer.shape, layer.shape + 2),
+					    layer.stride);
+					break;
+			}
+		}
+		if (m_layers.empty()) {
+			throw std::runtime_error("Network file without dense layer!");
+		}
+		m_layer_sizes.push_back(m_layers.back().cols());
+
+		load_data("");
 		m_constraint.setup(m_layers);
 	}
 
@@ -577,24 +770,72 @@ public:
 
 	const size_t &epochs() const override { return m_epochs; }
 	const size_t &batchsize() const override { return m_batchsize; }
+	const size_t &threads() const override { return m_threads; }
+
+	/**
+	 * @brief Sets the number of threads used for training and inference.
+	 * Every mini-batch is split into contiguous parts processed in parallel,
+	 * gradients are reduced in a fixed order. Hence, results are
+	 * deterministic for a given seed and number of threads.
+	 *
+	 * @param threads number of worker threads, 0 uses all hardware threads
+	 */
+	void set_threads(size_t threads) override
+	{
+		if (threads == 0) {
+			threads = std::max(size_t(std::thread::hardware_concurrency()),
+			                   size_t(1));
+		}
+		m_threads = threads;
+	}
 	const Real &learnrate() const override { return learn_rate; }
 
 	/**
-	 * @brief Returns reference to the train data
+	 * @brief Returns reference to the train data. The images are converted
+	 * to Real on the first call, prefer mnist_train_view()
 	 *
 	 * @return const mnist_helper::MNIST_DATA&
 	 */
 	const mnist_helper::MNIST_DATA &mnist_train_set() override
 	{
+		if (std::get<0>(m_mnist).empty() && m_mnist_idx) {
+			m_mnist = mnist_helper::to_mnist_data(*m_mnist_idx);
+		}
 		return m_mnist;
 	}
 	/**
-	 * @brief Returns reference to the test data
+	 * @brief Returns reference to the test data. The images are converted to
+	 * Real on the first call, prefer mnist_test_view()
 	 *
 	 * @return const mnist_helper::MNIST_DATA&
 	 */
 	const mnist_helper::MNIST_DATA &mnist_test_set() override
 	{
+		if (std::get<0>(m_mnist_test).empty() && m_mnist_test_idx) {
+			m_mnist_test = mnist_helper::to_mnist_data(*m_mnist_test_idx);
+		}
+		return m_mnist_test;
+	}
+
+	/**
+	 * @brief View of the train data without converting all images
+	 */
+	mnist_helper::MnistView mnist_train_view() const override
+	{
+		if (std::get<0>(m_mnist).empty() && m_mnist_idx) {
+			return *m_mnist_idx;
+		}
+		return m_mnist;
+	}
+
+	/**
+	 * @brief View of the test data without converting all images
+	 */
+	mnist_helper::MnistView mnist_test_view() const override
+	{
+		if (std::get<0>(m_mnist_test).empty() && m_mnist_test_idx) {
+			return *m_mnist_test_idx;
+		}
 		return m_mnist_test;
 	}
 
@@ -647,8 +888,11 @@ public:
 	 */
 	void scale_down_images(size_t pooling_size = 3) override
 	{
-		m_mnist = mnist_helper::scale_mnist(m_mnist, pooling_size);
-		m_mnist_test = mnist_helper::scale_mnist(m_mnist_test, pooling_size);
+		// Scaled from the view, the full size images are never converted
+		auto train = mnist_helper::scale_mnist(mnist_train_view(), pooling_size);
+		auto test = mnist_helper::scale_mnist(mnist_test_view(), pooling_size);
+		m_mnist = std::move(train);
+		m_mnist_test = std::move(test);
 	}
 
 	/**
@@ -665,11 +909,8 @@ public:
 		assert(mat.cols() == vec.size());
 #endif
 		std::vector<Real> res(mat.rows(), 0.0);
-		for (size_t i = 0; i < mat.rows(); i++) {
-			for (size_t j = 0; j < mat.cols(); j++) {
-				res[i] += mat(i, j) * vec[j];
-			}
-		}
+		Eigen::Map<EVector>(res.data(), res.size()).noalias() =
+		    to_eigen(mat) * to_eigen(vec);
 		return res;
 	}
 
@@ -687,11 +928,8 @@ public:
 		assert(mat.rows() == vec.size());
 #endif
 		std::vector<Real> res(mat.cols(), 0.0);
-		for (size_t i = 0; i < mat.cols(); i++) {
-			for (size_t j = 0; j < mat.rows(); j++) {
-				res[i] += mat(j, i) * vec[j];
-			}
-		}
+		Eigen::Map<EVector>(res.data(), res.size()).noalias() =
+		    to_eigen(mat).transpose() * to_eigen(vec);
 		return res;
 	}
 
@@ -709,12 +947,60 @@ public:
 		assert(vec1.size() == vec2.size());
 #endif
 		std::vector<Real> res(vec1.size());
-		for (size_t i = 0; i < vec1.size(); i++) {
-			res[i] = vec1[i] * vec2[i];
-		}
+		Eigen::Map<EVector>(res.data(), res.size()) =
+		    to_eigen(vec1).cwiseProduct(to_eigen(vec2));
 		return res;
 	}
 
+	/**
+	 * @brief Applies the activation function to a whole batch in place
+	 *
+	 * @param mat batch of values, overwritten with the result
+	 */
+	static inline void activate(EMatrix &mat)
+	{
+		ActivationFunction::function(mat.data(), size_t(mat.size()));
+	}
+
+	/**
+	 * @brief Multiplies an error element-wise with the derivative of the
+	 * activation function, evaluated at the given activations. Fused into a
+	 * single pass without temporaries.
+	 *
+	 * @param error error(sample, neuron), overwritten with the result
+	 * @param activations activations(sample, neuron) of the same layer
+	 */
+	static inline void mul_derivative(EMatrix &error,
+	                                  const EMatrix &activations)
+	{
+		Real *err = error.data();
+		const Real *act = activations.data();
+		for (Eigen::Index i = 0; i < error.size(); i++) {
+			err[i] *= ActivationFunction::derivative(act[i]);
+		}
+	}
+
+	/**
+	 * @brief Error of the output layer of a whole batch: loss gradient times
+	 * derivative of the activation function
+	 *
+	 * @param labels labels of all samples in the batch
+	 * @param output output layer activations, output(sample, neuron)
+	 * @return error(sample, neuron)
+	 */
+	static inline EMatrix output_error(const std::vector<uint16_t> &labels,
+	                                   const EMatrix &output)
+	{
+		EMatrix error(output.rows(), output.cols());
+		const size_t cols = output.cols();
+		for (Eigen::Index sample = 0; sample < output.rows(); sample++) {
+			Loss::calc_error(labels[sample], output.data() + sample * cols,
+			                 error.data() + sample * cols, cols);
+		}
+		mul_derivative(error, output);
+		return error;
+	}
+
 	/**
 	 * @brief Checks if the output of the network was correct
 	 *
@@ -750,15 +1036,535 @@ public:
 		assert(mat.rows() == pre_output.size());
 		assert(mat.cols() == errors.size());
 #endif
-		Real sample_num_r(sample_num);
-		for (size_t i = 0; i < mat.rows(); i++) {
-			for (size_t j = 0; j < mat.cols(); j++) {
-				mat(i, j) = mat(i, j) - learn_rate * pre_output[i] * errors[j] /
-				                            sample_num_r;
+		to_eigen(mat).noalias() -= (learn_rate / Real(sample_num)) *
+		                           to_eigen(pre_output) *
+		                           to_eigen(errors).transpose();
+	}
+
+	/**
+	 * @brief Collects a batch of input images into one matrix
+	 *
+	 * @param images the image data set
+	 * @param indices list of shuffled (?) indices
+	 * @param start uses images indices[start] until indices[start + n - 1]
+	 * @param n number of images in the batch
+	 * @return input(sample, pixel)
+	 */
+	static inline EMatrix batch_input(const mnist_helper::MnistView &images,
+	                                  const std::vector<size_t> &indices,
+	                                  size_t start, size_t n)
+	{
+		EMatrix input(n, n > 0 ? images.pixels() : 0);
+		for (size_t sample = 0; sample < n; sample++) {
+			// Rows are contiguous, images are normalized in place
+			images.image(indices[start + sample], input.row(sample).data());
+		}
+		return input;
+	}
+
+	/**
+	 * @brief Number of samples in the batch starting at @param start,
+	 * the last batch of an epoch may be smaller than @param batchsize
+	 */
+	static inline size_t batch_samples(const std::vector<size_t> &indices,
+	                                   size_t start, size_t batchsize)
+	{
+		if (start >= indices.size()) {
+			return 0;
+		}
+		return std::min(batchsize, indices.size() - start);
+	}
+
+	/**
+	 * @brief Converts the filters of a convolution layer to a matrix with one
+	 * row per kernel position (x, y, z) and one column per filter
+	 *
+	 * @param layer the convolution layer
+	 * @return filter matrix as used by conv_forward
+	 */
+	static inline EMatrix filter_matrix(
+	    const mnist_helper::CONVOLUTION_LAYER &layer)
+	{
+		const auto &filter = layer.filter;
+		size_t kx = filter.size(), ky = filter[0].size(),
+		       kz = filter[0][0].size();
+		EMatrix mat(kx * ky * kz, layer.output_sizes[2]);
+		for (size_t x = 0; x < kx; x++) {
+			for (size_t y = 0; y < ky; y++) {
+				for (size_t z = 0; z < kz; z++) {
+					for (size_t f = 0; f < layer.output_sizes[2]; f++) {
+						mat((x * ky + y) * kz + z, f) = filter[x][y][z][f];
+					}
+				}
+			}
+		}
+		return mat;
+	}
+
+	/**
+	 * @brief Copies all receptive fields of one image into the rows of a
+	 * matrix (im2col). Images are stored in NHWC order, i.e. the index of
+	 * pixel (x, y, channel) is (x * width + y) * channels + channel, which is
+	 * the neuron numbering used by conv_weights_to_conn. Positions in the
+	 * padding are zero. Works on real valued and on quantized images.
+	 *
+	 * @param image pointer to the first pixel of the image
+	 * @param layer the convolution layer
+	 * @param cols one row per output position, one column per kernel position
+	 */
+	template <typename S>
+	static inline void im2col(const S *image,
+	                          const mnist_helper::CONVOLUTION_LAYER &layer,
+	                          RowMatrix<S> &cols)
+	{
+		const auto &in = layer.input_sizes;
+		const auto &out = layer.output_sizes;
+		size_t kx = layer.filter.size(), ky = layer.filter[0].size(),
+		       kz = layer.filter[0][0].size();
+		cols.resize(out[0] * out[1], kx * ky * kz);
+		for (size_t ox = 0; ox < out[0]; ox++) {
+			for (size_t oy = 0; oy < out[1]; oy++) {
+				S *row = &cols((ox * out[1] + oy), 0);
+				for (size_t x = 0; x < kx; x++) {
+					long ix = long(ox * layer.stride + x) - long(layer.padding);
+					for (size_t y = 0; y < ky; y++) {
+						long iy =
+						    long(oy * layer.stride + y) - long(layer.padding);
+						S *dst = row + (x * ky + y) * kz;
+						if (ix < 0 || iy < 0 || ix >= long(in[0]) ||
+						    iy >= long(in[1])) {
+							std::fill(dst, dst + kz, S(0));
+							continue;
+						}
+						const S *src = image + (ix * in[1] + iy) * in[2];
+						std::copy(src, src + kz, dst);
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Inverse of im2col: adds the entries of cols to the image pixels
+	 * they were taken from
+	 *
+	 * @param cols matrix in the format of im2col
+	 * @param layer the convolution layer
+	 * @param image pointer to the first pixel of the image, accumulated
+	 */
+	static inline void col2im(const EMatrix &cols,
+	                          const mnist_helper::CONVOLUTION_LAYER &layer,
+	                          Real *image)
+	{
+		const auto &in = layer.input_sizes;
+		const auto &out = layer.output_sizes;
+		size_t kx = layer.filter.size(), ky = layer.filter[0].size(),
+		       kz = layer.filter[0][0].size();
+		for (size_t ox = 0; ox < out[0]; ox++) {
+			for (size_t oy = 0; oy < out[1]; oy++) {
+				const Real *row = &cols((ox * out[1] + oy), 0);
+				for (size_t x = 0; x < kx; x++) {
+					long ix = long(ox * layer.stride + x) - long(layer.padding);
+					for (size_t y = 0; y < ky; y++) {
+						long iy =
+						    long(oy * layer.stride + y) - long(layer.padding);
+						if (ix < 0 || iy < 0 || ix >= long(in[0]) ||
+						    iy >= long(in[1])) {
+							continue;
+						}
+						const Real *src = row + (x * ky + y) * kz;
+						Real *dst = image + (ix * in[1] + iy) * in[2];
+						for (size_t z = 0; z < kz; z++) {
+							dst[z] += src[z];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	/**
+	 * @brief Convolution of a batch of images (without activation function).
+	 * Every image is converted by im2col and multiplied with the filter
+	 * matrix, which directly results in the NHWC layout of the output.
+	 *
+	 * @param input input(sample, pixel)
+	 * @param layer the convolution layer
+	 * @return output(sample, neuron)
+	 */
+	static inline EMatrix conv_forward(
+	    const EMatrix &input, const mnist_helper::CONVOLUTION_LAYER &layer)
+	{
+		const auto &out = layer.output_sizes;
+		EMatrix weights = filter_matrix(layer);
+		EMatrix output(input.rows(), out[0] * out[1] * out[2]);
+		EMatrix cols;
+		for (Eigen::Index sample = 0; sample < input.rows(); sample++) {
+			im2col(input.data() + sample * input.cols(), layer, cols);
+			Eigen::Map<EMatrix>(output.data() + sample * output.cols(),
+			                    out[0] * out[1], out[2])
+			    .noalias() = cols * weights;
+		}
+		return output;
+	}
+
+	/**
+	 * @brief Backward path of a convolution layer
+	 *
+	 * @param input input of the layer, input(sample, pixel)
+	 * @param error error at the output of the layer, error(sample, neuron)
+	 * @param layer the convolution layer
+	 * @param gradient gradient of the filter matrix (see filter_matrix)
+	 * @param input_error if not null, error at the input of the layer
+	 */
+	static inline void conv_backward(
+	    const EMatrix &input, const EMatrix &error,
+	    const mnist_helper::CONVOLUTION_LAYER &layer, EMatrix &gradient,
+	    EMatrix *input_error)
+	{
+		const auto &out = layer.output_sizes;
+		EMatrix weights = filter_matrix(layer);
+		gradient = EMatrix::Zero(weights.rows(), weights.cols());
+		if (input_error) {
+			*input_error = EMatrix::Zero(input.rows(), input.cols());
+		}
+		EMatrix cols, error_cols;
+		for (Eigen::Index sample = 0; sample < input.rows(); sample++) {
+			Eigen::Map<const EMatrix> sample_error(
+			    error.data() + sample * error.cols(), out[0] * out[1], out[2]);
+			im2col(input.data() + sample * input.cols(), layer, cols);
+			gradient.noalias() += cols.transpose() * sample_error;
+			if (input_error) {
+				error_cols.noalias() = sample_error * weights.transpose();
+				col2im(error_cols, layer,
+				       input_error->data() + sample * input_error->cols());
+			}
+		}
+	}
+
+	/**
+	 * @brief Max pooling of a batch of images in NHWC layout. Works on real
+	 * valued and on quantized images.
+	 *
+	 * @param input input(sample, pixel)
+	 * @param layer the pooling layer
+	 * @param argmax if not null, stores the input index of every maximum
+	 * @return output(sample, neuron)
+	 */
+	template <typename S>
+	static inline RowMatrix<S> pool_forward(
+	    const RowMatrix<S> &input, const mnist_helper::POOLING_LAYER &layer,
+	    std::vector<size_t> *argmax = nullptr)
+	{
+		const auto &in = layer.input_sizes;
+		const auto &out = layer.output_sizes;
+		RowMatrix<S> output(input.rows(), out[0] * out[1] * out[2]);
+		if (argmax) {
+			argmax->resize(output.size());
+		}
+		for (Eigen::Index sample = 0; sample < input.rows(); sample++) {
+			const S *image = input.data() + sample * input.cols();
+			S *res = output.data() + sample * output.cols();
+			for (size_t ox = 0; ox < out[0]; ox++) {
+				size_t x_end = std::min(ox * layer.stride + layer.size[0], in[0]);
+				for (size_t oy = 0; oy < out[1]; oy++) {
+					size_t y_end =
+					    std::min(oy * layer.stride + layer.size[1], in[1]);
+					for (size_t c = 0; c < out[2]; c++) {
+						size_t max_id = (ox * layer.stride * in[1] +
+						                 oy * layer.stride) * in[2] + c;
+						for (size_t x = ox * layer.stride; x < x_end; x++) {
+							for (size_t y = oy * layer.stride; y < y_end; y++) {
+								size_t id = (x * in[1] + y) * in[2] + c;
+								if (image[id] > image[max_id]) {
+									max_id = id;
+								}
+							}
+						}
+						size_t out_id = (ox * out[1] + oy) * out[2] + c;
+						res[out_id] = image[max_id];
+						if (argmax) {
+							(*argmax)[sample * output.cols() + out_id] = max_id;
+						}
+					}
+				}
+			}
+		}
+		return output;
+	}
+
+	/**
+	 * @brief Backward path of max pooling: the error is routed to the input
+	 * neuron which was the maximum in the forward path
+	 *
+	 * @param input input of the layer, input(sample, pixel)
+	 * @param error error at the output of the layer, error(sample, neuron)
+	 * @param layer the pooling layer
+	 * @return error at the input of the layer
+	 */
+	static inline EMatrix pool_backward(const EMatrix &input,
+	                                    const EMatrix &error,
+	                                    const mnist_helper::POOLING_LAYER &layer)
+	{
+		std::vector<size_t> argmax;
+		pool_forward(input, layer, &argmax);
+		EMatrix input_error = EMatrix::Zero(input.rows(), input.cols());
+		for (Eigen::Index sample = 0; sample < error.rows(); sample++) {
+			for (Eigen::Index neuron = 0; neuron < error.cols(); neuron++) {
+				input_error(sample, argmax[sample * error.cols() + neuron]) +=
+				    error(sample, neuron);
+			}
+		}
+		return input_error;
+	}
+
+	/**
+	 * @brief For every layer, the index into m_layers, m_filters or m_pools
+	 * (depending on the layer type)
+	 */
+	std::vector<size_t> type_indices() const
+	{
+		std::vector<size_t> res;
+		size_t dense = 0, conv = 0, pool = 0;
+		for (auto type : m_layer_types) {
+			switch (type) {
+				case mnist_helper::LAYER_TYPE::Dense: res.push_back(dense++); break;
+				case mnist_helper::LAYER_TYPE::Conv: res.push_back(conv++); break;
+				case mnist_helper::LAYER_TYPE::Pooling: res.push_back(pool++); break;
+			}
+		}
+		return res;
+	}
+
+	/**
+	 * @brief Forward path of a whole batch of samples. Every dense layer is
+	 * computed as one matrix-matrix product, convolutions via im2col
+	 *
+	 * @param input input(sample, pixel)
+	 * @return activations of all layers, activations[layer](sample, neuron)
+	 */
+	std::vector<EMatrix> forward_batch(const EMatrix &input) const
+	{
+		auto ids = type_indices();
+		std::vector<EMatrix> activations(m_layer_types.size() + 1);
+		activations[0] = input;
+		for (size_t layer = 0; layer < m_layer_types.size(); layer++) {
+			switch (m_layer_types[layer]) {
+				case mnist_helper::LAYER_TYPE::Dense:
+					activations[layer + 1].noalias() =
+					    activations[layer] * to_eigen(m_layers[ids[layer]]);
+					break;
+				case mnist_helper::LAYER_TYPE::Conv:
+					activations[layer + 1] =
+					    conv_forward(activations[layer], m_filters[ids[layer]]);
+					break;
+				case mnist_helper::LAYER_TYPE::Pooling:
+					// Max pooling has no activation function
+					activations[layer + 1] =
+					    pool_forward(activations[layer], m_pools[ids[layer]]);
+					continue;
+			}
+			activate(activations[layer + 1]);
+		}
+		return activations;
+	}
+
+	/**
+	 * @brief Calculates the weight gradients of a whole batch. The gradient of
+	 * every dense layer is computed as one matrix-matrix product
+	 * activations^T x errors. Weights are not changed.
+	 *
+	 * @param labels labels of the samples in the batch
+	 * @param activations result of forward_batch
+	 * @param last_only true for last layer only training
+	 * @return gradients for every layer, empty for layers not trained. For
+	 * convolution layers the gradient of the filter_matrix
+	 */
+	std::vector<EMatrix> batch_gradients(const std::vector<uint16_t> &labels,
+	                                     const std::vector<EMatrix> &activations,
+	                                     bool last_only) const
+	{
+		auto ids = type_indices();
+		std::vector<EMatrix> gradients(m_layer_types.size());
+		EMatrix error = output_error(labels, activations.back());
+		for (size_t inv_layer = 0; inv_layer < m_layer_types.size();
+		     inv_layer++) {
+			size_t layer_id = m_layer_types.size() - inv_layer - 1;
+			bool propagate = !last_only && layer_id > 0;
+			EMatrix input_error;
+			switch (m_layer_types[layer_id]) {
+				case mnist_helper::LAYER_TYPE::Dense:
+					gradients[layer_id].noalias() =
+					    activations[layer_id].transpose() * error;
+					if (propagate) {
+						input_error.noalias() =
+						    error *
+						    to_eigen(m_layers[ids[layer_id]]).transpose();
+					}
+					break;
+				case mnist_helper::LAYER_TYPE::Conv:
+					conv_backward(activations[layer_id], error,
+					              m_filters[ids[layer_id]], gradients[layer_id],
+					              propagate ? &input_error : nullptr);
+					break;
+				case mnist_helper::LAYER_TYPE::Pooling:
+					if (propagate) {
+						input_error = pool_backward(activations[layer_id],
+						                            error, m_pools[ids[layer_id]]);
+					}
+					break;
+			}
+			if (!propagate) {
+				break;
+			}
+			// Pooling layers do not have an activation function
+			if (m_layer_types[layer_id - 1] !=
+			    mnist_helper::LAYER_TYPE::Pooling) {
+				mul_derivative(input_error, activations[layer_id]);
+			}
+			error.swap(input_error);
+		}
+		return gradients;
+	}
+
+	/**
+	 * @brief Number of threads used for a batch of @param n samples. Every
+	 * thread gets at least a few samples, otherwise the overhead dominates
+	 */
+	size_t batch_threads(size_t n) const
+	{
+		const size_t min_samples = 16;
+		return std::max(size_t(1), std::min(m_threads, n / min_samples));
+	}
+
+	/**
+	 * @brief Splits [0, n) into @param threads contiguous ranges and calls
+	 * func(thread_id, begin, end) for every range in its own thread
+	 */
+	template <typename Func>
+	static void parallel_ranges(size_t n, size_t threads, Func func)
+	{
+		if (threads <= 1) {
+			func(size_t(0), size_t(0), n);
+			return;
+		}
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++) {
+			size_t begin = n * t / threads;
+			size_t end = n * (t + 1) / threads;
+			workers.emplace_back([&func, t, begin, end]() { func(t, begin, end); });
+		}
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	/**
+	 * @brief Sums up the gradients of all threads in a fixed order and updates
+	 * the weights accordingly
+	 *
+	 * @param gradients gradients[thread][layer], empty layers are skipped
+	 */
+	void apply_gradients(const std::vector<std::vector<EMatrix>> &gradients)
+	{
+		const Real rate = learn_rate / Real(m_batchsize);
+		auto ids = type_indices();
+		for (size_t layer = 0; layer < m_layer_types.size(); layer++) {
+			if (gradients[0][layer].size() == 0) {
+				continue;
+			}
+			EMatrix sum = gradients[0][layer];
+			for (size_t t = 1; t < gradients.size(); t++) {
+				sum += gradients[t][layer];
+			}
+			if (m_layer_types[layer] == mnist_helper::LAYER_TYPE::Dense) {
+				to_eigen(m_layers[ids[layer]]) -= rate * sum;
+			}
+			else if (m_layer_types[layer] == mnist_helper::LAYER_TYPE::Conv) {
+				auto &filter = m_filters[ids[layer]].filter;
+				size_t ky = filter[0].size(), kz = filter[0][0].size();
+				for (size_t x = 0; x < filter.size(); x++) {
+					for (size_t y = 0; y < ky; y++) {
+						for (size_t z = 0; z < kz; z++) {
+							for (size_t f = 0; f < filter[x][y][z].size(); f++) {
+								filter[x][y][z][f] -=
+								    rate * sum((x * ky + y) * kz + z, f);
+							}
+						}
+					}
+				}
 			}
 		}
 	}
 
+	/**
+	 * @brief Backprop of a whole batch, rows of the batch are split across
+	 * threads
+	 *
+	 * @param labels labels of the samples in the batch
+	 * @param activations result of forward_batch
+	 * @param last_only true for last layer only training
+	 */
+	void backward_batch(const std::vector<uint16_t> &labels,
+	                    const std::vector<EMatrix> &activations,
+	                    bool last_only)
+	{
+		size_t n = labels.size();
+		size_t threads = batch_threads(n);
+		if (threads == 1) {
+			apply_gradients({batch_gradients(labels, activations, last_only)});
+			return;
+		}
+		std::vector<std::vector<EMatrix>> gradients(threads);
+		parallel_ranges(n, threads, [&](size_t t, size_t begin, size_t end) {
+			std::vector<uint16_t> part_labels(labels.begin() + begin,
+			                                  labels.begin() + end);
+			std::vector<EMatrix> part(activations.size());
+			for (size_t layer = 0; layer < part.size(); layer++) {
+				if (activations[layer].rows()) {
+					part[layer] =
+					    activations[layer].middleRows(begin, end - begin);
+				}
+			}
+			gradients[t] = batch_gradients(part_labels, part, last_only);
+		});
+		apply_gradients(gradients);
+	}
+
+	/**
+	 * @brief Trains the network on one mini-batch of training data. Every
+	 * thread runs forward and backward path on its part of the batch.
+	 *
+	 * @param indices list of shuffled indices
+	 * @param start uses images indices[start] until indices[start +
+	 * m_batchsize -1]
+	 * @return number of correctly classified samples before the update
+	 */
+	size_t train_batch(const std::vector<size_t> &indices, size_t start)
+	{
+		size_t n = batch_samples(indices, start, m_batchsize);
+		size_t threads = batch_threads(n);
+		std::vector<std::vector<EMatrix>> gradients(threads);
+		std::vector<size_t> correct(threads, 0);
+		auto data = mnist_train_view();
+		parallel_ranges(n, threads, [&](size_t t, size_t begin, size_t end) {
+			auto activations = forward_batch(
+			    batch_input(data, indices, start + begin, end - begin));
+			std::vector<uint16_t> labels(end - begin);
+			for (size_t sample = 0; sample < labels.size(); sample++) {
+				labels[sample] = data.label(indices[start + begin + sample]);
+				Eigen::Index max_id;
+				activations.back().row(sample).maxCoeff(&max_id);
+				if (size_t(max_id) == labels[sample]) {
+					correct[t]++;
+				}
+			}
+			gradients[t] = batch_gradients(labels, activations, false);
+		});
+		apply_gradients(gradients);
+		return std::accumulate(correct.begin(), correct.end(), size_t(0));
+	}
+
 	/**
 	 * @brief Forward path of the network (--> inference)
 	 *
@@ -788,13 +1594,6 @@ public:
 	    const std::vector<size_t> &indices, const size_t start,
 	    size_t batchsize) const
 	{
-		if(!m_filters.empty()){
-            throw std::runtime_error("Conv layer not supported in forward_path function!");
-        }
-		if(!m_pools.empty()){
-            throw std::runtime_error("Pooling layer layer not supported in forward_path function!");
-        }
-		auto &input = std::get<0>(m_mnist);
 		std::vector<std::vector<std::vector<Real>>> res;
 		std::vector<std::vector<Real>> activations;
 		for (auto size : m_layer_sizes) {
@@ -804,18 +1603,59 @@ public:
 			res.emplace_back(activations);
 		}
 
-		for (size_t sample = 0; sample < batchsize; sample++) {
-			if (start + sample >= indices.size())
-				break;
-			res[sample][0] = input[indices[start + sample]];
-			for (size_t layer = 0; layer < m_layers.size(); layer++) {
-				res[sample][layer + 1] = ActivationFunction::function(
-				    mat_trans_X_vec(m_layers[layer], res[sample][layer]));
+		size_t n = batch_samples(indices, start, batchsize);
+		auto batch = forward_batch(
+		    batch_input(mnist_train_view(), indices, start, n));
+		for (size_t sample = 0; sample < n; sample++) {
+			for (size_t layer = 0; layer < batch.size(); layer++) {
+				Eigen::Map<EVector>(res[sample][layer].data(),
+				                    res[sample][layer].size()) =
+				    batch[layer].row(sample).transpose();
 			}
 		}
 		return res;
 	}
 
+	/**
+	 * @brief Classifies the test set in chunks of 1000 images, chunks are
+	 * distributed round-robin over the threads
+	 *
+	 * @param forward functor mapping a batch of input images to the output
+	 * layer, output(sample, neuron)
+	 * @return accuracy
+	 */
+	template <typename Forward>
+	Real test_accuracy(Forward forward) const
+	{
+		auto input = mnist_test_view();
+		std::vector<size_t> indices(input.size());
+		for (size_t i = 0; i < indices.size(); i++) {
+			indices[i] = i;
+		}
+		// Process the test set in chunks to bound memory usage
+		const size_t chunk = 1000;
+		size_t n_chunks = (input.size() + chunk - 1) / chunk;
+		size_t threads = std::max(size_t(1), std::min(m_threads, n_chunks));
+		std::vector<size_t> sum(threads, 0);
+		parallel_ranges(threads, threads, [&](size_t t, size_t, size_t) {
+			for (size_t start = t * chunk; start < input.size();
+			     start += threads * chunk) {
+				size_t n = batch_samples(indices, start, chunk);
+				auto output = forward(batch_input(input, indices, start, n));
+				for (size_t sample = 0; sample < n; sample++) {
+					Eigen::Index max_id;
+					output.row(sample).maxCoeff(&max_id);
+					if (size_t(max_id) == input.label(start + sample)) {
+						sum[t]++;
+					}
+				}
+			}
+		});
+
+		return Real(std::accumulate(sum.begin(), sum.end(), size_t(0))) /
+		       Real(input.size());
+	}
+
 	/**
 	 * @brief Forward path of test data
 	 *
@@ -823,30 +1663,162 @@ public:
 	 */
 	virtual Real forward_path_test() const override
 	{
-		if(!m_filters.empty()){
-            throw std::runtime_error("Conv layer not supported in forward_path function!");
-        }
-		if(!m_pools.empty()){
-            throw std::runtime_error("Pooling layer layer not supported in forward_path function!");
-        }
-		auto &input = std::get<0>(m_mnist_test);
-		auto &labels = std::get<1>(m_mnist_test);
-		std::vector<std::vector<Real>> activations;
-		for (auto size : m_layer_sizes) {
-			activations.emplace_back(std::vector<Real>(size, 0.0));
+		return test_accuracy(
+		    [this](const EMatrix &input) { return forward_batch(input).back(); });
+	}
+
+	/**
+	 * @brief Symmetric linear quantization of values to integers in
+	 * [-qmax, qmax], rounding half away from zero
+	 *
+	 * @param mat real valued matrix
+	 * @param scale value of one quantization step
+	 * @param qmax largest integer
+	 * @return integer matrix
+	 */
+	template <typename T>
+	static inline RowMatrix<T> quantize(const EMatrix &mat, Real scale,
+	                                    Real qmax)
+	{
+		// Same as std::round, but the truncating cast is vectorized
+		return mat
+		    .unaryExpr([scale, qmax](Real x) {
+			    x = std::max(-qmax, std::min(qmax, x / scale));
+			    return x < 0 ? x - 0.5 : x + 0.5;
+		    })
+		    .template cast<T>();
+	}
+
+	/**
+	 * @brief Integer matrix product a * b. Rows of b are scaled by the entries
+	 * of a and summed up in accumulators of type Acc, the compiler vectorizes
+	 * this as widening multiply-add on the narrow integers. Zero entries of a
+	 * (inactive neurons, background pixels) are skipped.
+	 *
+	 * @param a left operand
+	 * @param b right operand
+	 * @param res row-major result with a.rows() rows and b.cols() columns
+	 */
+	template <typename Acc, typename T>
+	static inline void int_product(const RowMatrix<T> &a,
+	                               const RowMatrix<T> &b, Real *res)
+	{
+		const Eigen::Index n = b.cols();
+		std::vector<Acc> sum(n);
+		for (Eigen::Index i = 0; i < a.rows(); i++) {
+			std::fill(sum.begin(), sum.end(), Acc(0));
+			for (Eigen::Index k = 0; k < a.cols(); k++) {
+				const Acc x = a(i, k);
+				if (x == 0) {
+					continue;
+				}
+				const T *y = b.data() + k * n;
+				for (Eigen::Index j = 0; j < n; j++) {
+					sum[j] += x * Acc(y[j]);
+				}
+			}
+			for (Eigen::Index j = 0; j < n; j++) {
+				res[i * n + j] = Real(sum[j]);
+			}
 		}
-		size_t sum = 0;
-		for (size_t sample = 0; sample < input.size(); sample++) {
-			activations[0] = input[sample];
-			for (size_t layer = 0; layer < m_layers.size(); layer++) {
-				activations[layer + 1] = ActivationFunction::function(
-				    mat_trans_X_vec(m_layers[layer], activations[layer]));
+	}
+
+	/**
+	 * @brief Test set accuracy of the network quantized to integers of type T
+	 * (int8_t or int16_t). Weights of every layer are quantized symmetrically
+	 * with one scale factor per layer (max |w|). Activations are requantized
+	 * after every layer, the activation range of a layer is the given
+	 * percentile of its activations on the training data (see
+	 * activation_ranges). Weights and activations are stored as T, dense and
+	 * convolution layers sum up the products in 32 bit (int8) or 64 bit
+	 * (int16) accumulators, max pooling works on the integers directly.
+	 *
+	 * @param percentile percentile of the activation ranges, >= 100 for max
+	 * @return accuracy of the quantized network on the test set
+	 */
+	template <typename T>
+	Real forward_path_test_quantized_t(size_t percentile) const
+	{
+		// Sums of 16 bit products overflow 32 bit already for a few inputs
+		typedef typename std::conditional<(sizeof(T) < 2), int32_t,
+		                                  int64_t>::type Acc;
+		const Real qmax = std::numeric_limits<T>::max();
+		auto ids = type_indices();
+
+		// Scale of one quantization step for activations and weights
+		std::vector<Real> act_scales = activation_ranges(percentile);
+		std::vector<Real> weight_scales(m_layer_types.size(), 1.0);
+		std::vector<RowMatrix<T>> weights(m_layer_types.size());
+		for (auto &scale : act_scales) {
+			scale = (scale > 0 ? scale : 1.0) / qmax;
+		}
+		for (size_t layer = 0; layer < m_layer_types.size(); layer++) {
+			EMatrix mat;
+			switch (m_layer_types[layer]) {
+				case mnist_helper::LAYER_TYPE::Dense:
+					mat = to_eigen(m_layers[ids[layer]]);
+					break;
+				case mnist_helper::LAYER_TYPE::Conv:
+					mat = filter_matrix(m_filters[ids[layer]]);
+					break;
+				case mnist_helper::LAYER_TYPE::Pooling:
+					// Max pooling does not change the range
+					act_scales[layer + 1] = act_scales[layer];
+					continue;
 			}
-			if (correct(labels[sample], activations.back()))
-				sum++;
+			Real max = mat.size() ? mat.cwiseAbs().maxCoeff() : 0.0;
+			weight_scales[layer] = (max > 0 ? max : 1.0) / qmax;
+			weights[layer] = quantize<T>(mat, weight_scales[layer], qmax);
 		}
 
-		return Real(sum) / Real(labels.size());
+		return test_accuracy([&](const EMatrix &input) {
+			RowMatrix<T> act = quantize<T>(input, act_scales[0], qmax);
+			RowMatrix<T> cols;
+			for (size_t layer = 0; layer < m_layer_types.size(); layer++) {
+				EMatrix real;
+				switch (m_layer_types[layer]) {
+					case mnist_helper::LAYER_TYPE::Dense:
+						real.resize(act.rows(), weights[layer].cols());
+						int_product<Acc>(act, weights[layer], real.data());
+						break;
+					case mnist_helper::LAYER_TYPE::Conv: {
+						const auto &conv = m_filters[ids[layer]];
+						const auto &out = conv.output_sizes;
+						real.resize(act.rows(), out[0] * out[1] * out[2]);
+						for (Eigen::Index sample = 0; sample < act.rows();
+						     sample++) {
+							im2col(act.data() + sample * act.cols(), conv,
+							       cols);
+							int_product<Acc>(cols, weights[layer],
+							                 real.data() + sample * real.cols());
+						}
+						break;
+					}
+					case mnist_helper::LAYER_TYPE::Pooling:
+						// Pooling on integers, the scale does not change
+						act = pool_forward(act, m_pools[ids[layer]]);
+						continue;
+				}
+				// Requantize to the range of the next layer
+				real *= act_scales[layer] * weight_scales[layer];
+				activate(real);
+				act = quantize<T>(real, act_scales[layer + 1], qmax);
+			}
+			return act;
+		});
+	}
+
+	virtual Real forward_path_test_quantized(
+	    size_t bits = 8, size_t percentile = 100) const override
+	{
+		if (bits == 8) {
+			return forward_path_test_quantized_t<int8_t>(percentile);
+		}
+		if (bits == 16) {
+			return forward_path_test_quantized_t<int16_t>(percentile);
+		}
+		throw std::invalid_argument("Quantization to " + std::to_string(bits) +
+		                            " bits is not supported, use 8 or 16");
 	}
 
 	/**
@@ -867,46 +1839,32 @@ public:
 #ifndef NDEBUG
 		assert(m_batchsize == activations.size());
 #endif
-		if(!m_filters.empty()){
-            throw std::runtime_error("Conv layer not supported in forward_path function!");
-        }
-		if(!m_pools.empty()){
-            throw std::runtime_error("Pooling layer layer not supported in forward_path function!");
-        }
-		const auto &labels = std::get<1>(m_mnist);
-		const std::vector<cypress::Matrix<cypress::Real>> orig_weights =
-		    m_layers;
-		for (size_t sample = 0; sample < m_batchsize; sample++) {
-			if (start + sample >= indices.size())
-				break;
-			const auto &activ = activations[sample];
-			auto error = vec_X_vec_comp(
-			    Loss::calc_error(labels[indices[start + sample]], activ.back()),
-			    ActivationFunction::derivative(activ.back()));
-			// TODO  works for ReLU only
-			update_mat(m_layers.back(), error, activ[activ.size() - 2],
-			           m_batchsize, learn_rate);
-			if (!last_only) {
-				for (size_t inv_layer = 1; inv_layer < m_layers.size();
-				     inv_layer++) {
-					size_t layer_id = m_layers.size() - inv_layer - 1;
-
-					error = vec_X_vec_comp(
-					    mat_X_vec(orig_weights[layer_id + 1], error),
-					    ActivationFunction::derivative(activ[layer_id + 1]));
-					update_mat(m_layers[layer_id], error, activ[layer_id],
-					           m_batchsize, learn_rate);
-				}
+		auto data = mnist_train_view();
+		size_t n = batch_samples(indices, start, m_batchsize);
+		std::vector<uint16_t> batch_labels(n);
+		std::vector<EMatrix> batch(m_layer_sizes.size());
+		for (size_t layer = 0; layer < batch.size(); layer++) {
+			batch[layer].resize(n, m_layer_sizes[layer]);
+			for (size_t sample = 0; sample < n; sample++) {
+				batch[layer].row(sample) =
+				    to_eigen(activations[sample][layer]).transpose();
 			}
 		}
+		for (size_t sample = 0; sample < n; sample++) {
+			batch_labels[sample] = data.label(indices[start + sample]);
+		}
+		backward_batch(batch_labels, batch, last_only);
 		m_constraint.constrain_weights(m_layers);
 		m_scaled_layerwise = false;
 	}
 	/**
-	 * @brief Implementation of backprop, adapted for usage in SNNs
+	 * @brief Implementation of backprop, adapted for usage in SNNs. The
+	 * gradient of the whole batch is accumulated before the weights are
+	 * updated and constrained.
 	 *
 	 * @param labels vector containing labels of the given batch
-	 * @param activations activations in the form of [layer][sample][neuron]
+	 * @param activations activations in the form of [layer][sample][neuron],
+	 * layers not required for training may be empty
 	 * @param last_only true for last layer only training (Perceptron learn
 	 * rule)
 	 */
@@ -924,32 +1882,24 @@ public:
 		if(!m_pools.empty()){
             throw std::runtime_error("Pooling layer layer not supported in forward_path function!");
         }
-		const auto orig_weights = m_layers;
-		for (size_t sample = 0; sample < m_batchsize; sample++) {
-
-			auto error = vec_X_vec_comp(
-			    Loss::calc_error(labels[sample], activations.back()[sample]),
-			    ActivationFunction::derivative(activations.back()[sample]));
-			// TODO  works for ReLU only
-			update_mat(m_layers.back(), error,
-			           activations[activations.size() - 2][sample], m_batchsize,
-			           learn_rate);
-			if (!last_only) {
-				for (size_t inv_layer = 1; inv_layer < m_layers.size();
-				     inv_layer++) {
-					size_t layer_id = m_layers.size() - inv_layer - 1;
-
-					error = vec_X_vec_comp(
-					    mat_X_vec(orig_weights[layer_id + 1], error),
-					    ActivationFunction::derivative(
-					        activations[layer_id + 1][sample]));
-					update_mat(m_layers[layer_id], error,
-					           activations[layer_id][sample], m_batchsize,
-					           learn_rate);
-				}
+		// Stack the samples, layers that were not recorded stay empty
+		std::vector<EMatrix> batch(activations.size());
+		for (size_t layer = 0; layer < batch.size(); layer++) {
+			const auto &act = activations[layer];
+			if (act.empty()) {
+				continue;
+			}
+			batch[layer].resize(m_batchsize, act[0].size());
+			for (size_t sample = 0; sample < m_batchsize; sample++) {
+				batch[layer].row(sample) = to_eigen(act[sample]).transpose();
 			}
-			m_constraint.constrain_weights(m_layers);
 		}
+		// One outer product per layer, weights and constraint are updated
+		// once per batch
+		backward_batch(std::vector<uint16_t>(labels.begin(),
+		                                     labels.begin() + m_batchsize),
+		               batch, last_only);
+		m_constraint.constrain_weights(m_layers);
 		m_scaled_layerwise = false;
 	}
 
@@ -971,13 +1921,13 @@ public:
 		assert(activations.size() == m_batchsize);
 #endif
 
-		auto &labels = std::get<1>(m_mnist);
+		auto data = mnist_train_view();
 		size_t sum = 0;
 
 		for (size_t sample = 0; sample < m_batchsize; sample++) {
 			if (start + sample >= indices.size())
 				break;
-			if (correct(labels[indices[start + sample]],
+			if (correct(data.label(indices[start + sample]),
 			            activations[sample].back()))
 				sum++;
 		}
@@ -991,7 +1941,7 @@ public:
 	 */
 	void train(unsigned seed = 0) override
 	{
-		std::vector<size_t> indices(std::get<0>(m_mnist).size());
+		std::vector<size_t> indices(mnist_train_view().size());
 		m_constraint.constrain_weights(m_layers);
 		for (size_t i = 0; i < indices.size(); i++) {
 			indices[i] = i;
@@ -1005,17 +1955,15 @@ public:
 			size_t correct = 0;
 			std::shuffle(indices.begin(), indices.end(), rng);
 			for (size_t current_idx = 0;
-			     current_idx < std::get<1>(m_mnist).size();
+			     current_idx < indices.size();
 			     current_idx += m_batchsize) {
-				auto activations = forward_path(indices, current_idx);
-				correct += accuracy(activations, indices, current_idx);
-				backward_path(indices, current_idx, activations);
+				correct += train_batch(indices, current_idx);
 				m_constraint.constrain_weights(m_layers);
 			}
 			cypress::global_logger().info(
 			    "MLP", "Accuracy of epoch " + std::to_string(epoch) + ": " +
 			               std::to_string(Real(correct) /
-			                              Real(std::get<1>(m_mnist).size())));
+			                              Real(indices.size())));
 		}
 	}
 
@@ -1044,43 +1992,7 @@ public:
 		if (m_scaled_layerwise) {
 			return m_scale_factors;
 		}
-		size_t sample_size = 1000;
-		std::vector<size_t> indices(std::get<0>(m_mnist).size());
-		for (size_t i = 0; i < indices.size(); i++) {
-			indices[i] = i;
-		}
-		std::vector<Real> scale_factors(m_layer_sizes.size(), 0.0);
-		auto activations =
-		    forward_path(indices, 0, sample_size);  // sample, layer, neuron
-		for (size_t layer = 0; layer < scale_factors.size(); layer++) {
-			size_t layer_size = m_layer_sizes[layer];
-			std::vector<Real> temp_vec(sample_size * layer_size);
-			for (size_t sample = 0; sample < sample_size; sample++) {
-				for (size_t neuron = 0; neuron < layer_size; neuron++) {
-					temp_vec[sample * layer_size + neuron] =
-					    activations[sample][layer][neuron];
-				}
-			}
-			size_t test = 0;
-			if (schedule) {
-				test = std::ceil(
-				    Real(temp_vec.size() * size_t(percentile - layer * 0.02)) /
-				    100.0);
-			}
-			else {
-				test = std::ceil(Real(temp_vec.size() * percentile) / 100.0);
-			}
-			if (percentile >= 100) {
-				scale_factors[layer] =
-				    *std::max_element(temp_vec.begin(), temp_vec.end());
-			}
-			else {
-				std::nth_element(temp_vec.begin(), temp_vec.begin() + test,
-				                 temp_vec.end());
-				scale_factors[layer] = temp_vec[test] ? temp_vec[test] : 1.0;
-			}
-		}
-		return scale_factors;
+		return activation_ranges(percentile, schedule);
 		/*
 		 * Get forward activations for train data
 		 * Take percentile p from config
@@ -1093,6 +2005,67 @@ public:
 		 * */
 	}
 
+	/**
+	 * @brief Percentile of the activations of every layer on (a part of) the
+	 * training data, computed with the current weights. The samples are
+	 * forwarded in chunks and the percentile is selected on the fly, so the
+	 * activations of all samples are never held in memory at once.
+	 *
+	 * @param percentile the percentile, >= 100 for the maximum
+	 * @param schedule lower the percentile for deeper layers
+	 * @return one value per layer (including the input), 1.0 for layers
+	 * without activity
+	 */
+	const std::vector<Real> activation_ranges(size_t percentile,
+	                                          bool schedule = false) const
+	{
+		size_t sample_size = 1000, chunk_size = 100;
+		auto data = mnist_train_view();
+		std::vector<size_t> indices(data.size());
+		for (size_t i = 0; i < indices.size(); i++) {
+			indices[i] = i;
+		}
+		std::vector<Real> scale_factors(m_layer_sizes.size(), 0.0);
+		sample_size = batch_samples(indices, 0, sample_size);
+		if (sample_size == 0) {
+			return std::vector<Real>(m_layer_sizes.size(), 1.0);
+		}
+		std::vector<mnist_helper::StreamingRank> ranks;
+		for (size_t start = 0; start < sample_size; start += chunk_size) {
+			size_t size = std::min(chunk_size, sample_size - start);
+			auto activations =
+			    forward_batch(batch_input(data, indices, start, size));
+			if (ranks.empty()) {
+				for (size_t layer = 0; layer < scale_factors.size();
+				     layer++) {
+					size_t count = activations[layer].cols() * sample_size;
+					size_t test = count - 1;
+					if (percentile < 100 && schedule) {
+						test = std::ceil(
+						    Real(count * size_t(percentile - layer * 0.02)) /
+						    100.0);
+					}
+					else if (percentile < 100) {
+						test = std::ceil(Real(count * percentile) / 100.0);
+					}
+					ranks.emplace_back(count, test);
+				}
+			}
+			for (size_t layer = 0; layer < scale_factors.size(); layer++) {
+				const EMatrix &act = activations[layer];
+				for (Eigen::Index i = 0; i < act.size(); i++) {
+					ranks[layer].push(act.data()[i]);
+				}
+			}
+		}
+		for (size_t layer = 0; layer < scale_factors.size(); layer++) {
+			Real value = ranks[layer].value();
+			scale_factors[layer] =
+			    (percentile >= 100 || value) ? value : 1.0;
+		}
+		return scale_factors;
+	}
+
 	/**
 	 * @brief Measure Layer-wise activation of the network for 1000 samples of
 	 * training data. Rescale the weights accordingly. See B. Rueckauer et al.,
@@ -1110,12 +2083,51 @@ public:
 		if (m_scaled_layerwise) {
 			return m_scale_factors;
 		}
-		m_scale_factors = calculate_scale_factors(percentile, schedule);
-		for (size_t i = 0; i < m_layers.size(); i++) {
+		return rescale_weights(calculate_scale_factors(percentile, schedule));
+	}
+
+	/**
+	 * @brief Rescale the weights with given layer-wise scale factors, e.g.
+	 * the (cached) return value of an earlier call of rescale_weights for the
+	 * same network
+	 *
+	 * @param scale_factors one activation value per layer (including input)
+	 * @return the activation values
+	 */
+	const std::vector<Real> &rescale_weights(
+	    const std::vector<Real> &scale_factors) override
+	{
+		if (m_scaled_layerwise) {
+			return m_scale_factors;
+		}
+		if (scale_factors.size() != m_layer_sizes.size()) {
+			throw std::invalid_argument(
+			    "Number of scale factors does not match number of layers!");
+		}
+		m_scale_factors = scale_factors;
+		auto ids = type_indices();
+		for (size_t i = 0; i < m_layer_types.size(); i++) {
+			if (m_layer_types[i] == mnist_helper::LAYER_TYPE::Pooling) {
+				// Max pooling does not change the scale of activations
+				m_scale_factors[i + 1] = m_scale_factors[i];
+				continue;
+			}
 			Real current_scale_factor =
 			    m_scale_factors[i] / m_scale_factors[i + 1];
-			for (auto &j : m_layers[i]) {
-				j = j * current_scale_factor;
+			if (m_layer_types[i] == mnist_helper::LAYER_TYPE::Dense) {
+				for (auto &j : m_layers[ids[i]]) {
+					j = j * current_scale_factor;
+				}
+				continue;
+			}
+			for (auto &x : m_filters[ids[i]].filter) {
+				for (auto &y : x) {
+					for (auto &z : y) {
+						for (auto &f : z) {
+							f = f * current_scale_factor;
+						}
+					}
+				}
 			}
 		}
 		m_scaled_layerwise = true;
@@ -110,10 +110,17 @@ public:
 	              size_t bench_index = 0)
 	    : m_backend(backend)
 	{
-		auto snab_vec = snab_registry(m_backend, bench_index);
-		for (auto &i : snab_vec) {
-			if (i->valid() &&
-			    (benchmark == "all" || benchmark == i->snab_name())) {
+		// Construct only the requested SNABs, one after the other
+		std::vector<std::string> names({benchmark});
+		if (benchmark == "all") {
+			names = snab_names();
+		}
+		for (const auto &name : names) {
+			if (!snab_config_valid(name, m_backend, bench_index)) {
+				continue;
+			}
+			auto i = create_snab(name, m_backend, bench_index);
+			if (i && i->valid()) {
 				global_logger().info("SNABSuite",
 				                     "Executing " + i->snab_name());
 
@@ -18,10 +18,13 @@
 
 #include <cypress/cypress.hpp>
 
-#include <algorithm>  // std::find
+#include <algorithm>  // std::remove_if
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <random>
 #include <sstream>
 #include <string>
@@ -29,9 +32,14 @@
 
 #include <mutex>
 #include <shared_mutex>
+#include <thread>
 
+#include <fcntl.h>
 #include <unistd.h>  // unlink file
 
+#include <cerrno>
+#include <cstdint>
+
 #include "common/snab_base.hpp"
 #include "common/snab_registry.hpp"
 #include "parameter_sweep.hpp"
@@ -123,77 +131,254 @@ void ParameterSweep::shuffle_sweep_indices(size_t size)
 	std::shuffle(m_indices.begin(), m_indices.end(), generator);
 }
 
-using cypress::Json;
-void ParameterSweep::recover_broken_simulation()
+std::vector<size_t> ParameterSweep::shard_positions(
+    const std::vector<size_t> &indices, size_t shard, size_t n_shards)
 {
-	// Open a the backup file, check if it exists
-	std::fstream ss(m_backend + "_bak.json", std::fstream::in);
-	if (!ss.good()) {
-		return;
+	std::vector<size_t> res;
+	for (size_t i = 0; i < indices.size(); i++) {
+		if (indices[i] % n_shards == shard) {
+			res.push_back(i);
+		}
 	}
+	return res;
+}
 
-	Json backup;
-	try {
-		backup = Json::parse(ss);
+void ParameterSweep::parse_shard(const std::string &spec, size_t &shard,
+                                 size_t &n_shards)
+{
+	auto splitted = Utilities::split(spec, '/');
+	if (splitted.size() != 2) {
+		throw std::invalid_argument("Shard must be given as i/N, got " + spec);
 	}
-	catch (...) {
-		global_logger().info("SNABSuite",
-		                     "Backup file exists, but is corrupt! "
-		                     "Skipping recovery and overwriting old file");
-		return;
+	shard = std::stoul(splitted[0]);
+	n_shards = std::stoul(splitted[1]);
+	if (n_shards == 0 || shard >= n_shards) {
+		throw std::invalid_argument("Invalid shard " + spec);
+	}
+}
+
+namespace {
+// Magic number at the beginning of every journal file
+const char journal_magic[8] = {'S', 'N', 'A', 'B', 'J', 'R', 'N', '1'};
+
+// Number of journal records written before the journal is synced to disk
+const size_t journal_sync_interval = 50;
+
+/**
+ * FNV-1a hash used as checksum for journal records
+ */
+uint32_t journal_checksum(const std::vector<char> &data)
+{
+	uint32_t hash = 2166136261u;
+	for (char c : data) {
+		hash = (hash ^ uint32_t(uint8_t(c))) * 16777619u;
+	}
+	return hash;
+}
+
+template <typename T>
+void append_raw(std::vector<char> &data, const T &value)
+{
+	const char *ptr = reinterpret_cast<const char *>(&value);
+	data.insert(data.end(), ptr, ptr + sizeof(T));
+}
+
+template <typename T>
+bool read_raw(std::istream &is, T &value)
+{
+	return bool(is.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+/**
+ * Appends the checksum to @param data and writes everything to @param fd
+ */
+bool write_record(int fd, std::vector<char> &data)
+{
+	append_raw(data, journal_checksum(data));
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t res = write(fd, data.data() + written, data.size() - written);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		written += size_t(res);
 	}
-	// Check wether the backup is for the correct SNAB
-	if (backup["snab"] != m_snab->snab_name()) {
+	return true;
+}
+}  // namespace
+
+SweepJournal::SweepJournal(std::string file, const std::string &snab_name,
+                           size_t n_points, size_t n_indicators)
+    : m_file(file), m_n_indicators(n_indicators)
+{
+	m_header.assign(journal_magic, journal_magic + sizeof(journal_magic));
+	append_raw(m_header, uint64_t(n_points));
+	append_raw(m_header, uint64_t(n_indicators));
+	append_raw(m_header, uint64_t(snab_name.size()));
+	m_header.insert(m_header.end(), snab_name.begin(), snab_name.end());
+}
+
+SweepJournal::~SweepJournal() { close(); }
+
+size_t SweepJournal::recover(
+    const std::vector<size_t> &indices,
+    const std::function<void(size_t, const Result &)> &replay)
+{
+	m_valid_size = 0;
+	std::ifstream ifs(m_file, std::ifstream::in | std::ifstream::binary);
+	if (!ifs.good()) {
+		return 0;
+	}
+
+	// Check wether the journal is for this SNAB and sweep
+	std::vector<char> file_header(m_header.size());
+	uint32_t checksum;
+	if (!ifs.read(file_header.data(), file_header.size()) ||
+	    !read_raw(ifs, checksum) || file_header != m_header ||
+	    checksum != journal_checksum(m_header)) {
 		global_logger().info("SNABSuite",
-		                     "Backup file exists, but not for this SNAB! "
+		                     "Backup file exists, but not for this sweep! "
 		                     "Skipping recovery and overwriting old file");
-		return;
+		return 0;
 	}
+	size_t valid_size = m_header.size() + sizeof(uint32_t);
+
+	// Replay all complete records. A torn or corrupt record ends the replay,
+	// the journal will be truncated behind the last valid one
+	size_t n_records = 0;
+	while (true) {
+		uint64_t pos, index;
+		Result res(m_n_indicators);
+		if (!read_raw(ifs, pos) || !read_raw(ifs, index)) {
+			break;
+		}
+		bool complete = true;
+		for (auto &i : res) {
+			if (!read_raw(ifs, i)) {
+				complete = false;
+				break;
+			}
+		}
+		if (!complete || !read_raw(ifs, checksum)) {
+			break;
+		}
+		std::vector<char> record;
+		append_raw(record, pos);
+		append_raw(record, index);
+		for (const auto &i : res) {
+			append_raw(record, i);
+		}
+		if (checksum != journal_checksum(record) || pos >= indices.size() ||
+		    indices[pos] != index) {
+			break;
+		}
+		valid_size += record.size() + sizeof(uint32_t);
+		n_records++;
+		replay(pos, res);
+	}
+	m_valid_size = valid_size;
+	return n_records;
+}
 
-	// Check wether sweep indices have the same size
-	if (m_indices.size() != backup["indices"].size()) {
-		global_logger().info("SNABSuite",
-		                     "Sweep size of backup is incorrect! Skipping "
-		                     "recovery and overwriting old file");
+void SweepJournal::open()
+{
+	if (m_fd >= 0) {
 		return;
 	}
+	if (m_valid_size > 0) {
+		// Continue the recovered journal, cut off a torn last record
+		m_fd = ::open(m_file.c_str(), O_WRONLY | O_APPEND);
+		if (m_fd >= 0 && ftruncate(m_fd, off_t(m_valid_size)) == 0) {
+			return;
+		}
+		close();
+	}
+	m_fd = ::open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC,
+	              0644);
+	std::vector<char> header = m_header;
+	if (m_fd < 0 || !write_record(m_fd, header)) {
+		global_logger().warn("SNABSuite",
+		                     "Could not create backup file " + m_file);
+		close();
+	}
+}
 
-	// Check results dimension
-	if (m_results.size() != backup["results"].size() ||
-	    m_results[0].size() != backup["results"][0].size()) {
-		global_logger().info("SNABSuite",
-		                     "Results size of backup is incorrect! Skipping "
-		                     "recovery and overwriting old file");
+void SweepJournal::append(size_t pos, size_t index, const Result &res)
+{
+	if (m_fd < 0) {
 		return;
 	}
+	std::vector<char> record;
+	append_raw(record, uint64_t(pos));
+	append_raw(record, uint64_t(index));
+	for (const auto &i : res) {
+		append_raw(record, i);
+	}
+	if (!write_record(m_fd, record)) {
+		global_logger().warn("SNABSuite", "Could not write backup record!");
+	}
+	m_unsynced++;
+	if (m_unsynced >= journal_sync_interval) {
+		sync();
+	}
+}
 
-	if (backup["jobs_done"].size() == 0) {
-		global_logger().info("SNABSuite",
-		                     "Empty backup file! Skipping "
-		                     "recovery and overwriting old file");
-		return;
+void SweepJournal::sync()
+{
+	if (m_fd >= 0) {
+		fsync(m_fd);
+		m_unsynced = 0;
 	}
+}
 
-	// Recover data
-	m_indices = json_array_to_vector<size_t>(backup["indices"]);
-	m_results = json_3Darray_to_vector<cypress::Real, 4>(backup["results"]);
-	m_jobs_done = json_array_to_vector<size_t>(backup["jobs_done"]);
+void SweepJournal::close()
+{
+	if (m_fd >= 0) {
+		fsync(m_fd);
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
 
-	// Check for invalid results (NaN) and repeat these experiments
-	for (size_t i = 0; i < m_indices.size(); i++) {
-		bool is_nan = false;
-		for (auto j : m_results[i]) {
-			if (std::isnan(j[0])) {
-				is_nan = true;
-				break;
-			}
+void SweepJournal::remove()
+{
+	close();
+	unlink(m_file.c_str());
+	m_valid_size = 0;
+}
+
+using cypress::Json;
+void ParameterSweep::recover_broken_simulation()
+{
+	std::vector<bool> done(m_indices.size(), false);
+	size_t n_records = m_journal->recover(
+	    m_indices, [&](size_t pos, const SweepJournal::Result &res) {
+		    // Invalid results (NaN) are repeated
+		    m_results[pos] = res;
+		    done[pos] = true;
+		    for (const auto &i : res) {
+			    if (std::isnan(i[0])) {
+				    done[pos] = false;
+				    break;
+			    }
+		    }
+	    });
+	if (n_records == 0) {
+		if (m_journal->valid_size() > 0) {
+			global_logger().info("SNABSuite",
+			                     "Empty backup file! Skipping "
+			                     "recovery and overwriting old file");
 		}
-		if (is_nan) {
-			auto iter =
-			    std::find(m_jobs_done.begin(), m_jobs_done.end(), m_indices[i]);
-			if (iter != m_jobs_done.end()) {
-				m_jobs_done.erase(iter);
-			}
+		return;
+	}
+
+	m_jobs_done.clear();
+	for (size_t i = 0; i < m_indices.size(); i++) {
+		if (done[i]) {
+			m_jobs_done.emplace_back(m_indices[i]);
 		}
 	}
 
@@ -202,39 +387,41 @@ void ParameterSweep::recover_broken_simulation()
 
 void ParameterSweep::backup_simulation_results()
 {
-	if (m_jobs_done.size() == 0) {
+	if (!m_journal || !m_journal->is_open()) {
 		global_logger().info("SNABSuite",
 		                     "No simulation finished! Skipping backup.");
 		return;
 	}
+	m_journal->sync();
+}
 
-	// Put together the backup of all important data
-	Json backup;
-	backup["snab"] = m_snab->snab_name();
-	backup["indices"] = m_indices;
-	backup["results"] = m_results;
-	backup["jobs_done"] = m_jobs_done;
-
-	// Write to file
-	std::fstream ss(m_backend + "_bak.json", std::fstream::out);
-	ss << backup.dump(0) << std::endl;
-	ss.close();
+ParameterSweep::ParameterSweep(std::string backend, cypress::Json &config,
+                               size_t bench_index, size_t threads,
+                               size_t shard, size_t n_shards, bool merge)
+    : ParameterSweep(backend, config,
+                     create_snab(config["snab_name"].get<std::string>(),
+                                 backend, bench_index),
+                     threads, shard, n_shards, merge)
+{
 }
 
 ParameterSweep::ParameterSweep(std::string backend, cypress::Json &config,
-                               size_t bench_index, size_t threads)
-    : m_backend(backend)
+                               std::shared_ptr<SNABBase> snab, size_t threads,
+                               size_t shard, size_t n_shards, bool merge)
+    : m_backend(backend), m_snab(snab), m_shard(shard), m_n_shards(n_shards)
 {
-	std::string snab_name = config["snab_name"];
+	if (m_n_shards == 0 || m_shard >= m_n_shards) {
+		throw std::invalid_argument("Invalid shard " +
+		                            std::to_string(m_shard) + "/" +
+		                            std::to_string(m_n_shards));
+	}
+	m_backup_file = m_backend + "_bak.journal";
+	if (m_n_shards > 1) {
+		m_backup_file = m_backend + "_shard_" + std::to_string(m_shard) +
+		                "_of_" + std::to_string(m_n_shards) + "_bak.journal";
+	}
 	m_file_name = config["out_file_name"].empty() ? "" : config["out_file_name"];
 	m_sweep_config = extract_backend(config["config"], m_backend);
-	// Get the correct SNAB
-	auto snab_vec = snab_registry(m_backend, bench_index);
-	for (auto i : snab_vec) {
-		if (i->snab_name() == snab_name) {
-			m_snab = i;
-		}
-	};
 	if (!m_snab) {
 		throw std::runtime_error("Unknown SNAB name!");
 	}
@@ -250,7 +437,12 @@ ParameterSweep::ParameterSweep(std::string backend, cypress::Json &config,
 	    m_indices.size(), std::vector<std::array<cypress::Real, 4>>(
 	                          m_snab->indicator_names().size(),
 	                          std::array<cypress::Real, 4>({0, 0, 0, 0})));
-	recover_broken_simulation();
+	if (!merge) {
+		m_journal.reset(new SweepJournal(m_backup_file, m_snab->snab_name(),
+		                                 m_indices.size(),
+		                                 m_snab->indicator_names().size()));
+		recover_broken_simulation();
+	}
 
 	std::string simulator =
 	    Utilities::split(Utilities::split(m_backend, '=')[0], '.')[0];
@@ -263,35 +455,72 @@ ParameterSweep::ParameterSweep(std::string backend, cypress::Json &config,
 	}
 }
 
+JobQueues::JobQueues(const std::vector<size_t> &jobs, size_t n_queues)
+    : m_queues(n_queues)
+{
+	for (size_t i = 0; i < n_queues; i++) {
+		m_mutexes.emplace_back(new std::mutex());
+	}
+	for (size_t i = 0; i < jobs.size(); i++) {
+		m_queues[i % n_queues].push_back(jobs[i]);
+	}
+}
+
+bool JobQueues::pop(size_t id, size_t &job)
+{
+	{
+		std::lock_guard<std::mutex> lock(*m_mutexes[id]);
+		if (!m_queues[id].empty()) {
+			job = m_queues[id].front();
+			m_queues[id].pop_front();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < m_queues.size(); i++) {
+		size_t victim = (id + i) % m_queues.size();
+		std::lock_guard<std::mutex> lock(*m_mutexes[victim]);
+		if (!m_queues[victim].empty()) {
+			job = m_queues[victim].back();
+			m_queues[victim].pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
 void ParameterSweep::execute()
 {
+	if (!m_journal) {
+		throw std::runtime_error(
+		    "Parameter sweep was constructed for merging shards only!");
+	}
+	// Gather all positions in m_indices which still have to be simulated
+	std::vector<bool> done(m_sweep_vector.size(), false);
+	for (auto i : m_jobs_done) {
+		done[i] = true;
+	}
+	auto shard_jobs = shard_positions(m_indices, m_shard, m_n_shards);
+	std::vector<size_t> open_jobs;
+	for (auto i : shard_jobs) {
+		if (!done[m_indices[i]]) {
+			open_jobs.push_back(i);
+		}
+	}
+	JobQueues queues(open_jobs, std::max(m_n_threads, size_t(1)));
 
-	size_t backup_count = 0;
-	size_t current_job_idx = 0;
-	std::mutex idx_mutex, res_mutex;
+	m_journal->open();
+	size_t finished = shard_jobs.size() - open_jobs.size();
+	double n_jobs = std::max(double(shard_jobs.size()), 1.0);
+	std::mutex res_mutex;
+	Utilities::progress_callback(double(finished) / n_jobs);
 
 	std::vector<std::thread> threads;
-	// auto current_snab = *m_snab.get();
 	for (size_t i = 0; i < m_n_threads; i++) {
-		threads.emplace_back([&]() mutable {
-			size_t index, this_idx;
-			while (true) {
-				{
-					std::lock_guard<std::mutex> lock(idx_mutex);
-					if (current_job_idx >= m_indices.size()) {
-						return;
-					}
-					this_idx = current_job_idx++;
-
-					Utilities::progress_callback(double(this_idx) /
-					                             double(m_indices.size()));
-				}
-				index = m_indices[this_idx];
+		threads.emplace_back([&, i]() mutable {
+			size_t this_idx;
+			while (queues.pop(i, this_idx)) {
+				size_t index = m_indices[this_idx];
 
-				if (std::find(m_jobs_done.begin(), m_jobs_done.end(), index) !=
-				    m_jobs_done.end()) {
-					continue;
-				}
 				// Resetting the SNAB
 				auto snab = m_snab->clone();
 				snab->set_config(m_sweep_vector[index]);
@@ -303,11 +532,9 @@ void ParameterSweep::execute()
 					m_results[this_idx] = res;
 					// Add the current job to the list of finished indices
 					m_jobs_done.emplace_back(index);
-					backup_count++;
-					if (backup_count >= 50) {
-						backup_simulation_results();
-						backup_count = 0;
-					}
+					m_journal->append(this_idx, index, res);
+					finished++;
+					Utilities::progress_callback(double(finished) / n_jobs);
 				}
 			}
 		});
@@ -362,6 +589,126 @@ std::vector<T> apply_permutation(const std::vector<T> &vec,
 
 }  // namespace
 
+std::string ParameterSweep::result_file_prefix()
+{
+	std::string filename = m_snab->snab_name() + "/";
+
+	int dir_err =
+	    system((std::string("mkdir -p ") + m_snab->snab_name()).c_str());
+	if (dir_err == -1) {
+		std::cout << "Error creating directory!" << std::endl;
+		filename = "";
+	}
+	if (m_file_name.empty()) {
+		for (auto i : m_sweep_names) {
+			filename += Utilities::split(i, '/').back() + "_";
+		}
+	}
+	else {
+		filename += m_file_name + "_";
+	}
+	return filename + Utilities::split(m_backend, '=')[0];
+}
+
+std::string ParameterSweep::shard_file_name(size_t shard)
+{
+	return result_file_prefix() + "_shard_" + std::to_string(shard) + "_of_" +
+	       std::to_string(m_n_shards) + ".json";
+}
+
+void ParameterSweep::write_shard()
+{
+	Json res;
+	res["snab"] = m_snab->snab_name();
+	res["shard"] = m_shard;
+	res["n_shards"] = m_n_shards;
+	res["size"] = m_indices.size();
+	res["indices"] = Json::array();
+	res["results"] = Json::array();
+	for (auto i : shard_positions(m_indices, m_shard, m_n_shards)) {
+		res["indices"].push_back(m_indices[i]);
+		res["results"].push_back(m_results[i]);
+	}
+
+	std::string filename = shard_file_name(m_shard);
+	std::ofstream ofs(filename, std::ofstream::out);
+	if (!ofs.good()) {
+		throw std::runtime_error("Could not open " + filename);
+	}
+	ofs << res.dump(0) << std::endl;
+	ofs.close();
+
+	// Remove backup file
+	if (m_journal) {
+		m_journal->remove();
+	}
+}
+
+void ParameterSweep::merge_shards(size_t n_shards)
+{
+	m_n_shards = n_shards;
+	// Position of every sweep index in m_indices
+	std::vector<size_t> positions(m_indices.size());
+	for (size_t i = 0; i < m_indices.size(); i++) {
+		positions[m_indices[i]] = i;
+	}
+	std::vector<bool> merged(m_indices.size(), false);
+
+	for (size_t shard = 0; shard < n_shards; shard++) {
+		std::string filename = shard_file_name(shard);
+		std::ifstream ifs(filename, std::ifstream::in);
+		if (!ifs.good()) {
+			throw std::runtime_error("Could not open shard file " + filename);
+		}
+		Json res = Json::parse(ifs);
+		auto invalid = [&filename]() {
+			return std::runtime_error("Shard file " + filename +
+			                          " does not belong to this sweep!");
+		};
+		if (res["snab"] != m_snab->snab_name() ||
+		    res["shard"].get<size_t>() != shard ||
+		    res["n_shards"].get<size_t>() != n_shards ||
+		    res["size"].get<size_t>() != m_indices.size() ||
+		    res["results"].size() != res["indices"].size()) {
+			throw invalid();
+		}
+		for (size_t i = 0; i < res["indices"].size(); i++) {
+			size_t index = res["indices"][i];
+			if (index >= m_indices.size() || index % n_shards != shard ||
+			    res["results"][i].size() != m_snab->indicator_names().size()) {
+				throw invalid();
+			}
+			auto &target = m_results[positions[index]];
+			for (size_t j = 0; j < target.size(); j++) {
+				if (res["results"][i][j].size() != 4) {
+					throw invalid();
+				}
+				for (size_t k = 0; k < 4; k++) {
+					const Json &val = res["results"][i][j][k];
+					target[j][k] = val.is_number() ? cypress::Real(val) : NaN();
+				}
+			}
+			merged[index] = true;
+		}
+	}
+
+	// Sweep points missing in all shards are marked as invalid
+	size_t missing = 0;
+	for (size_t i = 0; i < m_indices.size(); i++) {
+		if (!merged[m_indices[i]]) {
+			for (auto &j : m_results[i]) {
+				j = std::array<cypress::Real, 4>({NaN(), NaN(), NaN(), NaN()});
+			}
+			missing++;
+		}
+	}
+	if (missing > 0) {
+		global_logger().warn("SNABSuite", std::to_string(missing) +
+		                                      " sweep points are missing in "
+		                                      "the shard files!");
+	}
+}
+
 void ParameterSweep::write_csv()
 {
 	// Get the direct parameter names without json key
@@ -395,22 +742,7 @@ void ParameterSweep::write_csv()
 	sweep_values = apply_permutation(sweep_values, perm);
 	m_results = apply_permutation(m_results, perm);
 
-	std::string filename = m_snab->snab_name() + "/";
-
-	int dir_err =
-	    system((std::string("mkdir -p ") + m_snab->snab_name()).c_str());
-	if (dir_err == -1) {
-		std::cout << "Error creating directory!" << std::endl;
-		filename = "";
-	}
-	if (m_file_name.empty()) {
-		for (auto i : shortened_sweep_names) {
-			filename += i + "_";
-		}
-	} else {
-		filename += m_file_name + "_";
-	}
-	filename += Utilities::split(m_backend, '=')[0] + ".csv";
+	std::string filename = result_file_prefix() + ".csv";
 	std::ofstream ofs(filename, std::ofstream::out);
 	if (!ofs.good()) {
 		std::cout << "Error creating CSV" << std::endl;
@@ -439,8 +771,10 @@ void ParameterSweep::write_csv()
 	ofs.close();
 
 	// Remove backup file
-	unlink((m_backend + "_bak.json").c_str());
+	if (m_journal) {
+		m_journal->remove();
+	}
 }
 
-ParameterSweep::~ParameterSweep() = default;
+ParameterSweep::~ParameterSweep() {}
 }  // namespace SNAB
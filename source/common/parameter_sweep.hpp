@@ -23,14 +23,121 @@
 
 #include <cypress/cypress.hpp>
 
+#include <array>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "common/snab_base.hpp"
 
 namespace SNAB {
 
+/**
+ * Append-only binary journal of finished sweep jobs. A header identifies SNAB
+ * and sweep dimensions, every record holds the position of the job, its sweep
+ * index and the results, followed by a checksum. Not thread safe.
+ */
+class SweepJournal {
+public:
+	using Result = std::vector<std::array<cypress::Real, 4>>;
+
+	/**
+	 * @param file name of the journal file
+	 * @param snab_name name of the SNAB, stored in the header
+	 * @param n_points number of points in the sweep
+	 * @param n_indicators number of indicators of every result
+	 */
+	SweepJournal(std::string file, const std::string &snab_name,
+	             size_t n_points, size_t n_indicators);
+	SweepJournal(const SweepJournal &) = delete;
+	SweepJournal &operator=(const SweepJournal &) = delete;
+	~SweepJournal();
+
+	/**
+	 * Replays an existing journal. Replay stops at the first torn or corrupt
+	 * record, or at a record not matching @param indices.
+	 * @param indices (shuffled) indices of the sweep vector
+	 * @param replay called with position and result of every valid record
+	 * @return number of replayed records, zero if there is no journal for this
+	 * sweep
+	 */
+	size_t recover(const std::vector<size_t> &indices,
+	               const std::function<void(size_t, const Result &)> &replay);
+
+	/**
+	 * Size of the valid part of the journal found by recover(), zero if there
+	 * was none
+	 */
+	size_t valid_size() const { return m_valid_size; }
+
+	/**
+	 * Opens the journal for appending. A recovered journal is truncated to its
+	 * valid part and continued, otherwise a new one is created
+	 */
+	void open();
+
+	bool is_open() const { return m_fd >= 0; }
+
+	/**
+	 * Appends a record, the journal is synced to disk every 50 records
+	 * @param pos position of the job in the shuffled indices
+	 * @param index index of the job in the sweep vector
+	 * @param res results of the job
+	 */
+	void append(size_t pos, size_t index, const Result &res);
+
+	/**
+	 * Syncs all appended records to disk
+	 */
+	void sync();
+
+	/**
+	 * Syncs and closes the journal
+	 */
+	void close();
+
+	/**
+	 * Closes and deletes the journal file
+	 */
+	void remove();
+
+private:
+	std::string m_file;
+	size_t m_n_indicators;
+	std::vector<char> m_header;
+	int m_fd = -1;
+	size_t m_valid_size = 0;
+	size_t m_unsynced = 0;
+};
+
+/**
+ * Work-stealing job queues for the sweep threads. Every thread owns a deque of
+ * job positions, takes work from its front and, when it ran dry, steals from
+ * the back of the other deques. Locks are per deque, so threads only contend
+ * while stealing.
+ */
+class JobQueues {
+private:
+	std::vector<std::deque<size_t>> m_queues;
+	std::vector<std::unique_ptr<std::mutex>> m_mutexes;
+
+public:
+	/**
+	 * Distributes the given jobs round robin over @param n_queues deques
+	 */
+	JobQueues(const std::vector<size_t> &jobs, size_t n_queues);
+
+	/**
+	 * Fetches the next job for thread @param id. Returns false if there is no
+	 * job left in any queue
+	 */
+	bool pop(size_t id, size_t &job);
+};
+
 /**
  * class for systematic parameter sweeps of single benchmarks
  */
@@ -60,6 +167,27 @@ private:
 	// Number of threads for panellizing sweep
 	size_t m_n_threads = 1;
 
+	// Shard of the sweep executed by this process and total number of shards
+	size_t m_shard = 0;
+	size_t m_n_shards = 1;
+
+	// Name of the backup journal, unique for every shard
+	std::string m_backup_file;
+	// Backup journal, appended by the sweep threads under the result lock.
+	// Not existing when only merging shards
+	std::unique_ptr<SweepJournal> m_journal;
+
+	/**
+	 * Creates the output directory of the SNAB and returns the common prefix
+	 * of all result files of this sweep (without file extension)
+	 */
+	std::string result_file_prefix();
+
+	/**
+	 * Name of the partial result file written by shard @param shard
+	 */
+	std::string shard_file_name(size_t shard);
+
 	/**
 	 * Function for shuffling indices, reduces covariance between neighbouring
 	 * simulations on analogue hardware
@@ -67,8 +195,9 @@ private:
 	void shuffle_sweep_indices(size_t size);
 
 	/**
-	 * Private function for recovering an old sweep. Gets called at the end of
-	 * the constructor, checks for consistency.
+	 * Private function for recovering an old sweep by replaying the backup
+	 * journal. Gets called at the end of the constructor, checks for
+	 * consistency. Replay stops at the first torn or corrupt record.
 	 * Note: Make sure the same sweep config is used. This is currently not
 	 * checked against! TODO!
 	 */
@@ -88,9 +217,25 @@ public:
 	 * different network sizes, this the entry id to choose
 	 * @param threads number of threads for parallel execution. Note: not every
 	 * backend is threadsafe!
+	 * @param shard index of the shard of the sweep executed by this instance
+	 * @param n_shards total number of shards the sweep is split into. Every
+	 * shard can be executed by an independent process, see write_shard() and
+	 * merge_shards()
+	 * @param merge only merge the result files of a sharded sweep. No backup
+	 * journal is recovered, written or removed, as it might belong to another
+	 * sweep of the same backend. execute() cannot be used.
+	 */
+	ParameterSweep(std::string backend, cypress::Json &config,
+	               size_t bench_index = 0, size_t threads = 1,
+	               size_t shard = 0, size_t n_shards = 1, bool merge = false);
+
+	/**
+	 * Sweeps over an already constructed SNAB instead of the one named in
+	 * @param config. Parameters are the same as above
 	 */
 	ParameterSweep(std::string backend, cypress::Json &config,
-	               size_t bench_index = 0, size_t threads = 1);
+	               std::shared_ptr<SNABBase> snab, size_t threads = 1,
+	               size_t shard = 0, size_t n_shards = 1, bool merge = false);
 
 	/**
 	 * Execution of the sweep simulations. Results are stored in m_results
@@ -111,13 +256,48 @@ public:
 	    const cypress::Json &source, const cypress::Json &target,
 	    std::vector<std::string> &sweep_names);
 
+	/**
+	 * Deterministically selects the sweep points belonging to one shard.
+	 * Points are assigned by their index in the sweep vector, which makes the
+	 * split independent of the shuffling and the number of threads.
+	 * @param indices (shuffled) indices of the sweep vector
+	 * @param shard index of the shard
+	 * @param n_shards total number of shards
+	 * @return positions in @param indices belonging to the shard
+	 */
+	static std::vector<size_t> shard_positions(
+	    const std::vector<size_t> &indices, size_t shard, size_t n_shards);
+
+	/**
+	 * Parses a shard specification of the form "i/N"
+	 * @param spec string containing the specification
+	 * @param shard will contain i
+	 * @param n_shards will contain N
+	 */
+	static void parse_shard(const std::string &spec, size_t &shard,
+	                        size_t &n_shards);
+
 	/**
 	 * Results are converted to comma seperated values and written to
 	 * *sweep_parameters*_*backend*_.csv
 	 */
 	void write_csv();
+
+	/**
+	 * Writes the results of the shard executed by this instance to
+	 * *sweep_parameters*_*backend*_shard_i_of_N.json
+	 */
+	void write_shard();
+
+	/**
+	 * Reads in all partial result files written by write_shard() of
+	 * @param n_shards processes. Afterwards, write_csv() produces the same
+	 * output as a sweep executed in a single process.
+	 */
+	void merge_shards(size_t n_shards);
 	/**
-	 * Function for backing up an old simulation.
+	 * Function for backing up an old simulation. Every finished job is
+	 * appended to a binary journal, this function syncs the journal to disk.
 	 * Note: Make sure the same sweep config is used. This is currently not
 	 * checked against! TODO!
 	 */
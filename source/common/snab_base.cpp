@@ -28,6 +28,16 @@
 #include "util/utilities.hpp"
 
 namespace SNAB {
+namespace {
+/**
+ * @brief Checks wether a config is labeled as invalid
+ */
+bool labeled_invalid(Json &config)
+{
+	return config.find("invalid") != config.end() && bool(config["invalid"]);
+}
+}  // namespace
+
 SNABBase::SNABBase(std::string name, std::string backend,
                    std::initializer_list<std::string> indicator_names,
                    std::initializer_list<std::string> indicator_types,
@@ -43,22 +53,30 @@ SNABBase::SNABBase(std::string name, std::string backend,
       m_indicator_units(indicator_units),
       m_bench_index(bench_index)
 {
-	m_config_file = read_config(name, m_backend);
-
-	bool changed =
-	    replace_arrays_by_value(m_config_file, m_bench_index, m_snab_name);
-	if (!changed && m_bench_index != 0) {
+	if (!read_bench_config(name, m_backend, m_bench_index, m_config_file)) {
 		m_valid = false;
 		return;
 	}
 	check_config(required_parameters);
 }
 
+bool SNABBase::read_bench_config(const std::string &name,
+                                 const std::string &backend,
+                                 size_t bench_index, Json &config)
+{
+	config = read_config(name, backend);
+
+	bool changed = replace_arrays_by_value(config, bench_index, name);
+	if (!changed && bench_index != 0) {
+		return false;
+	}
+	return !labeled_invalid(config);
+}
+
 void SNABBase::check_config(std::vector<std::string> required_parameters_vec)
 {
 	// Check wether benchmark is labeled as invalid
-	if (!((m_config_file.find("invalid") == m_config_file.end() ||
-	       bool(m_config_file["invalid"]) == false))) {
+	if (labeled_invalid(m_config_file)) {
 		m_valid = false;
 		return;
 	}
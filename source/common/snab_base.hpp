@@ -183,6 +183,23 @@ public:
 	 */
 	bool valid() const { return m_valid; }
 
+	/**
+	 * @brief Reads the config file of a SNAB and chooses the entries for the
+	 * given bench index, as done by the constructor. Used to decide on the
+	 * validity of a SNAB without constructing it, see snab_config_valid().
+	 * Required parameters are not checked.
+	 *
+	 * @param name name of the SNAB, and therefore of the config file
+	 * @param backend string containing the simulation backend
+	 * @param bench_index index for all arrays in the config file
+	 * @param config will contain the config for the given bench index
+	 * @return false if there is no entry for the bench index or the config is
+	 * labeled as invalid
+	 */
+	static bool read_bench_config(const std::string &name,
+	                              const std::string &backend,
+	                              size_t bench_index, cypress::Json &config);
+
 	/**
 	 * @brief Virtual method cloning the SNAB without knowing which SNAB it is
 	 */
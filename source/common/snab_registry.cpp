@@ -17,6 +17,7 @@
  */
 
 #include <cypress/cypress.hpp>  // Avoid a warning
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -37,86 +38,130 @@
 #include "common/snab_registry.hpp"
 
 namespace SNAB {
+namespace {
+/**
+ * Registry entry: name of the SNAB and the factory constructing it
+ */
+using SNABEntry = std::pair<std::string, SNABFactory>;
+
+template <typename T>
+SNABEntry register_snab(const std::string &name)
+{
+	return SNABEntry(name, [](std::string backend, size_t bench_index) {
+		return std::make_shared<T>(backend, bench_index);
+	});
+}
+
+/**
+ * All SNABs in order of execution. Only the factories are stored here, SNABs
+ * are constructed on demand. The name has to match the name the SNAB passes
+ * to SNABBase, which is the class name for all SNABs in this suite.
+ */
+const std::vector<SNABEntry> &registry()
+{
+	static const std::vector<SNABEntry> vec = {
+	    register_snab<OutputFrequencySingleNeuron>(
+	        "OutputFrequencySingleNeuron"),
+	    register_snab<OutputFrequencySingleNeuron2>(
+	        "OutputFrequencySingleNeuron2"),
+	    register_snab<OutputFrequencyMultipleNeurons>(
+	        "OutputFrequencyMultipleNeurons"),
+	    register_snab<RefractoryPeriod>("RefractoryPeriod"),
+	    register_snab<MaxInputOneToOne>("MaxInputOneToOne"),
+	    register_snab<MaxInputAllToAll>("MaxInputAllToAll"),
+	    register_snab<MaxInputFixedOutConnector>("MaxInputFixedOutConnector"),
+	    register_snab<MaxInputFixedInConnector>("MaxInputFixedInConnector"),
+	    register_snab<SingleMaxFreqToGroup>("SingleMaxFreqToGroup"),
+	    register_snab<GroupMaxFreqToGroup>("GroupMaxFreqToGroup"),
+	    register_snab<GroupMaxFreqToGroupAllToAll>(
+	        "GroupMaxFreqToGroupAllToAll"),
+	    register_snab<GroupMaxFreqToGroupProb>("GroupMaxFreqToGroupProb"),
+	    register_snab<SetupTimeOneToOne>("SetupTimeOneToOne"),
+	    register_snab<SetupTimeAllToAll>("SetupTimeAllToAll"),
+	    register_snab<SetupTimeRandom>("SetupTimeRandom"),
+	    register_snab<SimpleWTA>("SimpleWTA"),
+	    register_snab<LateralInhibWTA>("LateralInhibWTA"),
+	    register_snab<MirrorInhibWTA>("MirrorInhibWTA"),
+	    register_snab<MirrorInhibWTASmall>("MirrorInhibWTASmall"),
+	    register_snab<WeightDependentActivation>("WeightDependentActivation"),
+	    register_snab<RateBasedWeightDependentActivation>(
+	        "RateBasedWeightDependentActivation"),
+	    register_snab<ReluSimilarity>("ReluSimilarity"),
+	    register_snab<MnistSpikey>("MnistSpikey"),
+	    register_snab<MnistNAS63>("MnistNAS63"),
+	    register_snab<MnistNAS129>("MnistNAS129"),
+	    register_snab<MnistNAStop>("MnistNAStop"),
+	    register_snab<MnistDiehl>("MnistDiehl"),
+	    register_snab<MnistITLLastLayer>("MnistITLLastLayer"),
+	    register_snab<MnistITL>("MnistITL"),
+	    register_snab<MnistSpikeyTTFS>("MnistSpikeyTTFS"),
+	    register_snab<MnistDiehlTTFS>("MnistDiehlTTFS"),
+	    register_snab<MnistITLTTFS>("MnistITLTTFS"),
+	    register_snab<BiNAM>("BiNAM"),
+	    register_snab<BiNAM_pop>("BiNAM_pop"),
+	    register_snab<BiNAM_burst>("BiNAM_burst"),
+	    register_snab<BiNAM_pop_burst>("BiNAM_pop_burst"),
+	    register_snab<SpikingSudoku>("SpikingSudoku"),
+	    register_snab<SpikingSudokuSinglePop>("SpikingSudokuSinglePop"),
+	    register_snab<SpikingSudokuMirrorInhib>("SpikingSudokuMirrorInhib"),
+	    register_snab<SpikingSlam>("SpikingSlam"),
+	    register_snab<FunctionApproximation>("FunctionApproximation"),
+	    register_snab<MnistDoubleCNN>("MnistDoubleCNN"),
+	    register_snab<MnistCNNPool>("MnistCNNPool"),
+	};
+	return vec;
+}
+
+/**
+ * Index of the registry, maps SNAB names to their factory
+ */
+const std::map<std::string, SNABFactory> &registry_index()
+{
+	static const std::map<std::string, SNABFactory> index(registry().begin(),
+	                                                      registry().end());
+	return index;
+}
+}  // namespace
+
+const std::vector<std::string> &snab_names()
+{
+	static const std::vector<std::string> names = []() {
+		std::vector<std::string> res;
+		for (const auto &i : registry()) {
+			res.push_back(i.first);
+		}
+		return res;
+	}();
+	return names;
+}
+
+std::shared_ptr<SNABBase> create_snab(const std::string &name,
+                                      std::string backend, size_t bench_index)
+{
+	auto it = registry_index().find(name);
+	if (it == registry_index().end()) {
+		return std::shared_ptr<SNABBase>();
+	}
+	return it->second(backend, bench_index);
+}
+
+bool snab_config_valid(const std::string &name, const std::string &backend,
+                       size_t bench_index)
+{
+	if (registry_index().find(name) == registry_index().end()) {
+		return false;
+	}
+	cypress::Json config;
+	return SNABBase::read_bench_config(name, backend, bench_index, config);
+}
+
 std::vector<std::shared_ptr<SNABBase>> snab_registry(std::string backend,
                                                      size_t bench_index)
 {
-	std::vector<std::shared_ptr<SNABBase>> vec = {
-	    std::make_shared<OutputFrequencySingleNeuron>(
-	        OutputFrequencySingleNeuron(backend, bench_index)),
-	    std::make_shared<OutputFrequencySingleNeuron2>(
-	        OutputFrequencySingleNeuron2(backend, bench_index)),
-	    std::make_shared<OutputFrequencyMultipleNeurons>(
-	        OutputFrequencyMultipleNeurons(backend, bench_index)),
-	    std::make_shared<RefractoryPeriod>(
-	        RefractoryPeriod(backend, bench_index)),
-	    std::make_shared<MaxInputOneToOne>(
-	        MaxInputOneToOne(backend, bench_index)),
-	    std::make_shared<MaxInputAllToAll>(
-	        MaxInputAllToAll(backend, bench_index)),
-	    std::make_shared<MaxInputFixedOutConnector>(
-	        MaxInputFixedOutConnector(backend, bench_index)),
-	    std::make_shared<MaxInputFixedInConnector>(
-	        MaxInputFixedInConnector(backend, bench_index)),
-	    std::make_shared<SingleMaxFreqToGroup>(
-	        SingleMaxFreqToGroup(backend, bench_index)),
-	    std::make_shared<GroupMaxFreqToGroup>(
-	        GroupMaxFreqToGroup(backend, bench_index)),
-	    std::make_shared<GroupMaxFreqToGroupAllToAll>(
-	        GroupMaxFreqToGroupAllToAll(backend, bench_index)),
-	    std::make_shared<GroupMaxFreqToGroupProb>(
-	        GroupMaxFreqToGroupProb(backend, bench_index)),
-	    std::make_shared<SetupTimeOneToOne>(
-	        SetupTimeOneToOne(backend, bench_index)),
-	    std::make_shared<SetupTimeAllToAll>(
-	        SetupTimeAllToAll(backend, bench_index)),
-	    std::make_shared<SetupTimeRandom>(
-	        SetupTimeRandom(backend, bench_index)),
-	    std::make_shared<SimpleWTA>(SimpleWTA(backend, bench_index)),
-	    std::make_shared<LateralInhibWTA>(
-	        LateralInhibWTA(backend, bench_index)),
-	    std::make_shared<MirrorInhibWTA>(MirrorInhibWTA(backend, bench_index)),
-	    std::make_shared<MirrorInhibWTASmall>(MirrorInhibWTASmall(backend, bench_index)),
-	    std::make_shared<WeightDependentActivation>(
-	        WeightDependentActivation(backend, bench_index)),
-	    std::make_shared<RateBasedWeightDependentActivation>(
-	        RateBasedWeightDependentActivation(backend, bench_index)),
-	    std::make_shared<ReluSimilarity>(
-	        ReluSimilarity(backend, bench_index)),
-	    std::make_shared<MnistSpikey>(MnistSpikey(backend, bench_index)),
-	    std::make_shared<MnistNAS63>(MnistNAS63(backend, bench_index)),
-	    std::make_shared<MnistNAS129>(MnistNAS129(backend, bench_index)),
-	    std::make_shared<MnistNAStop>(MnistNAStop(backend, bench_index)),
-	    std::make_shared<MnistDiehl>(MnistDiehl(backend, bench_index)),
-	    std::make_shared<MnistITLLastLayer>(
-	        MnistITLLastLayer(backend, bench_index)),
-	    std::make_shared<MnistITL>(
-	        MnistITL(backend, bench_index)),
-	    std::make_shared<MnistSpikeyTTFS>(
-	        MnistSpikeyTTFS(backend, bench_index)),
-	    std::make_shared<MnistDiehlTTFS>(
-	        MnistDiehlTTFS(backend, bench_index)),
-	    std::make_shared<MnistITLTTFS>(
-	        MnistITLTTFS(backend, bench_index)),
-	    std::make_shared<BiNAM>(BiNAM(backend, bench_index)),
-	    std::make_shared<BiNAM_pop>(BiNAM_pop(backend, bench_index)),
-	    std::make_shared<BiNAM_burst>(BiNAM_burst(backend, bench_index)),
-	    std::make_shared<BiNAM_pop_burst>(
-	        BiNAM_pop_burst(backend, bench_index)),
-	    std::make_shared<SpikingSudoku>(
-	        SpikingSudoku(backend, bench_index)),
-	    std::make_shared<SpikingSudokuSinglePop>(
-	        SpikingSudokuSinglePop(backend, bench_index)),
-	    std::make_shared<SpikingSudokuMirrorInhib>(
-	        SpikingSudokuMirrorInhib(backend, bench_index)),
-	    std::make_shared<SpikingSlam>(
-	        SpikingSlam(backend, bench_index)),
-	    std::make_shared<FunctionApproximation>(
-	        FunctionApproximation(backend, bench_index)),
-	    std::make_shared<MnistDoubleCNN>(
-	        MnistDoubleCNN(backend, bench_index)),
-	    std::make_shared<MnistCNNPool>(
-	        MnistCNNPool(backend, bench_index)),
-	};
+	std::vector<std::shared_ptr<SNABBase>> vec;
+	for (const auto &i : registry()) {
+		vec.emplace_back(i.second(backend, bench_index));
+	}
 	return vec;
 }
 }  // namespace SNAB
@@ -21,6 +21,7 @@
 #ifndef SNABSUITE_COMMON_SNAB_REGISTRY_HPP
 #define SNABSUITE_COMMON_SNAB_REGISTRY_HPP
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -28,12 +29,45 @@
 #include "common/snab_base.hpp"
 
 namespace SNAB {
+/**
+ * Factory constructing a SNAB for the given backend and bench index
+ */
+using SNABFactory =
+    std::function<std::shared_ptr<SNABBase>(std::string, size_t)>;
+
+/**
+ * Names of all registered SNABs/benchmarks in order of execution. This does
+ * not construct any SNAB.
+ */
+const std::vector<std::string> &snab_names();
+
+/**
+ * Constructs only the requested SNAB.
+ * @param name name of the SNAB as returned by SNABBase::snab_name()
+ * @param backend the cypress backend
+ * @param bench_index index for scalable benchmarks
+ * @return shared pointer to the new SNAB, nullptr for unknown names
+ */
+std::shared_ptr<SNABBase> create_snab(const std::string &name,
+                                      std::string backend, size_t bench_index);
+
+/**
+ * Checks whether the config of a SNAB marks it as valid for the given backend
+ * and bench index, without constructing the SNAB itself. Uses the same check
+ * as the SNAB constructor, see SNABBase::read_bench_config(). Required
+ * parameters are only checked by the constructor, see SNABBase::valid().
+ * Returns false for unknown names.
+ */
+bool snab_config_valid(const std::string &name, const std::string &backend,
+                       size_t bench_index);
+
 /**
  * A vector containing all SNABs/benchmarks which should be executed. The shared
- * pointer ensures that objects live 'long enough'
+ * pointer ensures that objects live 'long enough'. Note that this constructs
+ * every SNAB, prefer create_snab() if only one is needed.
  */
 std::vector<std::shared_ptr<SNABBase>> snab_registry(std::string backend,
                                                      size_t bench_index);
-}
+}  // namespace SNAB
 
 #endif /* SNABSUITE_COMMON_SNAB_REGISTRY_HPP */
@@ -1,8 +1,18 @@
 
 #pragma once
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <system_error>
 #include <thread>
@@ -16,6 +26,305 @@
 namespace Energy {
 std::atomic<bool> m_record(false);
 
+/**
+ * @brief Lock-free ring buffer for exactly one producer and one consumer
+ * thread. The capacity is fixed at construction, no allocation happens while
+ * pushing or popping.
+ */
+template <typename T>
+class SpscRing {
+private:
+	std::vector<T> m_buffer;
+	size_t m_mask;
+	std::atomic<size_t> m_head{0};  // Next element to pop, owned by consumer
+	char m_pad[64];                 // Keep head and tail on own cache lines
+	std::atomic<size_t> m_tail{0};  // Next free slot, owned by producer
+
+	static size_t next_pow2(size_t n)
+	{
+		size_t res = 1;
+		while (res < n) {
+			res <<= 1;
+		}
+		return res;
+	}
+
+public:
+	/**
+	 * @param capacity minimal number of elements, rounded up to a power of 2
+	 */
+	explicit SpscRing(size_t capacity)
+	    : m_buffer(next_pow2(std::max(capacity, size_t(2)))),
+	      m_mask(m_buffer.size() - 1)
+	{
+	}
+
+	/**
+	 * @brief Producer side. Returns false if the buffer is full.
+	 */
+	bool push(const T &value)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) > m_mask) {
+			return false;
+		}
+		m_buffer[tail & m_mask] = value;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief Consumer side. Returns false if the buffer is empty.
+	 */
+	bool pop(T &value)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = m_buffer[head & m_mask];
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t capacity() const { return m_buffer.size(); }
+
+	/**
+	 * @brief Drops all elements and changes the capacity. Neither producer nor
+	 * consumer may access the buffer meanwhile.
+	 */
+	void reset(size_t capacity)
+	{
+		m_buffer.assign(next_pow2(std::max(capacity, size_t(2))), T());
+		m_mask = m_buffer.size() - 1;
+		m_head = 0;
+		m_tail = 0;
+	}
+};
+
+/**
+ * @brief Calls a function as soon as a file is created, used by external
+ * processes to signal the end of a measurement. Uses inotify on the directory
+ * of the file instead of polling the file system.
+ */
+class FileSignal {
+private:
+	int m_inotify = -1;
+	int m_wake = -1;
+	std::thread m_thread;
+
+	void watch(std::string name, std::function<void()> callback)
+	{
+		alignas(struct inotify_event) char buffer[4096];
+		pollfd fds[2] = {{m_inotify, POLLIN, 0}, {m_wake, POLLIN, 0}};
+		while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+			if (fds[1].revents) {
+				return;
+			}
+			if (!fds[0].revents) {
+				continue;
+			}
+			ssize_t len = read(m_inotify, buffer, sizeof(buffer));
+			for (ssize_t i = 0; i < len;) {
+				auto event = reinterpret_cast<struct inotify_event *>(buffer + i);
+				if (event->len && name == event->name) {
+					callback();
+					return;
+				}
+				i += sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+
+public:
+	/**
+	 * @param file the file to wait for
+	 * @param callback called once from a background thread
+	 */
+	FileSignal(const std::string &file, std::function<void()> callback)
+	{
+		auto pos = file.rfind('/');
+		std::string dir = pos == std::string::npos ? "." : file.substr(0, pos);
+		std::string name =
+		    pos == std::string::npos ? file : file.substr(pos + 1);
+		m_inotify = inotify_init1(IN_CLOEXEC);
+		m_wake = eventfd(0, EFD_CLOEXEC);
+		if (m_inotify < 0 || m_wake < 0 ||
+		    inotify_add_watch(m_inotify, dir.c_str(),
+		                      IN_CREATE | IN_MOVED_TO) < 0) {
+			int err = errno;
+			close(m_inotify);
+			close(m_wake);
+			throw std::system_error(err, std::system_category());
+		}
+		// The file might have been created before the watch was set up
+		if (access(file.c_str(), F_OK) == 0) {
+			callback();
+			return;
+		}
+		m_thread = std::thread(&FileSignal::watch, this, name, callback);
+	}
+
+	~FileSignal()
+	{
+		if (m_thread.joinable()) {
+			uint64_t one = 1;
+			if (write(m_wake, &one, sizeof(one)) < 0) {
+				// Nothing we can do here
+			}
+			m_thread.join();
+		}
+		close(m_inotify);
+		close(m_wake);
+	}
+};
+
+/**
+ * @brief Online statistics of a measurement, updated with every sample. Gives
+ * the same results as the corresponding static functions of Multimeter
+ * applied to the full record, but in constant memory.
+ */
+class EnergyAccumulator {
+public:
+	using timed_record = MeasureDevice::data;
+
+private:
+	uint32_t m_thresh;
+	size_t m_samples = 0;
+	timed_record m_prev;
+
+	double m_energy = 0.0;            // Rectangle rule, mJ
+	double m_energy_trapezoid = 0.0;  // Trapezoidal rule, mJ
+	double m_power = 0.0;             // Sum of power above threshold
+	size_t m_power_count = 0;
+	double m_current = 0.0;  // Sum of current above threshold
+
+	// Current and previous segment above threshold
+	bool m_new_segment = false;
+	double m_seg_energy = 0.0, m_seg_energy_prev = 0.0;
+	bool m_new_power_segment = false;
+	double m_seg_power = 0.0, m_seg_power_prev = 0.0;
+	size_t m_seg_count = 0, m_seg_count_prev = 0;
+
+	double m_min_current = 0.0, m_max_current = 0.0;
+	double m_min_voltage = 0.0, m_max_voltage = 0.0;
+
+public:
+	/**
+	 * @param milliamps_thresh samples with a current at or below are ignored
+	 * for energy, power and average current
+	 */
+	explicit EnergyAccumulator(uint32_t milliamps_thresh = 0)
+	    : m_thresh(milliamps_thresh)
+	{
+	}
+
+	void add(const timed_record &rec)
+	{
+		double voltage = std::get<1>(rec), current = std::get<2>(rec),
+		       power = std::get<3>(rec);
+		bool above = current > m_thresh;
+		if (m_samples) {
+			if (above) {
+				double dt =
+				    std::chrono::duration<double>(std::get<0>(rec) -
+				                                  std::get<0>(m_prev))
+				        .count();
+				m_energy += power * dt;
+				m_energy_trapezoid += 0.5 * (power + std::get<3>(m_prev)) * dt;
+				m_seg_energy += power * dt;
+			}
+			else if (m_seg_energy != 0) {
+				m_seg_energy_prev = m_seg_energy;
+				m_seg_energy = 0.0;
+				m_new_segment = true;
+			}
+			m_min_current = std::min(m_min_current, current);
+			m_max_current = std::max(m_max_current, current);
+			m_min_voltage = std::min(m_min_voltage, voltage);
+			m_max_voltage = std::max(m_max_voltage, voltage);
+		}
+		else {
+			m_min_current = m_max_current = current;
+			m_min_voltage = m_max_voltage = voltage;
+		}
+
+		if (above) {
+			m_power += power;
+			m_current += current;
+			m_power_count++;
+			m_seg_power += power;
+			m_seg_count++;
+		}
+		else if (m_seg_power) {
+			m_seg_power_prev = m_seg_power;
+			m_seg_count_prev = m_seg_count;
+			m_seg_power = 0.0;
+			m_seg_count = 0;
+			m_new_power_segment = true;
+		}
+		m_prev = rec;
+		m_samples++;
+	}
+
+	void reset(uint32_t milliamps_thresh)
+	{
+		*this = EnergyAccumulator(milliamps_thresh);
+	}
+
+	uint32_t threshold() const { return m_thresh; }
+	size_t samples() const { return m_samples; }
+
+	/**
+	 * @brief Energy in mJoule, every sample above threshold contributes its
+	 * power times the time since the previous sample
+	 */
+	double energy() const { return m_energy; }
+
+	/**
+	 * @brief Energy in mJoule, integrated with the trapezoidal rule over all
+	 * intervals ending in a sample above threshold
+	 */
+	double energy_trapezoid() const { return m_energy_trapezoid; }
+
+	/**
+	 * @brief Energy of the last segment above threshold in mJoule
+	 */
+	double energy_last() const
+	{
+		if (m_seg_energy) {
+			return m_seg_energy;
+		}
+		return m_new_segment ? m_seg_energy_prev : 0.0;
+	}
+
+	double average_power_draw() const
+	{
+		return m_power / double(m_power_count);
+	}
+
+	double average_power_draw_last() const
+	{
+		if (m_seg_power) {
+			return m_seg_power / double(m_seg_count);
+		}
+		if (!m_new_power_segment) {
+			return 0.0;
+		}
+		return m_seg_power_prev / double(m_seg_count_prev);
+	}
+
+	double average_current() const
+	{
+		return m_current / double(m_power_count);
+	}
+
+	double min_current() const { return m_min_current; }
+	double max_current() const { return m_max_current; }
+	double min_voltage() const { return m_min_voltage; }
+	double max_voltage() const { return m_max_voltage; }
+};
+
 /**
  * @brief This class is not thread safe! Would not make any sense since there is
  * only one recording device in one instance!
@@ -35,14 +344,52 @@ private:
 	using timed_record = MeasureDevice::data;
 
 	std::atomic<bool> m_record{false};
-	std::thread m_thread;
+	std::thread m_thread;    // Samples the device
+	std::thread m_consumer;  // Drains m_ring into m_data
 	std::vector<timed_record> m_data;
 
+	double m_sample_rate = 0.0;  // Target rate in Hz, 0: as fast as possible
+	SpscRing<timed_record> m_ring{4096};
+	std::atomic<bool> m_stop{false};  // External stop or stop_recording
+	std::atomic<bool> m_sampling{false};
+	std::atomic<size_t> m_dropped{0};
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	EnergyAccumulator m_stats;  // Updated by the consumer thread
+	bool m_keep_samples = true;
+
 	bool m_block = false;
 	std::string file_name = "sync_lock";
 
+	void signal_stop()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+
+	/**
+	 * @brief Whether a query with the given threshold can be answered by the
+	 * online statistics
+	 */
+	bool use_stats(uint32_t milliamps_thresh) const
+	{
+		check_size(m_stats.samples());
+		if (milliamps_thresh == m_stats.threshold()) {
+			return true;
+		}
+		if (!m_keep_samples) {
+			throw std::runtime_error(
+			    "Samples were not kept, only threshold " +
+			    std::to_string(m_stats.threshold()) + " can be evaluated");
+		}
+		return false;
+	}
+
 	void priv_continuos_record()
 	{
+		std::unique_ptr<FileSignal> stop_signal;
 		if (m_block) {
 			remove(file_name.c_str());
 			remove((file_name + "2").c_str());
@@ -57,14 +404,55 @@ private:
 				usleep(30);
 			}
 			res.close();
+			stop_signal.reset(new FileSignal(file_name + "2", [this]() {
+				remove((file_name + "2").c_str());
+				signal_stop();
+			}));
 		}
-		while (m_record) {
-			m_data.emplace_back(m_device->get_data_sample_timed());
-			if (m_block) {
-				if (std::ifstream(file_name + "2").good()) {
-					remove((file_name + "2").c_str());
-					break;
+		// Only samples taken during the measured window
+		m_device->discard_pending();
+		auto period = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		    std::chrono::duration<double>(
+		        m_sample_rate > 0.0 ? 1.0 / m_sample_rate : 0.0));
+		auto next = std::chrono::steady_clock::now();
+		while (!m_stop) {
+			if (!m_ring.push(m_device->get_data_sample_timed())) {
+				m_dropped++;
+			}
+			if (period.count() > 0) {
+				// Fixed rate independent of the device latency, skip missed
+				// slots instead of catching up
+				next += period;
+				auto now = std::chrono::steady_clock::now();
+				if (next < now) {
+					next = now;
+				}
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait_until(lock, next, [this]() { return m_stop.load(); });
+			}
+		}
+		m_sampling = false;
+	}
+
+	void priv_consume()
+	{
+		timed_record sample;
+		while (true) {
+			bool done = !m_sampling;
+			size_t count = 0;
+			while (m_ring.pop(sample)) {
+				m_stats.add(sample);
+				if (m_keep_samples) {
+					m_data.emplace_back(sample);
 				}
+				count++;
+			}
+			if (done) {
+				break;
+			}
+			// Only back off while the ring is far from full
+			if (count < m_ring.capacity() / 2) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
 			}
 		}
 	}
@@ -84,6 +472,21 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Record from an already opened device
+	 */
+	explicit Multimeter(std::shared_ptr<MeasureDevice> device)
+	    : m_device(device)
+	{
+	}
+
+	~Multimeter()
+	{
+		if (m_record) {
+			stop_recording();
+		}
+	}
+
 	std::vector<timed_record> continuos_record(std::atomic<bool> &record)
 	{
 		std::vector<timed_record> res;
@@ -102,6 +505,56 @@ public:
 		return res;
 	}
 
+	/**
+	 * @brief Recording samples the device with a fixed rate, independent of
+	 * the latency of the device (as long as it is fast enough)
+	 *
+	 * @param rate target sampling rate in Hz, 0 samples as fast as possible
+	 */
+	void set_sample_rate(double rate) { m_sample_rate = rate; }
+
+	/**
+	 * @brief Number of samples buffered between the sampling and the consuming
+	 * thread, rounded up to a power of 2. Samples are dropped if the buffer
+	 * is full.
+	 */
+	void set_buffer_size(size_t size)
+	{
+		if (m_record.load()) {
+			throw std::runtime_error("Call to set_buffer_size while recording");
+		}
+		m_ring.reset(size);
+	}
+
+	/**
+	 * @brief Number of samples of the last recording which were lost because
+	 * the consumer could not keep up
+	 */
+	size_t dropped_samples() const { return m_dropped; }
+
+	/**
+	 * @brief Set the current threshold used by the online statistics. Queries
+	 * with this threshold are answered without touching the samples.
+	 *
+	 * @param milliamps_thresh threshold in milli amp
+	 */
+	void set_online_threshold(uint32_t milliamps_thresh)
+	{
+		m_stats.reset(milliamps_thresh);
+	}
+
+	/**
+	 * @brief Do not store the raw samples, only the online statistics. Useful
+	 * for long measurements, but only the threshold given to
+	 * set_online_threshold can be evaluated afterwards.
+	 */
+	void set_keep_samples(bool keep) { m_keep_samples = keep; }
+
+	/**
+	 * @brief Online statistics of the last recording
+	 */
+	const EnergyAccumulator &statistics() const { return m_stats; }
+
 	void start_recording()
 	{
 		if (m_record.load()) {
@@ -110,6 +563,11 @@ public:
 		}
 		m_record.store(true);  // Not threadsafe, could be true in meantime
 		m_data.clear();
+		m_stop = false;
+		m_sampling = true;
+		m_dropped = 0;
+		m_stats.reset(m_stats.threshold());
+		m_consumer = std::thread(&Multimeter::priv_consume, this);
 		m_thread = std::thread(&Multimeter::priv_continuos_record, this);
 	}
 
@@ -119,8 +577,15 @@ public:
 			throw std::runtime_error(
 			    "Call to stop_recording without recording");
 		}
-		m_record.store(false);
+		signal_stop();
 		m_thread.join();
+		m_consumer.join();
+		m_record.store(false);
+		if (m_dropped) {
+			cypress::global_logger().warn(
+			    "Multimeter", "Dropped " + std::to_string(m_dropped) +
+			                      " samples during recording");
+		}
 		return m_data;
 	}
 
@@ -186,6 +651,9 @@ public:
 
 	double calculate_energy(uint32_t milliamps_thresh = 0.0) const
 	{
+		if (use_stats(milliamps_thresh)) {
+			return m_stats.energy();
+		}
 		return calculate_energy(m_data, milliamps_thresh);
 	}
 
@@ -222,6 +690,9 @@ public:
 
 	double calculate_energy_last(uint32_t milliamps_thresh) const
 	{
+		if (use_stats(milliamps_thresh)) {
+			return m_stats.energy_last();
+		}
 		return calculate_energy_last(m_data, milliamps_thresh);
 	}
 
@@ -249,6 +720,9 @@ public:
 
 	double average_power_draw(uint32_t milliamps_thresh = 0.0) const
 	{
+		if (use_stats(milliamps_thresh)) {
+			return m_stats.average_power_draw();
+		}
 		return average_power_draw(m_data, milliamps_thresh);
 	}
 	static double average_power_draw_last(const std::vector<timed_record> &rec,
@@ -281,6 +755,9 @@ public:
 
 	double average_power_draw_last(uint32_t milliamps_thresh) const
 	{
+		if (use_stats(milliamps_thresh)) {
+			return m_stats.average_power_draw_last();
+		}
 		return average_power_draw_last(m_data, milliamps_thresh);
 	}
 
@@ -313,7 +790,11 @@ public:
 			    return std::get<2>(a) < std::get<2>(b);
 		    }));
 	}
-	double max_current() const { return max_current(m_data); }
+	double max_current() const
+	{
+		check_size(m_stats.samples());
+		return m_stats.max_current();
+	}
 
 	static double max_voltage(const std::vector<timed_record> &rec)
 	{
@@ -322,7 +803,11 @@ public:
 			    return std::get<1>(a) < std::get<1>(b);
 		    }));
 	}
-	double max_voltage() const { return max_voltage(m_data); }
+	double max_voltage() const
+	{
+		check_size(m_stats.samples());
+		return m_stats.max_voltage();
+	}
 
 	static double min_current(const std::vector<timed_record> &rec)
 	{
@@ -331,7 +816,11 @@ public:
 			    return std::get<2>(a) < std::get<2>(b);
 		    }));
 	}
-	double min_current() const { return min_current(m_data); }
+	double min_current() const
+	{
+		check_size(m_stats.samples());
+		return m_stats.min_current();
+	}
 
 	static double min_voltage(const std::vector<timed_record> &rec)
 	{
@@ -340,7 +829,11 @@ public:
 			    return std::get<1>(a) < std::get<1>(b);
 		    }));
 	}
-	double min_voltage() const { return min_voltage(m_data); }
+	double min_voltage() const
+	{
+		check_size(m_stats.samples());
+		return m_stats.min_voltage();
+	}
 
 	void set_block(bool block) { m_block = block; }
 };
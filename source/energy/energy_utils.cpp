@@ -1,7 +1,11 @@
 
 #include <glob.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cypress/cypress.hpp>
+#include <limits>
+#include <thread>
 
 #include "energy_utils.hpp"
 #include "util/utilities.hpp"
@@ -44,12 +48,57 @@ size_t get_number_of_neurons(cypress::Network &netw, bool sources)
 	return neurons;
 }
 
-size_t calc_number_stdp_synapses(const cypress::Network &netw)
+bool FanOutCache::Entry::matches(
+    const cypress::ConnectionDescriptor &descr) const
 {
+	return pid_src == size_t(descr.pid_src()) &&
+	       pid_tar == size_t(descr.pid_tar()) &&
+	       connector == &descr.connector() &&
+	       synapse == descr.connector().synapse();
+}
+
+std::shared_ptr<const FanOutCache::FanOut> FanOutCache::get(
+    const cypress::ConnectionDescriptor &descr, size_t conn_id,
+    size_t source_size)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_cache.find(conn_id);
+		if (it != m_cache.end() && it->second.matches(descr)) {
+			return it->second.fan_out;
+		}
+	}
+
+	// Expand the connector without holding the lock
+	std::shared_ptr<FanOut> fan_out = std::make_shared<FanOut>();
+	fan_out->per_source.resize(source_size, 0);
+	std::vector<cypress::LocalConnection> connections;
+	descr.connect(connections);
+	for (const auto &lc : connections) {
+		if (lc.valid()) {
+			fan_out->per_source[lc.src]++;
+			fan_out->synapses++;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cache[conn_id] = Entry{size_t(descr.pid_src()), size_t(descr.pid_tar()),
+	                         &descr.connector(), descr.connector().synapse(),
+	                         fan_out};
+	return fan_out;
+}
 
+size_t calc_number_stdp_synapses(const cypress::Network &netw,
+                                 FanOutCache *cache)
+{
+	FanOutCache local_cache;
+	if (!cache) {
+		cache = &local_cache;
+	}
 	size_t res = 0;
 	auto &conns = netw.connections();
-	for (const auto &descr : conns) {
+	for (size_t i = 0; i < conns.size(); i++) {
+		const auto &descr = conns[i];
 		auto name = descr.connector().name();
 		if (descr.connector().synapse()->learning()) {
 			if (name == "AllToAllConnector") {
@@ -65,13 +114,10 @@ size_t calc_number_stdp_synapses(const cypress::Network &netw)
 					    "EnergyModel",
 					    "Energy for random connectors is only approximated!");
 				}
-				std::vector<cypress::LocalConnection> connections;
-				descr.connect(connections);
-				for (auto lc : connections) {
-					if (lc.valid()) {
-						res++;
-					}
-				}
+				res += cache
+				           ->get(descr, i,
+				                 netw.populations()[descr.pid_src()].size())
+				           ->synapses;
 			}
 		}
 	}
@@ -91,53 +137,101 @@ std::vector<size_t> conn_ids_source(
 	return res;
 }
 
-std::tuple<size_t, size_t, size_t> calc_postsyn_spikes(
-    const cypress::PopulationBase &pop,
-    const std::vector<cypress::ConnectionDescriptor> &conns, bool stdp)
+std::vector<std::vector<size_t>> conn_ids_by_source(
+    const cypress::Network &netw)
 {
-	auto conn_ids = conn_ids_source(pop.pid(), conns);
-	size_t spikes_one = 0, spikes_all = 0, spikes_misc = 0;
+	std::vector<std::vector<size_t>> res(netw.populations().size());
+	const auto &conns = netw.connections();
+	for (size_t i = 0; i < conns.size(); i++) {
+		res[conns[i].pid_src()].push_back(i);
+	}
+	return res;
+}
+
+namespace {
+/**
+ * @brief Counts postsynaptic spikes of all given connections in one pass,
+ * see calc_postsyn_spikes. Spike counts of the neurons are gathered once.
+ *
+ * @param cache fan-out of FromList and random connectors
+ * @param res postsynaptic spikes over O2O, A2A and other connectors
+ * @param res_stdp the same for STDP synapses only
+ * @return true if a random connector was only approximated. Not logged here,
+ * since this runs on worker threads.
+ */
+bool postsyn_spikes(const cypress::PopulationBase &pop,
+                    const std::vector<cypress::ConnectionDescriptor> &conns,
+                    const std::vector<size_t> &conn_ids,
+                    FanOutCache &cache, std::array<size_t, 3> &res,
+                    std::array<size_t, 3> &res_stdp)
+{
+	res = {{0, 0, 0}};
+	res_stdp = {{0, 0, 0}};
+	bool approximated = false;
+	if (conn_ids.empty()) {
+		return approximated;
+	}
+	std::vector<size_t> spikes(pop.size());
+	size_t spikes_pop = 0;
+	for (size_t i = 0; i < pop.size(); i++) {
+		spikes[i] = pop[i].signals().data(0).size();
+		spikes_pop += spikes[i];
+	}
 	const auto &netw = pop.network();
 	for (auto cid : conn_ids) {
 		auto name = conns[cid].connector().name();
-		if (stdp && !(conns[cid].connector().synapse()->learning())) {
-			continue;
-		}
+		size_t type = 2, count = 0;
 		if (name == "AllToAllConnector") {
-			size_t tar_size = netw.populations()[conns[cid].pid_tar()].size();
-			for (const auto &neuron : pop) {
-				spikes_all += neuron.signals().data(0).size() * tar_size;
-			}
+			type = 1;
+			count = spikes_pop * netw.populations()[conns[cid].pid_tar()].size();
 		}
 		else if (name == "OneToOneConnector") {
-			for (const auto &neuron : pop) {
-				spikes_one += neuron.signals().data(0).size();
-			}
+			type = 0;
+			count = spikes_pop;
 		}
 		else if (name == "FixedFanOutConnector") {
-			size_t fan_out =
-			    size_t(conns[cid].connector().additional_parameter());
-			for (const auto &neuron : pop) {
-				spikes_misc += neuron.signals().data(0).size() * fan_out;
-			}
+			count = spikes_pop *
+			        size_t(conns[cid].connector().additional_parameter());
 		}
 		else {
 			if (name != "FromListConnector") {
-				cypress::global_logger().warn(
-				    "EnergyModel",
-				    "Energy for random connectors is only approximated!");
+				approximated = true;
 			}
-			std::vector<cypress::LocalConnection> connections;
-			conns[cid].connect(connections);
-			for (auto lc : connections) {
-				if (lc.valid()) {
-					spikes_misc += pop[lc.src].signals().data(0).size();
-				}
+			// Dot product of spike counts and fan-out
+			auto fan_out = cache.get(conns[cid], cid, pop.size());
+			for (size_t i = 0; i < spikes.size(); i++) {
+				count += spikes[i] * fan_out->per_source[i];
 			}
 		}
+		res[type] += count;
+		if (conns[cid].connector().synapse()->learning()) {
+			res_stdp[type] += count;
+		}
+	}
+	return approximated;
+}
+
+void warn_approximated()
+{
+	cypress::global_logger().warn(
+	    "EnergyModel", "Energy for random connectors is only approximated!");
+}
+}  // namespace
+
+std::tuple<size_t, size_t, size_t> calc_postsyn_spikes(
+    const cypress::PopulationBase &pop,
+    const std::vector<cypress::ConnectionDescriptor> &conns, bool stdp)
+{
+	std::array<size_t, 3> res, res_stdp;
+	FanOutCache cache;
+	if (postsyn_spikes(pop, conns, conn_ids_source(pop.pid(), conns), cache,
+	                   res, res_stdp)) {
+		warn_approximated();
+	}
+	if (stdp) {
+		res = res_stdp;
 	}
-	return std::tuple<size_t, size_t, size_t>(spikes_one, spikes_all,
-	                                          spikes_misc);
+	return std::tuple<size_t, size_t, size_t>(res[0], res[1], res[2]);
 }
 
 Json setup_energy_model()
@@ -966,209 +1060,208 @@ void calculate_coefficients(Json &energy_model)
 	}
 }
 
+namespace {
+EnergyCoefficients::Coef coef(const Json &energy_model,
+                              const std::string &section,
+                              const std::string &key)
+{
+	auto sec = energy_model.find(section);
+	if (sec == energy_model.end() || sec->find(key) == sec->end()) {
+		return {std::numeric_limits<double>::quiet_NaN(),
+		        std::numeric_limits<double>::quiet_NaN()};
+	}
+	const auto &value = (*sec)[key];
+	return {value[0].get<double>(), value[1].get<double>()};
+}
+}  // namespace
+
+EnergyCoefficients::EnergyCoefficients(const Json &energy_model)
+    : idle(coef(energy_model, "power", "idle")),
+      idle_neurons(coef(energy_model, "power", "idle_neurons")),
+      idle_recorded_neurons(
+          coef(energy_model, "power", "idle_recorded_neurons")),
+      idle_stdp(coef(energy_model, "power", "idle_stdp")),
+      idle_neurons_ms(coef(energy_model, "energy", "idle_neurons_ms")),
+      idle_recorded_neurons_ms(
+          coef(energy_model, "energy", "idle_recorded_neurons_ms")),
+      idle_stdp_ms(coef(energy_model, "energy", "idle_stdp_ms")),
+      spike(coef(energy_model, "energy", "spike")),
+      input({{coef(energy_model, "energy", "InputSpike_O2O"),
+              coef(energy_model, "energy", "InputSpike_A2A"),
+              coef(energy_model, "energy", "InputSpike_random")}}),
+      transmission({{coef(energy_model, "energy", "Transmission_O2O"),
+                     coef(energy_model, "energy", "Transmission_S2A"),
+                     coef(energy_model, "energy", "Transmission_random")}}),
+      transmission_stdp(coef(energy_model, "energy", "Transmission_STDP"))
+{
+	stdp = energy_model.count("stdp") > 0 && energy_model["stdp"].get<bool>();
+	runtime_normalized = energy_model.count("runtime_normalized") > 0 &&
+	                     energy_model["runtime_normalized"].get<bool>();
+	if (energy_model.count("fixed_neuron_costs") > 0) {
+		fixed_neuron_costs = true;
+		n_neurons_system = energy_model["fixed_neuron_costs"].get<size_t>();
+	}
+}
+
+NetworkActivity::NetworkActivity(const cypress::Network &netw, size_t threads,
+                                 FanOutCache *cache)
+{
+	FanOutCache local_cache;
+	if (!cache) {
+		cache = &local_cache;
+	}
+	runtime =
+	    netw.runtime().sim_pure * 1000.0;  // TODO runtime not cross platform!
+	bioruntime = netw.runtime().duration;
+	if (bioruntime == 0) {
+		duration = netw.duration();
+	}
+	const auto &conns = netw.connections();
+	auto pops = netw.populations();
+	auto conn_ids = conn_ids_by_source(netw);
+	populations.resize(pops.size());
+
+	// Populations are independent of each other
+	std::atomic<size_t> next(0);
+	std::atomic<bool> approximated(false);
+	auto worker = [&]() {
+		for (size_t i = next++; i < pops.size(); i = next++) {
+			const auto &pop = pops[i];
+			auto &res = populations[i];
+			res.size = pop.size();
+			res.source = &pop.type() == &cypress::SpikeSourceArray::inst();
+			res.recording = pop.signals().is_recording(0);
+			if (res.recording) {
+				res.spikes = get_number_of_spikes_pop(pop);
+				if (postsyn_spikes(pop, conns, conn_ids[i], *cache,
+				                   res.postsyn, res.postsyn_stdp)) {
+					approximated = true;
+				}
+			}
+		}
+	};
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	threads = std::min(threads, pops.size());
+	std::vector<std::thread> pool;
+	for (size_t i = 1; i < threads; i++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto &t : pool) {
+		t.join();
+	}
+	if (approximated) {
+		warn_approximated();
+	}
+	stdp_synapses = calc_number_stdp_synapses(netw, cache);
+}
+
 std::pair<double, double> calculate_energy(const cypress::Network &netw,
                                            const Json &energy_model,
                                            double runt)
 {
-	double runtime =
-	    netw.runtime().sim_pure * 1000.0;  // TODO runtime not cross platform!
+	return calculate_energy(NetworkActivity(netw),
+	                        EnergyCoefficients(energy_model), runt);
+}
+
+std::pair<double, double> calculate_energy(const NetworkActivity &activity,
+                                           const EnergyCoefficients &coefs,
+                                           double runt)
+{
+	double runtime = activity.runtime;
 	if (runt > 0) {
 		runtime = runt;
 	}
 
 	double energy = 0.0, error = 0.0;
-	energy += runtime * energy_model["power"]["idle"][0].get<double>();
-	error += runtime * energy_model["power"]["idle"][1].get<double>();
-	auto &conns = netw.connections();
-	bool runtime_normalized = false;
-	double bioruntime = netw.runtime().duration;
-	if (energy_model.count("runtime_normalized") > 0 &&
-	    energy_model["runtime_normalized"].get<bool>()) {
-		runtime_normalized = true;
-		if (bioruntime == 0) {
-			bioruntime = netw.duration();
-			cypress::global_logger().warn(
-			    "EnergyModel", "Please provide simulation duration!");
-		}
+	energy += runtime * coefs.idle.first;
+	error += runtime * coefs.idle.second;
+	double bioruntime = activity.bioruntime;
+	if (coefs.runtime_normalized && bioruntime == 0) {
+		bioruntime = activity.duration;
+		cypress::global_logger().warn("EnergyModel",
+		                              "Please provide simulation duration!");
 	}
-	bool fixed_neuron_costs = false;
-	if (energy_model.count("fixed_neuron_costs") > 0) {
-		fixed_neuron_costs = true;
-		size_t n_neurons_system =
-		    energy_model["fixed_neuron_costs"].get<size_t>();
-		if (!runtime_normalized) {
-			energy += double(n_neurons_system) *
-			          energy_model["power"]["idle_recorded_neurons"][0]
-			              .get<double>() *
-			          runtime;
-			error += double(n_neurons_system) *
-			         energy_model["power"]["idle_recorded_neurons"][1]
-			             .get<double>() *
-			         runtime;
+	// Idle costs of n neurons for the whole simulation
+	auto idle_costs = [&](double n, const EnergyCoefficients::Coef &power,
+	                      const EnergyCoefficients::Coef &energy_ms) {
+		if (coefs.runtime_normalized) {
+			energy += n * energy_ms.first * bioruntime;
+			error += n * energy_ms.second * bioruntime;
 		}
 		else {
-			energy += double(n_neurons_system) *
-			          energy_model["energy"]["idle_recorded_neurons_ms"][0]
-			              .get<double>() *
-			          bioruntime;
-			error += double(n_neurons_system) *
-			         energy_model["energy"]["idle_recorded_neurons_ms"][1]
-			             .get<double>() *
-			         bioruntime;
+			energy += n * power.first * runtime;
+			error += n * power.second * runtime;
 		}
+	};
+	if (coefs.fixed_neuron_costs) {
+		idle_costs(double(coefs.n_neurons_system),
+		           coefs.idle_recorded_neurons,
+		           coefs.idle_recorded_neurons_ms);
 	}
-	for (const auto &pop : netw.populations()) {
-		if (&pop.type() == &cypress::SpikeSourceArray::inst()) {
-			if (!pop.signals().is_recording(0)) {
+	for (const auto &pop : activity.populations) {
+		if (pop.source) {
+			if (!pop.recording) {
 				cypress::global_logger().warn(
 				    "EnergyModel",
 				    "Please activate spike recording for all populations!");
 				continue;
 			}
-			auto spikes = calc_postsyn_spikes(pop, conns, false);
-			energy += double(std::get<0>(spikes)) *
-			          energy_model["energy"]["InputSpike_O2O"][0].get<double>();
-			energy += double(std::get<1>(spikes)) *
-			          energy_model["energy"]["InputSpike_A2A"][0].get<double>();
-			energy +=
-			    double(std::get<2>(spikes)) *
-			    energy_model["energy"]["InputSpike_random"][0].get<double>();
-
-			error += double(std::get<0>(spikes)) *
-			         energy_model["energy"]["InputSpike_O2O"][1].get<double>();
-			error += double(std::get<1>(spikes)) *
-			         energy_model["energy"]["InputSpike_A2A"][1].get<double>();
-			error +=
-			    double(std::get<2>(spikes)) *
-			    energy_model["energy"]["InputSpike_random"][1].get<double>();
+			for (size_t i = 0; i < 3; i++) {
+				energy += double(pop.postsyn[i]) * coefs.input[i].first;
+			}
+			for (size_t i = 0; i < 3; i++) {
+				error += double(pop.postsyn[i]) * coefs.input[i].second;
+			}
+			continue;
 		}
-		else {
-			if (!fixed_neuron_costs) {
-				if (!pop.signals().is_recording(0)) {
-					if (!runtime_normalized) {
-						energy += double(pop.size()) *
-						          energy_model["power"]["idle_neurons"][0]
-						              .get<double>() *
-						          runtime;
-						error += double(pop.size()) *
-						         energy_model["power"]["idle_neurons"][1]
-						             .get<double>() *
-						         runtime;
-						cypress::global_logger().warn(
-						    "EnergyModel",
-						    "Please activate spike recording for all "
-						    "populations!");
-						continue;
-					}
-					else {
-						energy += double(pop.size()) *
-						          energy_model["energy"]["idle_neurons_ms"][0]
-						              .get<double>() *
-						          bioruntime;
-						error += double(pop.size()) *
-						         energy_model["energy"]["idle_neurons_ms"][1]
-						             .get<double>() *
-						         bioruntime;
-						cypress::global_logger().warn(
-						    "EnergyModel",
-						    "Please activate spike recording for all "
-						    "populations!");
-						continue;
-					}
-				}
-				if (!runtime_normalized) {
-					energy += double(pop.size()) *
-					          energy_model["power"]["idle_recorded_neurons"][0]
-					              .get<double>() *
-					          runtime;
-					error += double(pop.size()) *
-					         energy_model["power"]["idle_recorded_neurons"][1]
-					             .get<double>() *
-					         runtime;
-				}
-				else {
-					energy +=
-					    double(pop.size()) *
-					    energy_model["energy"]["idle_recorded_neurons_ms"][0]
-					        .get<double>() *
-					    bioruntime;
-					error +=
-					    double(pop.size()) *
-					    energy_model["energy"]["idle_recorded_neurons_ms"][1]
-					        .get<double>() *
-					    bioruntime;
-				}
+		if (!coefs.fixed_neuron_costs) {
+			if (!pop.recording) {
+				idle_costs(double(pop.size), coefs.idle_neurons,
+				           coefs.idle_neurons_ms);
+				cypress::global_logger().warn(
+				    "EnergyModel",
+				    "Please activate spike recording for all populations!");
+				continue;
 			}
-
-			auto spikes = get_number_of_spikes_pop(pop);
-			energy += double(spikes) *
-			          energy_model["energy"]["spike"][0].get<double>();
-			error += double(spikes) *
-			         energy_model["energy"]["spike"][1].get<double>();
-			auto spikes2 = calc_postsyn_spikes(pop, conns, false);
-			energy +=
-			    double(std::get<0>(spikes2)) *
-			    energy_model["energy"]["Transmission_O2O"][0].get<double>();
-			energy +=
-			    double(std::get<1>(spikes2)) *
-			    energy_model["energy"]["Transmission_S2A"][0].get<double>();
-			energy +=
-			    double(std::get<2>(spikes2)) *
-			    energy_model["energy"]["Transmission_random"][0].get<double>();
-			error +=
-			    double(std::get<0>(spikes2)) *
-			    energy_model["energy"]["Transmission_O2O"][1].get<double>();
-			error +=
-			    double(std::get<1>(spikes2)) *
-			    energy_model["energy"]["Transmission_S2A"][1].get<double>();
-			error +=
-			    double(std::get<2>(spikes2)) *
-			    energy_model["energy"]["Transmission_random"][1].get<double>();
+			idle_costs(double(pop.size), coefs.idle_recorded_neurons,
+			           coefs.idle_recorded_neurons_ms);
 		}
-	}
-
-	if (energy_model["stdp"].get<bool>()) {
-
-		if (!runtime_normalized) {
-			energy += double(calc_number_stdp_synapses(netw)) *
-			          energy_model["power"]["idle_stdp"][0].get<double>();
-			error += double(calc_number_stdp_synapses(netw)) *
-			         energy_model["power"]["idle_stdp"][1].get<double>();
+		energy += double(pop.spikes) * coefs.spike.first;
+		error += double(pop.spikes) * coefs.spike.second;
+		for (size_t i = 0; i < 3; i++) {
+			energy += double(pop.postsyn[i]) * coefs.transmission[i].first;
 		}
-		else {
-			energy += double(calc_number_stdp_synapses(netw)) *
-			          energy_model["energy"]["idle_stdp_ms"][0].get<double>();
-			error += double(calc_number_stdp_synapses(netw)) *
-			         energy_model["energy"]["idle_stdp_ms"][1].get<double>();
+		for (size_t i = 0; i < 3; i++) {
+			error += double(pop.postsyn[i]) * coefs.transmission[i].second;
 		}
-		for (const auto &pop : netw.populations()) {
-			if (pop.signals().is_recording(0)) {
-				auto spikes2 = calc_postsyn_spikes(pop, conns, true);
-				energy += double(std::get<0>(spikes2)) *
-				          energy_model["energy"]["Transmission_STDP"][0]
-				              .get<double>();
-				energy += double(std::get<1>(spikes2)) *
-				          energy_model["energy"]["Transmission_STDP"][0]
-				              .get<double>();
-				energy += double(std::get<2>(spikes2)) *
-				          energy_model["energy"]["Transmission_STDP"][0]
-				              .get<double>();
-				error += double(std::get<0>(spikes2)) *
-				         energy_model["energy"]["Transmission_STDP"][1]
-				             .get<double>();
-				error += double(std::get<1>(spikes2)) *
-				         energy_model["energy"]["Transmission_STDP"][1]
-				             .get<double>();
-				error += double(std::get<2>(spikes2)) *
-				         energy_model["energy"]["Transmission_STDP"][1]
-				             .get<double>();
+	}
+
+	if (coefs.stdp) {
+		auto costs = coefs.runtime_normalized ? coefs.idle_stdp_ms
+		                                      : coefs.idle_stdp;
+		energy += double(activity.stdp_synapses) * costs.first;
+		error += double(activity.stdp_synapses) * costs.second;
+		for (const auto &pop : activity.populations) {
+			if (pop.recording) {
+				for (size_t i = 0; i < 3; i++) {
+					energy += double(pop.postsyn_stdp[i]) *
+					          coefs.transmission_stdp.first;
+				}
+				for (size_t i = 0; i < 3; i++) {
+					error += double(pop.postsyn_stdp[i]) *
+					         coefs.transmission_stdp.second;
+				}
 			}
 		}
 	}
 	return std::pair<double, double>{energy, error};
 }
 
-Json energy_all_backends(const cypress::Network &netw, std::string path)
+Json energy_all_backends(const cypress::Network &netw, std::string path,
+                         size_t threads)
 {
 	glob_t glob_result;
 	glob((path + "/*.json").c_str(), GLOB_TILDE, NULL, &glob_result);
@@ -1179,6 +1272,11 @@ Json energy_all_backends(const cypress::Network &netw, std::string path)
 	}
 	globfree(&glob_result);
 	Json result;
+	if (files.empty()) {
+		return result;
+	}
+	// The network is traversed once for all energy models
+	NetworkActivity activity(netw, threads);
 	for (auto &file : files) {
 		std::ifstream ifs(file);
 		Json config;
@@ -1196,7 +1294,8 @@ Json energy_all_backends(const cypress::Network &netw, std::string path)
 				}
 			}
 
-			auto res = calculate_energy(netw, config, runtime);
+			auto res =
+			    calculate_energy(activity, EnergyCoefficients(config), runtime);
 			if (config.count("name") > 0) {
 				result[config["name"].get<std::string>()] = {
 				    {"val", std::get<0>(res)}, {"err", std::get<1>(res)}};
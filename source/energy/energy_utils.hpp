@@ -20,6 +20,13 @@
 
 #include <cypress/cypress.hpp>
 
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 namespace Energy {
 using namespace cypress;
 
@@ -49,14 +56,73 @@ size_t get_number_of_spikes(Network &netw, bool sources = true);
  */
 size_t get_number_of_neurons(cypress::Network &netw, bool sources = true);
 
+/**
+ * @brief Fan-out of connections which have to be expanded to be counted
+ * (FromList and random connectors): the number of valid synapses of every
+ * source neuron. Every connection is expanded only once, later queries are a
+ * lookup. Entries are keyed by the index of the connection and validated
+ * against its populations and connector. An entry keeps the synapse of its
+ * connector alive, so a connector replaced by Network::update_connection is
+ * detected even if the new one reuses the address of the old one.
+ */
+class FanOutCache {
+public:
+	struct FanOut {
+		std::vector<uint32_t> per_source;  // Valid synapses per source neuron
+		size_t synapses = 0;               // Sum of per_source
+	};
+
+	/**
+	 * @brief Fan-out of a connection, the connection is expanded on the first
+	 * call or if it was replaced since. Thread safe.
+	 *
+	 * @param descr the connection
+	 * @param conn_id index of the connection in the connection list
+	 * @param source_size number of neurons in the source population
+	 */
+	std::shared_ptr<const FanOut> get(
+	    const cypress::ConnectionDescriptor &descr, size_t conn_id,
+	    size_t source_size);
+
+	/**
+	 * @brief Number of cached connections
+	 */
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_cache.size();
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cache.clear();
+	}
+
+private:
+	struct Entry {
+		size_t pid_src, pid_tar;
+		const cypress::Connector *connector;
+		std::shared_ptr<cypress::SynapseBase> synapse;  // Pins the identity
+		std::shared_ptr<const FanOut> fan_out;
+
+		bool matches(const cypress::ConnectionDescriptor &descr) const;
+	};
+
+	mutable std::mutex m_mutex;
+	std::map<size_t, Entry> m_cache;
+};
+
 /**
  * @brief Goes through all the connections and identify learning enabled
  * synapses.
  *
  * @param netw network object
+ * @param cache fan-out of expanded connectors, a temporary cache if nullptr
  * @return number of synapses
  */
-size_t calc_number_stdp_synapses(const cypress::Network &netw);
+size_t calc_number_stdp_synapses(const cypress::Network &netw,
+                                 FanOutCache *cache = nullptr);
 
 /**
  * @brief Goes through all connections and counts the number of synaptic events:
@@ -82,6 +148,82 @@ std::vector<size_t> conn_ids_source(
     const size_t source_id,
     const std::vector<cypress::ConnectionDescriptor> &conns);
 
+/**
+ * @brief Group all connections of a network by their source population
+ *
+ * @param netw the network
+ * @return for every population the indexes of its outgoing connections
+ */
+std::vector<std::vector<size_t>> conn_ids_by_source(
+    const cypress::Network &netw);
+
+/**
+ * @brief The coefficients of an energy model, compiled once from the Json
+ * created by calculate_coefficients. Every coefficient is a pair of value and
+ * error, NaN if the model does not provide it.
+ */
+struct EnergyCoefficients {
+	typedef std::pair<double, double> Coef;
+	Coef idle;                      // power/idle
+	Coef idle_neurons;              // power/idle_neurons
+	Coef idle_recorded_neurons;     // power/idle_recorded_neurons
+	Coef idle_stdp;                 // power/idle_stdp
+	Coef idle_neurons_ms;           // energy/idle_neurons_ms
+	Coef idle_recorded_neurons_ms;  // energy/idle_recorded_neurons_ms
+	Coef idle_stdp_ms;              // energy/idle_stdp_ms
+	Coef spike;                     // energy/spike
+	std::array<Coef, 3> input;  // energy/InputSpike_{O2O, A2A, random}
+	std::array<Coef, 3> transmission;  // energy/Transmission_{O2O, S2A,
+	                                   // random}
+	Coef transmission_stdp;            // energy/Transmission_STDP
+	bool stdp = false;
+	bool runtime_normalized = false;
+	bool fixed_neuron_costs = false;
+	size_t n_neurons_system = 0;  // Only used with fixed_neuron_costs
+
+	EnergyCoefficients() = default;
+
+	/**
+	 * @param energy_model Json object containing coefficients of the energy
+	 * model
+	 */
+	explicit EnergyCoefficients(const Json &energy_model);
+};
+
+/**
+ * @brief All quantities of a simulated network the energy model depends on,
+ * gathered in a single traversal. The summary does not depend on the energy
+ * model, one traversal serves any number of models.
+ */
+struct NetworkActivity {
+	struct Population {
+		size_t size = 0;
+		bool source = false;     // Population of spike sources
+		bool recording = false;  // Spikes have been recorded
+		size_t spikes = 0;
+		std::array<size_t, 3> postsyn = {{0, 0, 0}};  // O2O, A2A, other
+		std::array<size_t, 3> postsyn_stdp = {{0, 0, 0}};  // Only STDP
+	};
+	std::vector<Population> populations;
+	size_t stdp_synapses = 0;
+	double runtime = 0.0;     // Wall-clock runtime in ms
+	double bioruntime = 0.0;  // Simulated duration in ms, 0 if not provided
+	double duration = 0.0;    // netw.duration(), only if bioruntime is 0
+
+	NetworkActivity() = default;
+
+	/**
+	 * @brief Traverse the network after simulation
+	 *
+	 * @param netw The network object after simulation
+	 * @param threads Populations are processed in parallel, 0 uses all cores
+	 * @param cache fan-out of expanded connectors of netw, kept between
+	 * evaluations of the same network. A temporary cache if nullptr.
+	 */
+	explicit NetworkActivity(const cypress::Network &netw, size_t threads = 1,
+	                         FanOutCache *cache = nullptr);
+};
+
 /**
  * @brief Perpare a json for storing measurement results. Init entries to zero.
  *
@@ -110,15 +252,30 @@ std::pair<double, double> calculate_energy(const cypress::Network &netw,
                                            const Json &energy_model,
                                            double runtime = 0.0 );
 
+/**
+ * @brief Approximate the energy expenditure of a summarized network with a
+ * compiled energy model, see calculate_energy above.
+ *
+ * @param activity Summary of the network after simulation
+ * @param coefs Compiled coefficients of the energy model
+ * @param runtime wall-clock runtime of the simulation in ms, def: netw runtime
+ * @return the amount of energy used in Joule + its error estimated
+ */
+std::pair<double, double> calculate_energy(const NetworkActivity &activity,
+                                           const EnergyCoefficients &coefs,
+                                           double runtime = 0.0);
+
 /**
  * @brief Calculates the energy for simulating/emulating the given network on
  * all available target systems. TODO: Calculate runtime of simulators/emulators
  *
  * @param netw Network object containing the simulated network
  * @param path Folder containing energy configs. Defaults to "../config_energy".
+ * @param threads Threads for traversing the network, 0 uses all cores
  * @return Energy calculations
  */
 Json energy_all_backends(const cypress::Network &netw,
-                         std::string path = "../config_energy");
+                         std::string path = "../config_energy",
+                         size_t threads = 1);
 
 }  // namespace Energy
@@ -1,8 +1,22 @@
 #pragma once
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
 
 #include "energy/um25c.hpp"
 #include "util/utilities.hpp"
@@ -13,37 +27,164 @@ namespace Energy {
  * @brief Measure Power usage via nvidia-smi tool. Must be installed on the
  * target system!
  *
+ * The tool is started once in loop mode and its output is parsed in the
+ * background. Every line of the output starting with a number is taken as
+ * power draw in Watt, all other lines (e.g. the csv header) are ignored.
  */
 class nvidiasmi : public MeasureDevice {
 private:
-	const std::string m_call = "nvidia-smi --query-gpu=power.draw --format=csv";
+	pid_t m_pid = -1;
+	FILE *m_pipe = nullptr;
+	std::thread m_reader;
 
-public:
-	nvidiasmi() = default;
-	double read()
+	using sample =
+	    std::pair<double, std::chrono::time_point<std::chrono::steady_clock>>;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<sample> m_samples;  // Power draw in Watt, time of arrival
+	bool m_eof = false;
+
+	// Oldest samples are discarded if nobody reads them
+	static constexpr size_t max_pending = 1024;
+
+	static std::string default_call(size_t interval_ms)
+	{
+		return "nvidia-smi --query-gpu=power.draw "
+		       "--format=csv,noheader,nounits -i 0 -lms " +
+		       std::to_string(interval_ms);
+	}
+
+	void start(const std::string &command)
+	{
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			throw std::system_error(errno, std::system_category());
+		}
+		m_pid = fork();
+		if (m_pid < 0) {
+			int err = errno;
+			close(fds[0]);
+			close(fds[1]);
+			throw std::system_error(err, std::system_category());
+		}
+		if (m_pid == 0) {
+			// Own process group, so the shell and its children can be killed
+			setpgid(0, 0);
+			dup2(fds[1], STDOUT_FILENO);
+			execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+			_exit(127);
+		}
+		setpgid(m_pid, m_pid);
+		close(fds[1]);
+		m_pipe = fdopen(fds[0], "r");
+		if (!m_pipe) {
+			int err = errno;
+			close(fds[0]);
+			stop();
+			throw std::system_error(err, std::system_category());
+		}
+		m_reader = std::thread(&nvidiasmi::read_loop, this);
+	}
+
+	void read_loop()
 	{
-		std::array<char, 128> buffer;
-		std::string result;
-		std::unique_ptr<FILE, decltype(&pclose)> pipe(
-		    popen(m_call.c_str(), "r"), pclose);
-		if (!pipe) {
-			throw std::runtime_error("popen() failed!");
+		std::array<char, 256> buffer;
+		while (fgets(buffer.data(), buffer.size(), m_pipe) != nullptr) {
+			char *end;
+			double val = std::strtod(buffer.data(), &end);
+			if (end == buffer.data()) {
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_samples.size() == max_pending) {
+				m_samples.pop_front();
+			}
+			m_samples.emplace_back(val, std::chrono::steady_clock::now());
+			m_cond.notify_all();
 		}
-		while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-			result += buffer.data();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_eof = true;
+		m_cond.notify_all();
+	}
+
+	void stop()
+	{
+		if (m_pid > 0) {
+			kill(-m_pid, SIGTERM);
+			waitpid(m_pid, nullptr, 0);
+			m_pid = -1;
 		}
-		result = SNAB::Utilities::split(result, '\n')[1];
-		return std::stod(result);
+		if (m_reader.joinable()) {
+			m_reader.join();
+		}
+		if (m_pipe) {
+			fclose(m_pipe);
+			m_pipe = nullptr;
+		}
+	}
+
+	/**
+	 * @brief Waits for the oldest sample not handed out before
+	 */
+	sample next_sample()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() { return !m_samples.empty() || m_eof; });
+		if (m_samples.empty()) {
+			throw std::runtime_error("nvidia-smi stopped sending samples!");
+		}
+		sample res = m_samples.front();
+		m_samples.pop_front();
+		return res;
+	}
+
+public:
+	/**
+	 * @param interval_ms sampling interval of nvidia-smi in milliseconds
+	 */
+	explicit nvidiasmi(size_t interval_ms = 100)
+	{
+		start(default_call(interval_ms));
+	}
+
+	/**
+	 * @brief Read from an arbitrary command printing one power draw in Watt
+	 * per line, e.g. for testing without a GPU
+	 */
+	explicit nvidiasmi(const std::string &command) { start(command); }
+
+	nvidiasmi(const nvidiasmi &) = delete;
+	nvidiasmi &operator=(const nvidiasmi &) = delete;
+
+	~nvidiasmi() { stop(); }
+
+	/**
+	 * @brief Next sample in order of arrival, blocks until one is available
+	 *
+	 * @return power draw in Watt
+	 */
+	double read() { return next_sample().first; }
+
+	/**
+	 * @brief Drops all samples received so far, following calls only return
+	 * samples arriving afterwards
+	 */
+	virtual void discard_pending() override
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_samples.clear();
 	}
 
 	virtual data get_data_sample_timed() override
 	{
-		double val = read() * 1.e3;  // milliwatt
+		auto sample = next_sample();
+		double val = sample.first * 1.e3;  // milliwatt
 		// Assume general 12V supply lane
 		return std::make_tuple<
 		    std::chrono::time_point<std::chrono::steady_clock>, double, double,
-		    double>(std::chrono::steady_clock::now(), 12.0 * 1.e3, val / 12.0,
-		            val*1.);
+		    double>(std::move(sample.second), 12.0 * 1.e3, val / 12.0,
+		            val * 1.);
 	}
 };
 }  // namespace Energy
@@ -49,6 +49,11 @@ public:
 	    data;
 	virtual data get_data_sample_timed() = 0;
 
+	/**
+	 * @brief Forget samples buffered by the device before a new recording
+	 */
+	virtual void discard_pending() {}
+
 	virtual ~MeasureDevice() {}
 };
 
@@ -0,0 +1,46 @@
+/*
+ *  SNABSuite -- Spiking Neural Architecture Benchmark Suite
+ *  Copyright (C) 2020  Christoph Ostrau
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "SNABs/mnist/helper_functions.hpp"
+#include "util/utilities.hpp"
+
+/*
+ * Converts a network file created with
+ * source/SNABs/mnist/python/convert_weights.py (msgpack or json) to the native
+ * binary format, which can be used as "dnn_file" in all MNIST SNABs.
+ */
+int main(int argc, const char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <network_file> <output_file>"
+		          << std::endl;
+		return 1;
+	}
+
+	std::string path(argv[1]);
+	cypress::Json kerasdata = mnist_helper::read_network(
+	    path, SNAB::Utilities::split(path, '.').back() == "msgpack");
+	mnist_helper::write_network_file(kerasdata, argv[2]);
+
+	mnist_helper::NetworkFile file(argv[2]);
+	std::cout << "Wrote " << file.size() << " layers to " << argv[2]
+	          << std::endl;
+}
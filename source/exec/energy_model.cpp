@@ -20,6 +20,7 @@
 #include <cypress/backend/power/power.hpp>
 #include <cypress/cypress.hpp>
 #include <iomanip>
+#include <map>
 
 #include "common/snab_base.hpp"
 #include "energy/energy_recorder.hpp"
@@ -65,20 +66,29 @@ using cypress::Json;
  big for loop in cypress/backend/genn/genn.cpp
  */
 
-std::vector<std::shared_ptr<SNABBase>> snab_vec;
+// SNABs constructed so far, indexed by their name
+std::map<std::string, std::shared_ptr<SNABBase>> snab_map;
+std::string snab_simulator;
+size_t snab_bench_index = 0;
 
 /**
- * @brief Find the given SNAB and return a pointer to it
+ * @brief Find the given SNAB and return a pointer to it. SNABs are constructed
+ * on first use.
  *
  * @param snab_name The SNAB name to find
  * @return std::shared_ptr< SNAB::SNABBase > ptr to SNAB instance
  */
 std::shared_ptr<SNABBase> find_snab(const std::string snab_name)
 {
-	for (auto i : snab_vec) {
-		if (i->valid() && snab_name == i->snab_name()) {
-			return i;
-		}
+	auto it = snab_map.find(snab_name);
+	if (it == snab_map.end()) {
+		it = snab_map
+		         .emplace(snab_name, create_snab(snab_name, snab_simulator,
+		                                         snab_bench_index))
+		         .first;
+	}
+	if (it->second && it->second->valid()) {
+		return it->second;
 	}
 	throw std::runtime_error("Internal Error: Snab " + snab_name + "not found");
 }
@@ -396,7 +406,8 @@ int main(int argc, const char *argv[])
 		cypress::join(setup, Json::parse(Utilities::split(simulator, '=')[1]));
 	}
 
-	snab_vec = snab_registry(simulator, bench_index);
+	snab_simulator = simulator;
+	snab_bench_index = bench_index;
 
 	double threshhold = 0.0;
 	bool block = false;
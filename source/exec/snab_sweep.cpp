@@ -19,6 +19,7 @@
 #include <cypress/cypress.hpp>
 
 #include <glob.h>
+#include <algorithm>
 #include <csignal>
 
 #include "common/parameter_sweep.hpp"
@@ -43,13 +44,29 @@ void backup_wrapper_sig_handler(int i)
 	std::abort();
 }
 
+/**
+ * Prints the command line usage of the program @param name
+ */
+void print_usage(const char *name)
+{
+	std::cout << "Usage: " << name
+	          << " <SIMULATOR> <SWEEP_CONFIG> <bench_index> [threads] "
+	             "[--shard i/N | --merge N] [NMPI]"
+	          << std::endl;
+}
+
+/**
+ * Checks whether @param arg is a non-negative integer
+ */
+bool is_number(const std::string &arg)
+{
+	return !arg.empty() && std::all_of(arg.begin(), arg.end(), ::isdigit);
+}
+
 int main(int argc, const char *argv[])
 {
-	if ((argc < 4 || argc > 6) && !cypress::NMPI::check_args(argc, argv)) {
-		std::cout
-		    << "Usage: " << argv[0]
-		    << " <SIMULATOR> <SWEEP_CONFIG> <bench_index> [threads] [NMPI]"
-		    << std::endl;
+	if ((argc < 4 || argc > 8) && !cypress::NMPI::check_args(argc, argv)) {
+		print_usage(argv[0]);
 		return 1;
 	}
 
@@ -74,8 +91,35 @@ int main(int argc, const char *argv[])
 	size_t bench_index = std::stoi(argv[3]);
 
 	size_t threads = 1;
-	if ((argc > 4) && isdigit(*argv[argc - 1])) {
-		threads = std::stoi(argv[argc - 1]);
+	// Shard of the sweep executed by this process
+	size_t shard = 0, n_shards = 1;
+	// Number of shards to merge, zero if not in merge mode
+	size_t merge = 0;
+	try {
+		for (int i = 4; i < argc; i++) {
+			std::string arg(argv[i]);
+			if (arg == "--shard" && i + 1 < argc) {
+				ParameterSweep::parse_shard(argv[++i], shard, n_shards);
+			}
+			else if (arg == "--merge" && i + 1 < argc &&
+			         is_number(argv[i + 1]) && std::stoul(argv[i + 1]) > 0) {
+				merge = std::stoul(argv[++i]);
+			}
+			else if (is_number(arg)) {
+				threads = std::stoul(arg);
+			}
+			else if (arg != "NMPI" || i != argc - 1) {
+				throw std::invalid_argument("Invalid argument " + arg);
+			}
+		}
+		if (merge > 0 && n_shards > 1) {
+			throw std::invalid_argument("Use either --shard or --merge");
+		}
+	}
+	catch (std::exception &e) {
+		std::cout << e.what() << std::endl;
+		print_usage(argv[0]);
+		return 1;
 	}
 
 	// Open sweep config
@@ -89,7 +133,15 @@ int main(int argc, const char *argv[])
 	// Suppress all logging
 	cypress::global_logger().min_level(cypress::LogSeverity::ERROR, 1);
 
-	ParameterSweep sweep(argv[1], json, bench_index, threads);
+	ParameterSweep sweep(argv[1], json, bench_index, threads, shard, n_shards,
+	                     merge > 0);
+
+	// Merge the partial results of all shard processes
+	if (merge > 0) {
+		sweep.merge_shards(merge);
+		sweep.write_csv();
+		return 0;
+	}
 
 	// Use customized signal handler to backup sweep
 	sweep_pointer = &sweep;
@@ -104,7 +156,12 @@ int main(int argc, const char *argv[])
 		std::cout << "Backup complete!" << std::endl;
 		throw e;
 	}
-	sweep.write_csv();
+	if (n_shards > 1) {
+		sweep.write_shard();
+	}
+	else {
+		sweep.write_csv();
+	}
 
 	return 0;
 }
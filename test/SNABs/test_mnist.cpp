@@ -17,6 +17,7 @@
  */
 
 #include <cypress/cypress.hpp>
+#include <random>
 
 //#include "SNABs/mnist/helper_functions.cpp"
 #include "SNABs/mnist/mnist_mlp.hpp"
@@ -1626,6 +1627,67 @@ TEST(mnist_helper, loadMnistData)
 	EXPECT_ANY_THROW(loadMnistData(100005, "../t10k"));
 }
 
+TEST(mnist_helper, MnistIdx)
+{
+	MnistIdx idx("../t10k");
+	EXPECT_EQ(size_t(10000), idx.size());
+	EXPECT_EQ(size_t(28), idx.rows());
+	EXPECT_EQ(size_t(28), idx.cols());
+
+	auto mnist_data = loadMnistData(10, "../t10k");
+	std::vector<Real> batch(10 * idx.pixels());
+	idx.normalize(0, 10, batch.data());
+	for (size_t i = 0; i < 10; i++) {
+		EXPECT_EQ(std::get<1>(mnist_data)[i], idx.label(i));
+		for (size_t j = 0; j < idx.pixels(); j++) {
+			EXPECT_DOUBLE_EQ(std::get<0>(mnist_data)[i][j],
+			                 batch[i * idx.pixels() + j]);
+			EXPECT_DOUBLE_EQ(Real(idx.image(i)[j]) / 255.0,
+			                 batch[i * idx.pixels() + j]);
+		}
+	}
+
+	EXPECT_EQ(size_t(5), MnistIdx("../t10k", 5).size());
+	EXPECT_ANY_THROW(MnistIdx("../t10k", 10001));
+	EXPECT_ANY_THROW(MnistIdx("asdf"));
+}
+
+TEST(mnist_helper, MnistView)
+{
+	MnistIdx idx("../t10k", 20);
+	auto mnist_data = to_mnist_data(idx);
+	MnistView mapped(idx), converted(mnist_data);
+	EXPECT_EQ(size_t(20), mapped.size());
+	EXPECT_EQ(size_t(20), converted.size());
+	EXPECT_EQ(idx.pixels(), mapped.pixels());
+	EXPECT_EQ(idx.pixels(), converted.pixels());
+	std::vector<Real> a(idx.pixels()), b(idx.pixels());
+	for (size_t i = 0; i < 20; i++) {
+		EXPECT_EQ(mapped.label(i), converted.label(i));
+		mapped.image(i, a.data());
+		converted.image(i, b.data());
+		EXPECT_EQ(a, b);
+	}
+
+	// Encoding from the mapped file equals encoding of converted images
+	std::vector<size_t> indices = {3, 1, 4, 15, 9, 2};
+	auto from_idx =
+	    encode_batch(idx, indices, 1, 4, 100.0, 100.0, 10.0, false, false);
+	auto from_data = encode_batch(mnist_data, indices, 1, 4, 100.0, 100.0,
+	                              10.0, false, false);
+	EXPECT_EQ(std::get<1>(from_data), std::get<1>(from_idx));
+	ASSERT_EQ(idx.pixels(), std::get<0>(from_idx).size());
+	for (size_t px = 0; px < idx.pixels(); px++) {
+		EXPECT_EQ(std::get<0>(from_data).train(px),
+		          std::get<0>(from_idx).train(px));
+	}
+
+	auto scaled = scale_mnist(idx);
+	auto scaled_data = scale_mnist(mnist_data);
+	EXPECT_EQ(std::get<0>(scaled_data), std::get<0>(scaled));
+	EXPECT_EQ(std::get<1>(scaled_data), std::get<1>(scaled));
+}
+
 TEST(mnist_helper, image_to_rate)
 {
 	Real duration = 100.0;
@@ -1633,17 +1695,124 @@ TEST(mnist_helper, image_to_rate)
 	auto mnist = std::get<0>(loadMnistData(500, "../t10k"));
 	auto spiking_mnist =
 	    image_to_rate(mnist, duration, max_freq, mnist.size(), false);
-	EXPECT_EQ(mnist.size(), spiking_mnist.size());
-	EXPECT_EQ(mnist[0].size(), spiking_mnist[0].size());
+	EXPECT_EQ(mnist.size(), spiking_mnist.blocks());
+	EXPECT_EQ(mnist[0].size(), spiking_mnist.block_size());
 	for (size_t image = 0; image < mnist.size(); image++) {
 		for (size_t pixel = 0; pixel < mnist[image].size(); pixel++) {
-			EXPECT_NEAR(Real(spiking_mnist[image][pixel].size()) /
+			EXPECT_NEAR(Real(spiking_mnist.count(image, pixel)) /
 			                (duration * 1.0e-3 * max_freq),
 			            mnist[image][pixel], 1e-2);
 		}
 	}
 }
 
+TEST(mnist_helper, SpikeStore)
+{
+	SpikeStore store(2);
+	store.push_back(std::vector<Real>{1.0, 2.0});
+	store.close_train();
+	store.add_spike(3.0);
+	store.close_train();
+	store.push_back(std::vector<Real>{4.0, 5.0, 6.0});
+	EXPECT_EQ(size_t(4), store.size());
+	EXPECT_EQ(size_t(2), store.blocks());
+	EXPECT_EQ(size_t(6), store.spike_count());
+	EXPECT_EQ(size_t(0), store.count(0, 1));
+	EXPECT_EQ(size_t(1), store.count(1, 0));
+	EXPECT_EQ(std::vector<Real>({4.0, 5.0, 6.0}), store.train(3));
+	EXPECT_FLOAT_EQ(3.0, *store.begin(1, 0));
+	EXPECT_EQ(std::vector<std::vector<Real>>(
+	              {{1.0, 2.0}, {}, {3.0}, {4.0, 5.0, 6.0}}),
+	          store.to_vector());
+}
+
+TEST(mnist_helper, image_to_TTFS)
+{
+	std::vector<std::vector<Real>> images({{0.0, 0.5, 1.0}, {0.25, 0.0, 0.0}});
+	auto spikes = image_to_TTFS(images, 100.0, 2);
+	EXPECT_EQ(size_t(2), spikes.blocks());
+	EXPECT_EQ(size_t(3), spikes.block_size());
+	EXPECT_EQ(size_t(0), spikes.count(0, 0));
+	EXPECT_FLOAT_EQ(50.0, *spikes.begin(0, 1));
+	EXPECT_FLOAT_EQ(0.0, *spikes.begin(0, 2));
+	EXPECT_FLOAT_EQ(75.0, *spikes.begin(1, 0));
+	EXPECT_EQ(size_t(3), spikes.spike_count());
+
+	auto batches = create_batches(
+	    SPIKING_MNIST(spikes, std::vector<uint16_t>{3, 7}), 2, 100.0, 10.0);
+	ASSERT_EQ(size_t(1), batches.size());
+	EXPECT_EQ(std::vector<uint16_t>({3, 7}), std::get<1>(batches[0]));
+	EXPECT_EQ(std::vector<Real>({185.0}), std::get<0>(batches[0]).train(0));
+	EXPECT_EQ(std::vector<Real>({50.0}), std::get<0>(batches[0]).train(1));
+}
+
+TEST(mnist_helper, SpikeBatchStream)
+{
+	MNIST_DATA data;
+	for (size_t i = 0; i < 5; i++) {
+		std::get<0>(data).push_back({0.0, Real(i) * 0.2, 1.0});
+		std::get<1>(data).push_back(uint16_t(i));
+	}
+	SpikeBatchStream stream(data, 5, 2, 100.0, 10.0, 10.0, false, true, false,
+	                        0, 1);
+	EXPECT_EQ(size_t(3), stream.batches());
+
+	auto spikes = image_to_TTFS(std::get<0>(data), 100.0, 5);
+	auto expected = create_batches(
+	    SPIKING_MNIST(spikes, std::get<1>(data)), 2, 100.0, 10.0);
+	SPIKING_MNIST batch;
+	size_t count = 0;
+	while (stream.next(batch)) {
+		ASSERT_LT(count, expected.size());
+		EXPECT_EQ(std::get<1>(expected[count]), std::get<1>(batch));
+		for (size_t px = 0; px < 3; px++) {
+			EXPECT_EQ(std::get<0>(expected[count]).train(px),
+			          std::get<0>(batch).train(px));
+		}
+		count++;
+	}
+	EXPECT_EQ(size_t(3), count);
+	EXPECT_FALSE(stream.next(batch));
+}
+
+TEST(mnist_helper, SpikeBatchStream_poisson_seed)
+{
+	MNIST_DATA data;
+	for (size_t i = 0; i < 6; i++) {
+		std::get<0>(data).push_back({0.0, Real(i) * 0.2, 1.0});
+		std::get<1>(data).push_back(uint16_t(i));
+	}
+	// Spike trains of every image, found by its label
+	auto trains = [&data](unsigned seed, unsigned poisson_seed) {
+		SpikeBatchStream stream(data, 6, 1, 1000.0, 50.0, 10.0, true, false,
+		                        true, seed, 2, poisson_seed);
+		std::vector<std::vector<std::vector<Real>>> res(6);
+		SPIKING_MNIST batch;
+		while (stream.next(batch)) {
+			for (size_t px = 0; px < 3; px++) {
+				res[std::get<1>(batch)[0]].push_back(
+				    std::get<0>(batch).train(px));
+			}
+		}
+		return res;
+	};
+	// Different order of images, same spike trains (e.g. in every epoch)
+	auto a = trains(1, 42), b = trains(2, 42);
+	EXPECT_EQ(a, b);
+	EXPECT_NE(a, trains(1, 43));
+	for (size_t i = 0; i < 6; i++) {
+		ASSERT_EQ(size_t(3), a[i].size());
+		EXPECT_TRUE(a[i][0].empty());
+		for (auto spike : a[i][2]) {
+			EXPECT_LE(0.0, spike);
+			EXPECT_GT(1000.0, spike);
+		}
+	}
+	// 50 Hz over one second
+	EXPECT_LT(size_t(20), a[5][2].size());
+	EXPECT_GT(size_t(80), a[5][2].size());
+}
+
 TEST(mnist_helper, create_batch)
 {
 	Real duration = 100.0;
@@ -1659,7 +1828,7 @@ TEST(mnist_helper, create_batch)
 		auto image = std::get<0>(mnist_data)[i];
 		for (size_t pixel = 0; pixel < image.size(); pixel++) {
 			auto sp_pixel = cypress::SpikingUtils::calc_num_spikes(
-			    std::get<0>(spiking_batch[0])[pixel],
+			    std::get<0>(spiking_batch[0]).train(pixel),
 			    Real(i) * (duration + 10.0), Real(i + 1) * (duration + 10.0));
 
 			EXPECT_NEAR(Real(sp_pixel) / (duration * 1.0e-3 * max_freq),
@@ -1668,6 +1837,109 @@ TEST(mnist_helper, create_batch)
 	}
 }
 
+TEST(mnist_helper, ConnectionCache)
+{
+	ConnectionCache cache;
+	size_t calls = 0;
+	auto generate = [&calls]() {
+		calls++;
+		return ConnectionCache::Tables{
+		    {LocalConnection(0, 1, 0.5, 1.0), LocalConnection(1, 0, 0.5, 1.0)}};
+	};
+	auto a = cache.get(0, 1.0, generate);
+	auto b = cache.get(0, 1.0, generate);
+	EXPECT_EQ(a.get(), b.get());
+	EXPECT_EQ(size_t(1), calls);
+	auto c = cache.get(0, 2.0, generate);
+	auto d = cache.get(1, 1.0, generate);
+	EXPECT_NE(a.get(), c.get());
+	EXPECT_NE(a.get(), d.get());
+	EXPECT_EQ(size_t(3), calls);
+	EXPECT_EQ(size_t(1), cache.hits());
+	EXPECT_EQ(size_t(3), cache.misses());
+	EXPECT_EQ(size_t(6), cache.connections());
+
+	cache.clear();
+	EXPECT_EQ(size_t(0), cache.connections());
+	// Handed out tables stay valid
+	EXPECT_EQ(size_t(2), (*a)[0].size());
+}
+
+TEST(mnist_helper, prune_weights_to_conn)
+{
+	Matrix<Real> mat(2, 3, 0.0);
+	mat(0, 0) = 0.5;
+	mat(0, 2) = -0.01;
+	mat(1, 1) = -0.3;
+	size_t pruned = 42;
+	auto conns = dense_weights_to_conn(mat, 2.0, 1.0, -1.0, &pruned);
+	EXPECT_EQ(size_t(6), conns.size());
+	EXPECT_EQ(size_t(0), pruned);
+
+	conns = dense_weights_to_conn(mat, 2.0, 1.0, 0.0, &pruned);
+	ASSERT_EQ(size_t(3), conns.size());
+	EXPECT_EQ(size_t(3), pruned);
+	conns = dense_weights_to_conn(mat, 2.0, 1.0, 0.1, &pruned);
+	ASSERT_EQ(size_t(2), conns.size());
+	EXPECT_EQ(size_t(4), pruned);
+	EXPECT_EQ(size_t(0), conns[0].src);
+	EXPECT_EQ(size_t(0), conns[0].tar);
+	EXPECT_DOUBLE_EQ(1.0, conns[0].SynapseParameters[0]);
+	EXPECT_EQ(size_t(1), conns[1].src);
+	EXPECT_EQ(size_t(1), conns[1].tar);
+	EXPECT_DOUBLE_EQ(-0.6, conns[1].SynapseParameters[0]);
+	EXPECT_EQ(size_t(2), conns_from_mat(mat, 1.0, 0.0, 0.1).size());
+
+	CONVOLUTION_FILTER filter(
+	    2, std::vector<std::vector<std::vector<Real>>>(
+	           2, std::vector<std::vector<Real>>(1, {0.5, 0.0})));
+	filter[0][0][0][1] = 0.01;
+	CONVOLUTION_LAYER layer = {filter, {3, 3, 1}, {2, 2, 2}, 1, 0};
+	conns = conv_weights_to_conn(layer, 1.0, 1.0, -1.0, &pruned);
+	EXPECT_EQ(size_t(32), conns.size());
+	EXPECT_EQ(size_t(0), pruned);
+	conns = conv_weights_to_conn(layer, 1.0, 1.0, 0.05, &pruned);
+	EXPECT_EQ(size_t(16), conns.size());
+	EXPECT_EQ(size_t(16), pruned);
+	for (const auto &conn : conns) {
+		EXPECT_EQ(size_t(0), conn.tar % 2);
+	}
+}
+
+TEST(mnist_helper, ConnectionUpdater)
+{
+	std::vector<Matrix<Real>> weights{Matrix<Real>(2, 3, 0.5),
+	                                  Matrix<Real>(3, 2, 0.25)};
+	cypress::Network netw;
+	auto pop_a = netw.create_population<SpikeSourceArray>(
+	    2, SpikeSourceArrayParameters(), SpikeSourceArraySignals(), "a");
+	auto pop_b = netw.create_population<IfCondExp>(3, IfCondExpParameters(),
+	                                               IfCondExpSignals(), "b");
+	auto pop_c = netw.create_population<IfCondExp>(2, IfCondExpParameters(),
+	                                               IfCondExpSignals(), "c");
+	netw.add_connection(
+	    pop_a, pop_b,
+	    Connector::from_list(dense_weights_to_conn(weights[0], 1.0, 1.0)),
+	    "dense_0");
+	netw.add_connection(
+	    pop_b, pop_c,
+	    Connector::from_list(dense_weights_to_conn(weights[1], 1.0, 1.0)),
+	    "dense_1");
+
+	ConnectionUpdater updater;
+	updater.reset(weights);
+	EXPECT_EQ(size_t(0), updater.update(weights, netw));
+	weights[1](2, 1) = 0.75;
+	EXPECT_EQ(size_t(1), updater.update(weights, netw));
+	EXPECT_EQ(size_t(0), updater.update(weights, netw));
+	weights[0](0, 0) = 0.0;
+	weights[1](0, 0) = 0.0;
+	EXPECT_EQ(size_t(2), updater.update(weights, netw));
+
+	ConnectionUpdater fresh;
+	EXPECT_EQ(size_t(2), fresh.update(weights, netw));
+}
+
 TEST(mnist_helper, spikes_to_labels)
 {
 	std::vector<std::vector<Real>> spikes(
@@ -1692,6 +1964,182 @@ TEST(mnist_helper, spikes_to_labels)
 	EXPECT_EQ(vec[3], std::numeric_limits<uint16_t>::max());
 }
 
+TEST(mnist_helper, SpikeBins)
+{
+	std::vector<std::vector<Real>> spikes(
+	    {{0, 1, 2, 3, 4, 5, 6, 7, 8, 9},
+	     {1, 2, 3, 8, 9, 10, 11, 12, 13, 14, 15, 16},
+	     {3, 4, 5, 8, 10, 13, 15, 18, 19, 20, 21, 22, 23}});
+	SpikeBins bins(3, 5, 5, 4);
+	for (const auto &train : spikes) {
+		bins.add_train(train);
+	}
+	EXPECT_ANY_THROW(bins.add_train({}));
+	EXPECT_EQ(std::vector<uint16_t>(
+	              {0, 1, 2, std::numeric_limits<uint16_t>::max()}),
+	          bins.labels());
+	EXPECT_EQ(8, bins.count(0, 0));
+	EXPECT_EQ(9, bins.count(1, 1));
+	EXPECT_EQ(6, bins.count(2, 2));
+	auto rates = bins.rates(2.0);
+	EXPECT_DOUBLE_EQ(4.0, rates[0][0]);
+	EXPECT_DOUBLE_EQ(1.5, rates[0][1]);
+	EXPECT_DOUBLE_EQ(0.0, rates[3][2]);
+
+	SpikeBins ttfs(3, 5, 5, 3, true);
+	for (const auto &train : spikes) {
+		ttfs.add_train(train);
+	}
+	EXPECT_DOUBLE_EQ(0.0, ttfs.first_spike(0, 0));
+	EXPECT_DOUBLE_EQ(3.0, ttfs.first_spike(0, 2));
+	EXPECT_DOUBLE_EQ(1.0, ttfs.first_spike(0, 1));
+	EXPECT_DOUBLE_EQ(0.0, ttfs.first_spike(1, 1));
+	EXPECT_DOUBLE_EQ(std::numeric_limits<Real>::max(),
+	                 ttfs.first_spike(2, 0));
+	EXPECT_EQ(std::vector<uint16_t>(
+	              {0, std::numeric_limits<uint16_t>::max(), 2}),
+	          ttfs.labels());
+	auto ttfs_rates = ttfs.ttfs_rates();
+	EXPECT_DOUBLE_EQ(1.0, ttfs_rates[0][0]);
+	EXPECT_DOUBLE_EQ(0.4, ttfs_rates[0][2]);
+	EXPECT_DOUBLE_EQ(0.8, ttfs_rates[0][1]);
+	EXPECT_DOUBLE_EQ(0.0, ttfs_rates[2][0]);
+}
+
+TEST(mnist_helper, StreamingRank)
+{
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<Real> dist(-1.0, 1.0);
+	std::vector<Real> values(1000);
+	for (auto &v : values) {
+		v = dist(rng);
+	}
+	for (size_t rank : {size_t(0), size_t(10), size_t(500), size_t(990),
+	                    size_t(999), size_t(5000)}) {
+		StreamingRank sr(values.size(), rank);
+		for (auto v : values) {
+			sr.push(v);
+		}
+		auto sorted = values;
+		std::sort(sorted.begin(), sorted.end());
+		EXPECT_EQ(sorted[std::min(rank, values.size() - 1)], sr.value());
+	}
+	EXPECT_ANY_THROW(StreamingRank(0, 0));
+}
+
+TEST(mnist_helper, scale_factor_cache)
+{
+	std::string file = "scale_cache_test.json";
+	{
+		std::ofstream out(file);
+		out << "network";
+	}
+	std::string hash = file_hash(file);
+	EXPECT_EQ(size_t(16), hash.size());
+	EXPECT_EQ(hash, file_hash(file));
+	EXPECT_ANY_THROW(file_hash("asdf"));
+
+	std::string cache = file + ".scales.json";
+	std::vector<Real> factors;
+	EXPECT_FALSE(load_scale_factors(cache, hash, "p99", factors));
+	store_scale_factors(cache, hash, "p99", {1.0, 2.5, 0.5});
+	store_scale_factors(cache, hash, "p100", {1.0, 3.0, 1.0});
+	EXPECT_TRUE(load_scale_factors(cache, hash, "p99", factors));
+	EXPECT_EQ(std::vector<Real>({1.0, 2.5, 0.5}), factors);
+	EXPECT_TRUE(load_scale_factors(cache, hash, "p100", factors));
+	EXPECT_EQ(std::vector<Real>({1.0, 3.0, 1.0}), factors);
+	EXPECT_FALSE(load_scale_factors(cache, hash, "p98", factors));
+
+	// A changed network invalidates all entries
+	{
+		std::ofstream out(file);
+		out << "other network";
+	}
+	std::string hash2 = file_hash(file);
+	EXPECT_NE(hash, hash2);
+	EXPECT_FALSE(load_scale_factors(cache, hash2, "p99", factors));
+	store_scale_factors(cache, hash2, "p99", {1.0});
+	EXPECT_FALSE(load_scale_factors(cache, hash, "p100", factors));
+	EXPECT_FALSE(load_scale_factors(cache, hash2, "p100", factors));
+	EXPECT_TRUE(load_scale_factors(cache, hash2, "p99", factors));
+	EXPECT_EQ(std::vector<Real>({1.0}), factors);
+	std::remove(file.c_str());
+	std::remove(cache.c_str());
+}
+
+TEST(mnist_helper, NetworkFile)
+{
+	Json json;
+	json["netw"] = Json::array();
+	Json conv;
+	conv["class_name"] = "Conv2D";
+	conv["weights"] = {{{{1.0, 2.0}}, {{3.0, 4.0}}}, {{{5.0, 6.0}}, {{7.0, 8.0}}}};
+	conv["stride"] = 1;
+	conv["padding"] = "valid";
+	conv["input_shape_x"] = 5;
+	conv["input_shape_y"] = 5;
+	conv["input_shape_z"] = 1;
+	json["netw"].push_back(conv);
+	Json pool;
+	pool["class_name"] = "MaxPooling2D";
+	pool["size"] = {2, 2};
+	pool["stride"] = 2;
+	json["netw"].push_back(pool);
+	Json dense;
+	dense["class_name"] = "Dense";
+	dense["weights"] = {{0.5, -0.5, 1.5}, {2.5, -2.5, 3.5}};
+	json["netw"].push_back(dense);
+
+	std::string file = "network_file_test.bin";
+	write_network_file(json, file);
+	EXPECT_TRUE(NetworkFile::is_network_file(file));
+	{
+		NetworkFile netw(file);
+		ASSERT_EQ(size_t(3), netw.size());
+
+		EXPECT_EQ(uint32_t(LAYER_TYPE::Conv), netw.layer(0).type);
+		EXPECT_EQ(uint32_t(0), netw.layer(0).padding);
+		EXPECT_EQ(uint64_t(1), netw.layer(0).stride);
+		EXPECT_EQ(uint64_t(5), netw.layer(0).input_shape[0]);
+		EXPECT_EQ(uint64_t(2), netw.layer(0).shape[3]);
+		EXPECT_EQ(uint64_t(8), netw.layer(0).count);
+		for (size_t i = 0; i < 8; i++) {
+			EXPECT_EQ(Real(i + 1), netw.weights(0)[i]);
+		}
+
+		EXPECT_EQ(uint32_t(LAYER_TYPE::Pooling), netw.layer(1).type);
+		EXPECT_EQ(uint64_t(2), netw.layer(1).shape[0]);
+		EXPECT_EQ(uint64_t(2), netw.layer(1).stride);
+		EXPECT_EQ(uint64_t(0), netw.layer(1).count);
+
+		EXPECT_EQ(uint32_t(LAYER_TYPE::Dense), netw.layer(2).type);
+		EXPECT_EQ(uint64_t(2), netw.layer(2).shape[0]);
+		EXPECT_EQ(uint64_t(3), netw.layer(2).shape[1]);
+		std::vector<Real> weights(netw.weights(2), netw.weights(2) + 6);
+		EXPECT_EQ(std::vector<Real>({0.5, -0.5, 1.5, 2.5, -2.5, 3.5}),
+		          weights);
+	}
+
+	// Truncated files are rejected
+	{
+		std::ifstream in(file, std::ios::binary);
+		std::string content((std::istreambuf_iterator<char>(in)),
+		                    std::istreambuf_iterator<char>());
+		std::ofstream out(file, std::ios::binary);
+		out << content.substr(0, content.size() - 8);
+	}
+	EXPECT_ANY_THROW(NetworkFile netw(file));
+	std::remove(file.c_str());
+
+	{
+		std::ofstream out(file);
+		out << "{}";
+	}
+	EXPECT_FALSE(NetworkFile::is_network_file(file));
+	EXPECT_ANY_THROW(NetworkFile netw(file));
+	std::remove(file.c_str());
+}
+
 TEST(mnist_helper, compare_labels)
 {
 	std::vector<uint16_t> label1{1, 3, 5, 7, 9, 11, 13};
@@ -1809,6 +2257,84 @@ TEST(MLP, ReLU_dev)
 	EXPECT_FLOAT_EQ(test[2], 1.0);
 }
 
+TEST(MLP, inplace_policies)
+{
+	std::vector<Real> vec({-0.3, 0.8, 0.0, 1.5});
+	std::vector<Real> span = vec;
+	MNIST::Tanh::function(span.data(), span.size());
+	EXPECT_EQ(MNIST::Tanh::function(vec), span);
+	span = vec;
+	MNIST::Sigmoid::derivative(span.data(), span.size());
+	EXPECT_EQ(MNIST::Sigmoid::derivative(vec), span);
+	EXPECT_DOUBLE_EQ(0.0, MNIST::ReLU::function(-0.3));
+	EXPECT_DOUBLE_EQ(1.0, MNIST::ReLU::derivative(0.0));
+
+	std::vector<Real> error(4, 42.0);
+	MNIST::MSE::calc_error(1, vec.data(), error.data(), error.size());
+	EXPECT_DOUBLE_EQ(-0.3, error[0]);
+	EXPECT_DOUBLE_EQ(0.8 - 1.0, error[1]);
+	EXPECT_DOUBLE_EQ(0.0, error[2]);
+	EXPECT_DOUBLE_EQ(1.5, error[3]);
+	MNIST::CatHinge::calc_error(1, vec.data(), error.data(), error.size());
+	EXPECT_EQ(std::vector<Real>({0.0, -1.0, 0.0, 1.0}), error);
+	EXPECT_EQ(MNIST::CatHinge::calc_error(1, vec), error);
+}
+
+TEST(MLP, conv_forward)
+{
+	// 3x3 image with 1 channel, 2x2 kernel with 2 filters
+	mnist_helper::CONVOLUTION_FILTER filter(
+	    2, std::vector<std::vector<std::vector<Real>>>(
+	           2, std::vector<std::vector<Real>>(1, std::vector<Real>(2, 0.0))));
+	filter[0][0][0][0] = 1.0;
+	filter[1][1][0][0] = 1.0;
+	filter[0][1][0][1] = 2.0;
+	mnist_helper::CONVOLUTION_LAYER layer = {filter, {3, 3, 1}, {2, 2, 2}, 1,
+	                                         0};
+	MNIST::EMatrix input(1, 9);
+	input << 1, 2, 3, 4, 5, 6, 7, 8, 9;
+	auto output = MNIST::MLP<>::conv_forward(input, layer);
+	ASSERT_EQ(1, output.rows());
+	ASSERT_EQ(8, output.cols());
+	// NHWC: (x * 2 + y) * 2 + filter
+	EXPECT_FLOAT_EQ(6.0, output(0, 0));
+	EXPECT_FLOAT_EQ(4.0, output(0, 1));
+	EXPECT_FLOAT_EQ(8.0, output(0, 2));
+	EXPECT_FLOAT_EQ(6.0, output(0, 3));
+	EXPECT_FLOAT_EQ(12.0, output(0, 4));
+	EXPECT_FLOAT_EQ(10.0, output(0, 5));
+	EXPECT_FLOAT_EQ(14.0, output(0, 6));
+	EXPECT_FLOAT_EQ(12.0, output(0, 7));
+}
+
+TEST(MLP, pool)
+{
+	// 4x4 image with 2 channels, the second channel is the negative
+	mnist_helper::POOLING_LAYER layer = {{4, 4, 2}, {2, 2, 2}, {2, 2}, 2};
+	MNIST::EMatrix input(1, 32);
+	for (size_t i = 0; i < 16; i++) {
+		input(0, 2 * i) = Real(i);
+		input(0, 2 * i + 1) = -Real(i);
+	}
+	auto output = MNIST::MLP<>::pool_forward(input, layer);
+	ASSERT_EQ(8, output.cols());
+	EXPECT_FLOAT_EQ(5.0, output(0, 0));
+	EXPECT_FLOAT_EQ(0.0, output(0, 1));
+	EXPECT_FLOAT_EQ(7.0, output(0, 2));
+	EXPECT_FLOAT_EQ(-2.0, output(0, 3));
+	EXPECT_FLOAT_EQ(13.0, output(0, 4));
+	EXPECT_FLOAT_EQ(-8.0, output(0, 5));
+	EXPECT_FLOAT_EQ(15.0, output(0, 6));
+	EXPECT_FLOAT_EQ(-10.0, output(0, 7));
+
+	MNIST::EMatrix error = MNIST::EMatrix::Ones(1, 8);
+	auto input_error = MNIST::MLP<>::pool_backward(input, error, layer);
+	EXPECT_FLOAT_EQ(1.0, input_error(0, 2 * 5));
+	EXPECT_FLOAT_EQ(0.0, input_error(0, 2 * 4));
+	EXPECT_FLOAT_EQ(1.0, input_error(0, 1));
+	EXPECT_FLOAT_EQ(8.0, input_error.sum());
+}
+
 TEST(MLP, train)
 {
 	MNIST::MLP<MNIST::CatHinge, MNIST::ReLU, MNIST::PositiveWeights> mlp(
@@ -1823,4 +2349,347 @@ TEST(MLP, train)
 	EXPECT_TRUE(mlp2.forward_path_test() > 0.5);
 }
 
+TEST(MLP, train_threads)
+{
+	MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp({81, 100, 10}, 1, 128, 0.01);
+	mlp.scale_down_images();
+	// Copies start with the same random weights
+	auto mlp_repeat = mlp, mlp_single = mlp;
+	mlp.set_threads(4);
+	EXPECT_EQ(size_t(4), mlp.threads());
+	mlp.train(1234);
+	Real accuracy = mlp.forward_path_test();
+	EXPECT_TRUE(accuracy > 0.5);
+
+	// Same seed and number of threads gives identical weights
+	mlp_repeat.set_threads(4);
+	mlp_repeat.train(1234);
+	const auto &weights = mlp.get_weights();
+	const auto &weights_repeat = mlp_repeat.get_weights();
+	ASSERT_EQ(weights.size(), weights_repeat.size());
+	for (size_t i = 0; i < weights.size(); i++) {
+		ASSERT_EQ(weights[i].size(), weights_repeat[i].size());
+		for (size_t j = 0; j < weights[i].size(); j++) {
+			ASSERT_EQ(weights[i][j], weights_repeat[i][j]);
+		}
+	}
+
+	// A single thread only differs in the order of summation
+	mlp_single.set_threads(1);
+	mlp_single.train(1234);
+	const auto &weights_single = mlp_single.get_weights();
+	ASSERT_EQ(weights.size(), weights_single.size());
+	for (size_t i = 0; i < weights.size(); i++) {
+		for (size_t j = 0; j < weights[i].size(); j++) {
+			ASSERT_NEAR(weights[i][j], weights_single[i][j], 1e-6);
+		}
+	}
+	EXPECT_NEAR(accuracy, mlp_single.forward_path_test(), 1e-3);
+
+	mlp.set_threads(0);
+	EXPECT_TRUE(mlp.threads() >= 1);
+}
+
+TEST(MLP, mapped_data)
+{
+	MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp({784, 10, 10}, 1, 128, 0.01);
+	// Training and inference work on the mapped files, nothing is converted
+	auto train = mlp.mnist_train_view();
+	EXPECT_EQ(size_t(60000), train.size());
+	EXPECT_EQ(size_t(10000), mlp.mnist_test_view().size());
+	Real accuracy = mlp.forward_path_test();
+
+	const auto &test_set = mlp.mnist_test_set();
+	EXPECT_EQ(size_t(10000), std::get<0>(test_set).size());
+	EXPECT_EQ(accuracy, mlp.forward_path_test());
+	std::vector<Real> image(train.pixels());
+	train.image(7, image.data());
+	EXPECT_EQ(mlp.mnist_train_set().first[7], image);
+}
+
+TEST(MLP, quantized)
+{
+	MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp({81, 100, 10}, 1, 128, 0.01);
+	mlp.scale_down_images();
+	mlp.train(1234);
+	Real acc = mlp.forward_path_test();
+	EXPECT_NEAR(acc, mlp.forward_path_test_quantized(16), 0.01);
+	EXPECT_NEAR(acc, mlp.forward_path_test_quantized(8), 0.05);
+	EXPECT_NEAR(acc, mlp.forward_path_test_quantized(8, 99), 0.05);
+	EXPECT_THROW(mlp.forward_path_test_quantized(4), std::invalid_argument);
+}
+
+TEST(MLP, quantized_conv)
+{
+	MNIST::RowMatrix<int8_t> a(2, 3), b(3, 2);
+	a << 1, 0, -3, 127, -127, 2;
+	b << 5, -6, 7, 8, -9, 10;
+	MNIST::EMatrix res(2, 2);
+	MNIST::MLP<>::int_product<int32_t>(a, b, res.data());
+	EXPECT_EQ((a.cast<Real>() * b.cast<Real>()).eval(), res);
+
+	// 9x9 images -> 7x7x4 -> 3x3x4 -> 10
+	Json json;
+	json["netw"] = Json::array();
+	Json conv;
+	conv["class_name"] = "Conv2D";
+	conv["weights"] = std::vector<std::vector<std::vector<std::vector<Real>>>>(
+	    3, std::vector<std::vector<std::vector<Real>>>(
+	           3, std::vector<std::vector<Real>>(1, std::vector<Real>(4))));
+	conv["stride"] = 1;
+	conv["padding"] = "valid";
+	conv["input_shape_x"] = 9;
+	conv["input_shape_y"] = 9;
+	conv["input_shape_z"] = 1;
+	json["netw"].push_back(conv);
+	Json pool;
+	pool["class_name"] = "MaxPooling2D";
+	pool["size"] = {2, 2};
+	pool["stride"] = 2;
+	json["netw"].push_back(pool);
+	Json dense;
+	dense["class_name"] = "Dense";
+	dense["weights"] =
+	    std::vector<std::vector<Real>>(36, std::vector<Real>(10, 0.0));
+	json["netw"].push_back(dense);
+
+	MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp(json, 1, 128, 0.01, true);
+	mlp.scale_down_images();
+	mlp.train(1234);
+	Real acc = mlp.forward_path_test();
+	EXPECT_NEAR(acc, mlp.forward_path_test_quantized(16), 0.01);
+	EXPECT_NEAR(acc, mlp.forward_path_test_quantized(8), 0.05);
+}
+
+TEST(MLP, backward_path_2)
+{
+	MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp({6, 5, 4}, 1, 8, 0.05);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<Real> dist(0.0, 1.0);
+	std::vector<std::vector<std::vector<Real>>> activations(3);
+	size_t sizes[] = {6, 5, 4};
+	for (size_t layer = 0; layer < 3; layer++) {
+		for (size_t sample = 0; sample < 8; sample++) {
+			std::vector<Real> act(sizes[layer]);
+			for (auto &a : act) {
+				a = dist(rng) > 0.3 ? dist(rng) : 0.0;
+			}
+			activations[layer].push_back(act);
+		}
+	}
+	std::vector<uint16_t> labels({0, 1, 2, 3, 0, 1, 2, 3});
+
+	// Reference: per sample updates with the weights of the batch start
+	auto orig = mlp.get_weights();
+	auto expected = orig;
+	for (size_t sample = 0; sample < 8; sample++) {
+		auto error = MLP::vec_X_vec_comp(
+		    MNIST::MSE::calc_error(labels[sample], activations[2][sample]),
+		    MNIST::ReLU::derivative(activations[2][sample]));
+		MLP::update_mat(expected[1], error, activations[1][sample], 8, 0.05);
+		error = MLP::vec_X_vec_comp(
+		    MLP::mat_X_vec(orig[1], error),
+		    MNIST::ReLU::derivative(activations[1][sample]));
+		MLP::update_mat(expected[0], error, activations[0][sample], 8, 0.05);
+	}
+
+	mlp.backward_path_2(labels, activations);
+	for (size_t layer = 0; layer < 2; layer++) {
+		for (size_t i = 0; i < expected[layer].size(); i++) {
+			EXPECT_NEAR(expected[layer][i], mlp.get_weights()[layer][i],
+			            1e-12);
+		}
+	}
+
+	// Last layer only: the hidden layer is not required
+	auto hidden = mlp.get_weights()[0];
+	activations[0].clear();
+	mlp.backward_path_2(labels, activations, true);
+	for (size_t i = 0; i < hidden.size(); i++) {
+		EXPECT_DOUBLE_EQ(hidden[i], mlp.get_weights()[0][i]);
+	}
+}
+
+TEST(MLP, backward_path)
+{
+	for (size_t threads : {1, 2}) {
+		SCOPED_TRACE("threads " + std::to_string(threads));
+		MNIST::MLP<MNIST::MSE, MNIST::ReLU> mlp({81, 12, 10}, 1, 32, 0.05);
+		mlp.scale_down_images();
+		mlp.set_threads(threads);
+		std::vector<size_t> indices(100);
+		std::mt19937 rng(7);
+		for (auto &i : indices) {
+			i = rng() % mlp.mnist_train_view().size();
+		}
+		const size_t start = 40;
+		auto activations = mlp.forward_path(indices, start);
+
+		// Reference: per sample updates with the weights of the batch start
+		auto orig = mlp.get_weights();
+		auto expected = orig;
+		for (size_t sample = 0; sample < 32; sample++) {
+			const auto &act = activations[sample];
+			uint16_t label =
+			    mlp.mnist_train_view().label(indices[start + sample]);
+			auto error = MLP::vec_X_vec_comp(
+			    MNIST::MSE::calc_error(label, act[2]),
+			    MNIST::ReLU::derivative(act[2]));
+			MLP::update_mat(expected[1], error, act[1], 32, 0.05);
+			error = MLP::vec_X_vec_comp(MLP::mat_X_vec(orig[1], error),
+			                            MNIST::ReLU::derivative(act[1]));
+			MLP::update_mat(expected[0], error, act[0], 32, 0.05);
+		}
+
+		mlp.backward_path(indices, start, activations);
+		for (size_t layer = 0; layer < 2; layer++) {
+			for (size_t i = 0; i < expected[layer].size(); i++) {
+				EXPECT_NEAR(expected[layer][i], mlp.get_weights()[layer][i],
+				            1e-12);
+			}
+		}
+	}
+}
+
+namespace {
+/**
+ * @brief Exponential activation function. Its derivative equals the
+ * activation, at which the MLP evaluates derivatives, so finite differences
+ * have to match the backward path exactly.
+ */
+class ExpActivation : public MNIST::ElementwiseActivation<ExpActivation> {
+public:
+	using MNIST::ElementwiseActivation<ExpActivation>::function;
+	using MNIST::ElementwiseActivation<ExpActivation>::derivative;
+	static inline Real function(Real x) { return std::exp(x); }
+	static inline Real derivative(Real x) { return x; }
+};
+
+/**
+ * @brief Gives tests write access to the weights of an MLP
+ */
+template <typename Activation>
+class WeightAccessMLP : public MNIST::MLP<MNIST::MSE, Activation> {
+public:
+	using MNIST::MLP<MNIST::MSE, Activation>::MLP;
+	std::vector<Matrix<Real>> &layers() { return this->m_layers; }
+	std::vector<CONVOLUTION_LAYER> &filters() { return this->m_filters; }
+};
+
+/**
+ * @brief Json description of a convolution layer with random weights
+ */
+Json random_conv(std::mt19937 &rng, std::vector<size_t> shape,
+                 std::string padding)
+{
+	std::uniform_real_distribution<Real> dist(-0.2, 0.2);
+	std::vector<std::vector<std::vector<std::vector<Real>>>> weights(
+	    shape[0], std::vector<std::vector<std::vector<Real>>>(
+	                  shape[1], std::vector<std::vector<Real>>(
+	                                shape[2], std::vector<Real>(shape[3]))));
+	for (auto &x : weights) {
+		for (auto &y : x) {
+			for (auto &z : y) {
+				for (auto &w : z) {
+					w = dist(rng);
+				}
+			}
+		}
+	}
+	Json conv;
+	conv["class_name"] = "Conv2D";
+	conv["weights"] = weights;
+	conv["stride"] = 1;
+	conv["padding"] = padding;
+	return conv;
+}
+}  // namespace
+
+TEST(MLP, gradient_check)
+{
+	// 6x6 -> conv 3x3 -> 4x4x2 -> pool 2x2 -> 2x2x2 -> conv 2x2, padding 1
+	// -> 3x3x3 -> dense -> 4
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<Real> dist(-0.2, 0.2);
+	Json json;
+	json["netw"] = Json::array();
+	Json conv = random_conv(rng, {3, 3, 1, 2}, "valid");
+	conv["input_shape_x"] = 6;
+	conv["input_shape_y"] = 6;
+	conv["input_shape_z"] = 1;
+	json["netw"].push_back(conv);
+	Json pool;
+	pool["class_name"] = "MaxPooling2D";
+	pool["size"] = {2, 2};
+	pool["stride"] = 2;
+	json["netw"].push_back(pool);
+	json["netw"].push_back(random_conv(rng, {2, 2, 2, 3}, "same"));
+	std::vector<std::vector<Real>> dense_weights(27, std::vector<Real>(4));
+	for (auto &row : dense_weights) {
+		for (auto &w : row) {
+			w = dist(rng);
+		}
+	}
+	Json dense;
+	dense["class_name"] = "Dense";
+	dense["weights"] = dense_weights;
+	json["netw"].push_back(dense);
+	WeightAccessMLP<ExpActivation> mlp(json, 1, 3);
+
+	MNIST::EMatrix input = MNIST::EMatrix::Random(3, 36).cwiseAbs();
+	std::vector<uint16_t> labels = {0, 3, 1};
+	auto loss = [&]() {
+		MNIST::EMatrix output = mlp.forward_batch(input).back();
+		Real res = 0.0;
+		for (Eigen::Index sample = 0; sample < output.rows(); sample++) {
+			for (Eigen::Index neuron = 0; neuron < output.cols(); neuron++) {
+				Real diff = output(sample, neuron) -
+				            (labels[sample] == neuron ? 1.0 : 0.0);
+				res += 0.5 * diff * diff;
+			}
+		}
+		return res;
+	};
+	auto gradients =
+	    mlp.batch_gradients(labels, mlp.forward_batch(input), false);
+	ASSERT_EQ(size_t(4), gradients.size());
+	EXPECT_EQ(0, gradients[1].size());
+
+	// Central differences of the loss summed over the batch
+	const Real eps = 1e-5;
+	auto check = [&](Real &weight, Real expected) {
+		Real orig = weight;
+		weight = orig + eps;
+		Real plus = loss();
+		weight = orig - eps;
+		Real minus = loss();
+		weight = orig;
+		EXPECT_NEAR(expected, (plus - minus) / (2.0 * eps),
+		            1e-6 * std::max(1.0, std::abs(expected)));
+	};
+	size_t layer_ids[] = {0, 2};
+	for (size_t conv_id = 0; conv_id < 2; conv_id++) {
+		SCOPED_TRACE("conv layer " + std::to_string(conv_id));
+		auto &filter = mlp.filters()[conv_id].filter;
+		const auto &gradient = gradients[layer_ids[conv_id]];
+		size_t ky = filter[0].size(), kz = filter[0][0].size();
+		for (size_t x = 0; x < filter.size(); x++) {
+			for (size_t y = 0; y < ky; y++) {
+				for (size_t z = 0; z < kz; z++) {
+					for (size_t f = 0; f < filter[x][y][z].size(); f++) {
+						check(filter[x][y][z][f],
+						      gradient((x * ky + y) * kz + z, f));
+					}
+				}
+			}
+		}
+	}
+	auto &weights = mlp.layers()[0];
+	for (size_t i = 0; i < weights.rows(); i++) {
+		for (size_t j = 0; j < weights.cols(); j++) {
+			check(weights(i, j), gradients[3](i, j));
+		}
+	}
+}
+
 }  // namespace mnist_helper
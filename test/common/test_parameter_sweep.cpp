@@ -19,7 +19,17 @@
 #include <cypress/cypress.hpp>
 #include "common/parameter_sweep.hpp"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -222,4 +232,477 @@ TEST(generate_sweep_vector, 2dim_sweep)
 	EXPECT_NEAR(3.0, Real(res[13]["neuron_params2"]["tau_syn_E"]), 1e-8);
 	EXPECT_NEAR(3.0, Real(res[14]["neuron_params2"]["tau_syn_E"]), 1e-8);
 }
+
+TEST(ParameterSweep, shard_positions)
+{
+	std::vector<size_t> indices = {3, 0, 4, 1, 6, 2, 5};
+	auto shard0 = ParameterSweep::shard_positions(indices, 0, 3);
+	auto shard1 = ParameterSweep::shard_positions(indices, 1, 3);
+	auto shard2 = ParameterSweep::shard_positions(indices, 2, 3);
+	EXPECT_EQ(std::vector<size_t>({0, 1, 4}), shard0);
+	EXPECT_EQ(std::vector<size_t>({2, 3}), shard1);
+	EXPECT_EQ(std::vector<size_t>({5, 6}), shard2);
+
+	auto all = ParameterSweep::shard_positions(indices, 0, 1);
+	EXPECT_EQ(indices.size(), all.size());
+}
+
+TEST(ParameterSweep, parse_shard)
+{
+	size_t shard, n_shards;
+	ParameterSweep::parse_shard("2/4", shard, n_shards);
+	EXPECT_EQ(size_t(2), shard);
+	EXPECT_EQ(size_t(4), n_shards);
+	EXPECT_ANY_THROW(ParameterSweep::parse_shard("4/4", shard, n_shards));
+	EXPECT_ANY_THROW(ParameterSweep::parse_shard("1/0", shard, n_shards));
+	EXPECT_ANY_THROW(ParameterSweep::parse_shard("2", shard, n_shards));
+}
+namespace {
+SweepJournal::Result journal_result(size_t pos, size_t n_indicators)
+{
+	SweepJournal::Result res(n_indicators);
+	for (size_t i = 0; i < n_indicators; i++) {
+		res[i] = {Real(pos), Real(i), Real(pos * i) * 0.5, -1.0};
+	}
+	return res;
+}
+
+size_t file_size(const std::string &file)
+{
+	struct stat st;
+	return stat(file.c_str(), &st) == 0 ? size_t(st.st_size) : 0;
+}
+
+/**
+ * Writes a journal containing the first n positions of indices
+ */
+void write_journal(const std::string &file, const std::vector<size_t> &indices,
+                   size_t n)
+{
+	SweepJournal journal(file, "TestSNAB", indices.size(), 2);
+	journal.open();
+	for (size_t pos = 0; pos < n; pos++) {
+		journal.append(pos, indices[pos], journal_result(pos, 2));
+	}
+}
+
+std::map<size_t, SweepJournal::Result> recover_journal(
+    const std::vector<size_t> &indices, SweepJournal &journal)
+{
+	std::map<size_t, SweepJournal::Result> res;
+	journal.recover(indices, [&](size_t pos, const SweepJournal::Result &r) {
+		res[pos] = r;
+	});
+	return res;
+}
+
+// Sizes of header and records, including the checksum
+const size_t journal_header_size = 8 + 3 * 8 + 8 + 4;
+const size_t journal_record_size = 8 + 8 + 2 * sizeof(std::array<Real, 4>) + 4;
+}  // namespace
+
+TEST(SweepJournal, recover)
+{
+	std::string file = "test_sweep_bak.journal";
+	std::vector<size_t> indices = {3, 7, 0, 9, 1, 4, 8, 2, 6, 5};
+	write_journal(file, indices, 6);
+	EXPECT_EQ(journal_header_size + 6 * journal_record_size, file_size(file));
+
+	SweepJournal journal(file, "TestSNAB", indices.size(), 2);
+	auto res = recover_journal(indices, journal);
+	EXPECT_EQ(size_t(6), res.size());
+	EXPECT_EQ(file_size(file), journal.valid_size());
+	for (size_t pos = 0; pos < 6; pos++) {
+		EXPECT_EQ(journal_result(pos, 2), res[pos]);
+	}
+
+	// Appending continues the recovered journal
+	journal.open();
+	journal.append(6, indices[6], journal_result(6, 2));
+	journal.close();
+	SweepJournal journal2(file, "TestSNAB", indices.size(), 2);
+	res = recover_journal(indices, journal2);
+	EXPECT_EQ(size_t(7), res.size());
+	EXPECT_EQ(journal_result(6, 2), res[6]);
+
+	journal2.remove();
+	EXPECT_EQ(size_t(0), file_size(file));
+	SweepJournal journal3(file, "TestSNAB", indices.size(), 2);
+	EXPECT_EQ(size_t(0), journal3.recover(
+	                         indices, [](size_t, const SweepJournal::Result &) {
+	                         }));
+}
+
+TEST(SweepJournal, torn_record)
+{
+	std::string file = "test_sweep_bak.journal";
+	std::vector<size_t> indices = {3, 7, 0, 9, 1, 4, 8, 2, 6, 5};
+	write_journal(file, indices, 5);
+	size_t valid = journal_header_size + 4 * journal_record_size;
+	ASSERT_EQ(0, truncate(file.c_str(), off_t(valid + 10)));
+
+	SweepJournal journal(file, "TestSNAB", indices.size(), 2);
+	auto res = recover_journal(indices, journal);
+	EXPECT_EQ(size_t(4), res.size());
+	EXPECT_EQ(valid, journal.valid_size());
+	EXPECT_EQ(size_t(0), res.count(4));
+
+	// The torn record is cut off before appending
+	journal.open();
+	EXPECT_EQ(valid, file_size(file));
+	journal.append(4, indices[4], journal_result(4, 2));
+	journal.close();
+	EXPECT_EQ(valid + journal_record_size, file_size(file));
+	SweepJournal journal2(file, "TestSNAB", indices.size(), 2);
+	res = recover_journal(indices, journal2);
+	EXPECT_EQ(size_t(5), res.size());
+	EXPECT_EQ(journal_result(4, 2), res[4]);
+	journal2.remove();
+}
+
+TEST(SweepJournal, corrupt_checksum)
+{
+	std::string file = "test_sweep_bak.journal";
+	std::vector<size_t> indices = {3, 7, 0, 9, 1, 4, 8, 2, 6, 5};
+	write_journal(file, indices, 5);
+	// Flip a byte of the checksum of the third record
+	size_t valid = journal_header_size + 2 * journal_record_size;
+	{
+		std::fstream fs(file, std::ios::in | std::ios::out | std::ios::binary);
+		fs.seekg(valid + journal_record_size - 1);
+		char c = fs.get();
+		fs.seekp(valid + journal_record_size - 1);
+		fs.put(char(c ^ 0x5a));
+	}
+
+	SweepJournal journal(file, "TestSNAB", indices.size(), 2);
+	auto res = recover_journal(indices, journal);
+	EXPECT_EQ(size_t(2), res.size());
+	EXPECT_EQ(valid, journal.valid_size());
+	journal.open();
+	journal.close();
+	EXPECT_EQ(valid, file_size(file));
+	journal.remove();
+
+	// A record not matching the sweep indices ends the replay as well
+	write_journal(file, indices, 3);
+	std::vector<size_t> other = indices;
+	other[1] = 42;
+	SweepJournal journal2(file, "TestSNAB", indices.size(), 2);
+	res = recover_journal(other, journal2);
+	EXPECT_EQ(size_t(1), res.size());
+	journal2.remove();
+}
+
+TEST(SweepJournal, header_mismatch)
+{
+	std::string file = "test_sweep_bak.journal";
+	std::vector<size_t> indices = {3, 7, 0, 9, 1, 4, 8, 2, 6, 5};
+	write_journal(file, indices, 5);
+	auto dummy = [](size_t, const SweepJournal::Result &) {};
+
+	SweepJournal other_snab(file, "OtherSNAB", indices.size(), 2);
+	EXPECT_EQ(size_t(0), other_snab.recover(indices, dummy));
+	EXPECT_EQ(size_t(0), other_snab.valid_size());
+	SweepJournal other_size(file, "TestSNAB", indices.size() + 1, 2);
+	EXPECT_EQ(size_t(0), other_size.recover(indices, dummy));
+	SweepJournal other_indicators(file, "TestSNAB", indices.size(), 3);
+	EXPECT_EQ(size_t(0), other_indicators.recover(indices, dummy));
+
+	// Corrupt header checksum
+	{
+		std::fstream fs(file, std::ios::in | std::ios::out | std::ios::binary);
+		fs.seekg(journal_header_size - 1);
+		char c = fs.get();
+		fs.seekp(journal_header_size - 1);
+		fs.put(char(c ^ 0x5a));
+	}
+	SweepJournal corrupt(file, "TestSNAB", indices.size(), 2);
+	EXPECT_EQ(size_t(0), corrupt.recover(indices, dummy));
+
+	// A foreign journal is overwritten
+	other_snab.open();
+	other_snab.close();
+	EXPECT_EQ(journal_header_size + 1, file_size(file));
+	other_snab.remove();
+}
+
+namespace {
+/**
+ * SNAB without a network, results only depend on the swept parameters x and y
+ */
+class SweepTestSNAB : public SNABBase {
+public:
+	SweepTestSNAB(std::string backend, size_t bench_index)
+	    : SNABBase("SweepTestSNAB", backend, {"sum", "product"},
+	               {"quality", "quality"}, {"norm", "norm"}, {"", ""}, {},
+	               bench_index)
+	{
+	}
+	cypress::Network &build_netw(cypress::Network &network) override
+	{
+		return network;
+	}
+	void run_netw(cypress::Network &) override { runs++; }
+	std::vector<std::array<Real, 4>> evaluate() override
+	{
+		Real x = m_config_file["x"], y = m_config_file["y"];
+		return {{{x + y, 0.5, x, y}}, {{x * y, 0.25, -x, -y}}};
+	}
+	std::shared_ptr<SNABBase> clone() override
+	{
+		return std::make_shared<SweepTestSNAB>(m_backend, m_bench_index);
+	}
+
+	// Number of simulations run by all instances
+	static std::atomic<size_t> runs;
+};
+std::atomic<size_t> SweepTestSNAB::runs(0);
+
+const std::string sweep_csv = "SweepTestSNAB/sweep_test_json.csv";
+
+/**
+ * Sweeps x from 0 to 3 in 4 steps and y from 1 to 2 in 2 steps
+ */
+cypress::Json sweep_config()
+{
+	return {{"snab_name", "SweepTestSNAB"},
+	        {"out_file_name", "sweep_test"},
+	        {"config", {{"json", {{"x", {0.0, 3.0, 4.0}}, {"y", {1.0, 2.0, 2.0}}}}}}};
+}
+
+std::shared_ptr<SNABBase> sweep_snab()
+{
+	return std::make_shared<SweepTestSNAB>("json", 0);
+}
+
+std::string shard_file(size_t shard, size_t n_shards)
+{
+	return "SweepTestSNAB/sweep_test_json_shard_" + std::to_string(shard) +
+	       "_of_" + std::to_string(n_shards) + ".json";
+}
+
+std::string read_file(const std::string &file)
+{
+	std::ifstream ifs(file);
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	return ss.str();
+}
+
+/**
+ * Executes all shards of the test sweep, each in its own ParameterSweep
+ */
+void run_shards(size_t n_shards)
+{
+	auto config = sweep_config();
+	for (size_t shard = 0; shard < n_shards; shard++) {
+		ParameterSweep sweep("json", config, sweep_snab(), 2, shard, n_shards);
+		sweep.execute();
+		sweep.write_shard();
+	}
+}
+
+/**
+ * Applies @param modify to the Json content of a shard file
+ */
+void modify_shard(const std::string &file,
+                  std::function<void(cypress::Json &)> modify)
+{
+	cypress::Json json;
+	{
+		std::ifstream ifs(file);
+		json = cypress::Json::parse(ifs);
+	}
+	modify(json);
+	std::ofstream ofs(file);
+	ofs << json.dump();
+}
+
+void remove_sweep_files(size_t n_shards)
+{
+	for (size_t shard = 0; shard < n_shards; shard++) {
+		std::remove(shard_file(shard, n_shards).c_str());
+	}
+	std::remove(sweep_csv.c_str());
+	rmdir("SweepTestSNAB");
+}
+}  // namespace
+
+TEST(ParameterSweep, merge_shards)
+{
+	auto config = sweep_config();
+	std::remove("json_bak.journal");
+	{
+		ParameterSweep sweep("json", config, sweep_snab(), 2);
+		sweep.execute();
+		sweep.write_csv();
+	}
+	std::string expected = read_file(sweep_csv);
+	// Header and one line per sweep point
+	EXPECT_EQ(9, std::count(expected.begin(), expected.end(), '\n'));
+	std::remove(sweep_csv.c_str());
+
+	run_shards(3);
+	// Journal of an interrupted sweep with the same backend
+	std::vector<size_t> indices = {3, 7, 0, 1, 4, 2, 6, 5};
+	write_journal("json_bak.journal", indices, 2);
+	size_t journal_size = file_size("json_bak.journal");
+	{
+		ParameterSweep sweep("json", config, sweep_snab(), 1, 0, 1, true);
+		sweep.merge_shards(3);
+		sweep.write_csv();
+		EXPECT_ANY_THROW(sweep.execute());
+	}
+	EXPECT_EQ(expected, read_file(sweep_csv));
+	EXPECT_EQ(journal_size, file_size("json_bak.journal"));
+
+	std::remove("json_bak.journal");
+	remove_sweep_files(3);
+}
+
+TEST(ParameterSweep, merge_missing_point)
+{
+	auto config = sweep_config();
+	run_shards(2);
+	modify_shard(shard_file(1, 2), [](cypress::Json &json) {
+		json["indices"].erase(0);
+		json["results"].erase(0);
+	});
+	ParameterSweep sweep("json", config, sweep_snab(), 1, 0, 1, true);
+	sweep.merge_shards(2);
+	sweep.write_csv();
+
+	std::stringstream csv(read_file(sweep_csv));
+	std::string line;
+	size_t lines = 0, missing = 0;
+	while (std::getline(csv, line)) {
+		lines++;
+		size_t nans = 0;
+		for (size_t pos = line.find("nan"); pos != std::string::npos;
+		     pos = line.find("nan", pos + 1)) {
+			nans++;
+		}
+		if (nans > 0) {
+			// All indicators of the point, but not the sweep parameters
+			EXPECT_EQ(size_t(8), nans);
+			missing++;
+		}
+	}
+	EXPECT_EQ(size_t(9), lines);
+	EXPECT_EQ(size_t(1), missing);
+	remove_sweep_files(2);
+}
+
+TEST(ParameterSweep, merge_invalid_shard)
+{
+	auto config = sweep_config();
+	std::vector<std::function<void(cypress::Json &)>> modifications = {
+	    [](cypress::Json &json) { json["shard"] = 1; },
+	    [](cypress::Json &json) { json["indices"][0] = 100; },
+	    [](cypress::Json &json) {
+		    json["indices"][0] = json["indices"][0].get<size_t>() + 1;
+	    },
+	    [](cypress::Json &json) { json["results"][0].erase(1); },
+	    [](cypress::Json &json) { json["results"].erase(0); }};
+	for (size_t i = 0; i < modifications.size(); i++) {
+		SCOPED_TRACE("modification " + std::to_string(i));
+		run_shards(2);
+		modify_shard(shard_file(0, 2), modifications[i]);
+		ParameterSweep sweep("json", config, sweep_snab(), 1, 0, 1, true);
+		EXPECT_THROW(sweep.merge_shards(2), std::runtime_error);
+	}
+	remove_sweep_files(2);
+}
+TEST(ParameterSweep, execute_skips_recovered)
+{
+	auto config = sweep_config();
+	std::remove("json_bak.journal");
+	{
+		// Interrupted sweep: the journal is kept as long as no results are
+		// written
+		ParameterSweep sweep("json", config, sweep_snab(), 1);
+		SweepTestSNAB::runs = 0;
+		sweep.execute();
+		EXPECT_EQ(size_t(8), SweepTestSNAB::runs);
+	}
+	// Keep the first three finished jobs
+	size_t header = file_size("json_bak.journal") - 8 * journal_record_size;
+	ASSERT_EQ(0, truncate("json_bak.journal",
+	                      off_t(header + 3 * journal_record_size)));
+	{
+		ParameterSweep sweep("json", config, sweep_snab(), 2);
+		SweepTestSNAB::runs = 0;
+		sweep.execute();
+		EXPECT_EQ(size_t(5), SweepTestSNAB::runs);
+		sweep.write_csv();
+	}
+	EXPECT_EQ(size_t(0), file_size("json_bak.journal"));
+	std::string expected = read_file(sweep_csv);
+	std::remove(sweep_csv.c_str());
+	{
+		ParameterSweep sweep("json", config, sweep_snab(), 2);
+		sweep.execute();
+		sweep.write_csv();
+	}
+	EXPECT_EQ(expected, read_file(sweep_csv));
+	remove_sweep_files(1);
+}
+
+TEST(JobQueues, steal_from_empty)
+{
+	// Queues {1, 5}, {2}, {3}, {4}
+	JobQueues queues({1, 2, 3, 4, 5}, 4);
+	size_t job;
+	ASSERT_TRUE(queues.pop(3, job));
+	EXPECT_EQ(size_t(4), job);
+	// Own queue is empty, steal from the back of the next one
+	ASSERT_TRUE(queues.pop(3, job));
+	EXPECT_EQ(size_t(5), job);
+	ASSERT_TRUE(queues.pop(3, job));
+	EXPECT_EQ(size_t(1), job);
+	ASSERT_TRUE(queues.pop(3, job));
+	EXPECT_EQ(size_t(2), job);
+	ASSERT_TRUE(queues.pop(0, job));
+	EXPECT_EQ(size_t(3), job);
+	EXPECT_FALSE(queues.pop(3, job));
+	EXPECT_FALSE(queues.pop(2, job));
+
+	JobQueues empty({}, 2);
+	EXPECT_FALSE(empty.pop(0, job));
+}
+
+TEST(JobQueues, concurrent)
+{
+	const size_t n_jobs = 10000, n_threads = 4;
+	std::vector<size_t> jobs(n_jobs);
+	for (size_t i = 0; i < n_jobs; i++) {
+		jobs[i] = i;
+	}
+	JobQueues queues(jobs, n_threads);
+	std::vector<std::vector<size_t>> popped(n_threads);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < n_threads; t++) {
+		threads.emplace_back([&, t]() {
+			size_t job;
+			while (queues.pop(t, job)) {
+				popped[t].push_back(job);
+				// Threads running at different speeds have to steal
+				if (t == 0) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	std::vector<size_t> all;
+	for (const auto &i : popped) {
+		all.insert(all.end(), i.begin(), i.end());
+	}
+	std::sort(all.begin(), all.end());
+	EXPECT_EQ(jobs, all);
+}
 }
@@ -0,0 +1,90 @@
+/*
+ *  SNABSuite -- Spiking Neural Architecture Benchmark Suite
+ *  Copyright (C) 2016  Christoph Jenzen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cypress/cypress.hpp>
+#include "common/snab_registry.hpp"
+
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace SNAB {
+namespace {
+/**
+ * @brief Checks for the config file of a SNAB in the directories searched by
+ * read_config()
+ */
+bool config_exists(const std::string &name)
+{
+	for (auto dir : {"../config/", "../../config/", "config/", ""}) {
+		std::ifstream ifs(dir + name + ".json");
+		if (ifs.good()) {
+			return true;
+		}
+	}
+	return false;
+}
+}  // namespace
+
+TEST(SNABRegistry, unknown_name)
+{
+	EXPECT_EQ(nullptr, create_snab("NoSuchSNAB", "nest", 0));
+	EXPECT_FALSE(snab_config_valid("NoSuchSNAB", "nest", 0));
+	EXPECT_EQ(nullptr, create_snab("", "nest", 0));
+	EXPECT_FALSE(snab_config_valid("", "nest", 0));
+}
+
+TEST(SNABRegistry, snab_names)
+{
+	const auto &names = snab_names();
+	auto snabs = snab_registry("nest", 0);
+	ASSERT_EQ(snabs.size(), names.size());
+	EXPECT_EQ(names.size(),
+	          std::set<std::string>(names.begin(), names.end()).size());
+	for (size_t i = 0; i < names.size(); i++) {
+		EXPECT_EQ(names[i], snabs[i]->snab_name());
+		auto snab = create_snab(names[i], "nest", 0);
+		ASSERT_NE(nullptr, snab) << names[i];
+		EXPECT_EQ(names[i], snab->snab_name());
+	}
+}
+
+TEST(SNABRegistry, snab_config_valid)
+{
+	size_t checked = 0;
+	for (const auto &name : snab_names()) {
+		if (!config_exists(name)) {
+			continue;
+		}
+		for (std::string backend : {"nest", "spikey", "genn"}) {
+			for (size_t bench_index = 0; bench_index < 4; bench_index++) {
+				auto snab = create_snab(name, backend, bench_index);
+				ASSERT_NE(nullptr, snab);
+				EXPECT_EQ(snab->valid(),
+				          snab_config_valid(name, backend, bench_index))
+				    << name << " " << backend << " " << bench_index;
+				checked++;
+			}
+		}
+	}
+	EXPECT_LT(0u, checked);
+}
+}  // namespace SNAB
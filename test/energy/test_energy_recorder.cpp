@@ -0,0 +1,418 @@
+/*
+ *  SNABSuite -- Spiking Neural Architecture Benchmark Suite
+ *  Copyright (C) 2016  Christoph Jenzen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "energy/energy_recorder.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace Energy {
+namespace {
+using timed_record = MeasureDevice::data;
+
+/**
+ * @brief Device returning generated samples, counts how often it was read
+ */
+class FakeDevice : public MeasureDevice {
+public:
+	std::atomic<size_t> reads{0};
+	std::chrono::microseconds latency{0};
+
+	virtual data get_data_sample_timed() override
+	{
+		if (latency.count()) {
+			std::this_thread::sleep_for(latency);
+		}
+		size_t i = reads++;
+		double current = double(i % 10) * 10.0;
+		return std::make_tuple(std::chrono::steady_clock::now(), 5000.0,
+		                       current, 5.0 * current);
+	}
+};
+
+/**
+ * @brief Random record with gaps below threshold and segments drawing no
+ * power
+ */
+std::vector<timed_record> random_record(std::mt19937 &gen, size_t size,
+                                        uint32_t thresh)
+{
+	std::uniform_real_distribution<double> uni(0.0, 1.0);
+	std::vector<timed_record> res;
+	auto time = std::chrono::steady_clock::now();
+	bool zero_power = false;
+	for (size_t i = 0; i < size; i++) {
+		time += std::chrono::microseconds(100 + size_t(uni(gen) * 10000));
+		double voltage = 4500.0 + 1000.0 * uni(gen);
+		double current;
+		if (uni(gen) < 0.3) {
+			current = double(thresh) * uni(gen);  // At or below threshold
+		}
+		else {
+			current = double(thresh) + 1.0 + 500.0 * uni(gen);
+		}
+		if (uni(gen) < 0.1) {
+			zero_power = !zero_power;
+		}
+		double power = zero_power ? 0.0 : voltage * current * 1e-3;
+		res.emplace_back(time, voltage, current, power);
+	}
+	return res;
+}
+
+/**
+ * @brief Equal or both NaN (averages without any sample above threshold)
+ */
+void expect_same(double expected, double actual)
+{
+	if (std::isnan(expected)) {
+		EXPECT_TRUE(std::isnan(actual));
+	}
+	else {
+		EXPECT_DOUBLE_EQ(expected, actual);
+	}
+}
+
+void compare_to_scans(const std::vector<timed_record> &rec, uint32_t thresh)
+{
+	EnergyAccumulator acc(thresh);
+	for (auto &i : rec) {
+		acc.add(i);
+	}
+	EXPECT_EQ(rec.size(), acc.samples());
+	EXPECT_EQ(thresh, acc.threshold());
+	EXPECT_DOUBLE_EQ(Multimeter::calculate_energy(rec, thresh), acc.energy());
+	EXPECT_DOUBLE_EQ(Multimeter::calculate_energy_last(rec, thresh),
+	                 acc.energy_last());
+	expect_same(Multimeter::average_power_draw(rec, thresh),
+	            acc.average_power_draw());
+	expect_same(Multimeter::average_power_draw_last(rec, thresh),
+	            acc.average_power_draw_last());
+	expect_same(Multimeter::average_current(rec, thresh),
+	            acc.average_current());
+	EXPECT_DOUBLE_EQ(Multimeter::min_current(rec), acc.min_current());
+	EXPECT_DOUBLE_EQ(Multimeter::max_current(rec), acc.max_current());
+	EXPECT_DOUBLE_EQ(Multimeter::min_voltage(rec), acc.min_voltage());
+	EXPECT_DOUBLE_EQ(Multimeter::max_voltage(rec), acc.max_voltage());
+
+	double trapezoid = 0.0;
+	for (size_t i = 1; i < rec.size(); i++) {
+		if (std::get<2>(rec[i]) > thresh) {
+			trapezoid += 0.5 *
+			             (std::get<3>(rec[i]) + std::get<3>(rec[i - 1])) *
+			             std::chrono::duration<double>(std::get<0>(rec[i]) -
+			                                           std::get<0>(rec[i - 1]))
+			                 .count();
+		}
+	}
+	EXPECT_NEAR(trapezoid, acc.energy_trapezoid(), 1e-9 * (1.0 + trapezoid));
+}
+
+/**
+ * @brief Waits until the predicate holds, false on timeout
+ */
+template <typename F>
+bool wait_for(F predicate, size_t timeout_ms = 2000)
+{
+	for (size_t i = 0; i < timeout_ms; i++) {
+		if (predicate()) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return predicate();
+}
+}  // namespace
+
+TEST(SpscRing, capacity)
+{
+	EXPECT_EQ(2u, SpscRing<int>(0).capacity());
+	EXPECT_EQ(2u, SpscRing<int>(1).capacity());
+	EXPECT_EQ(2u, SpscRing<int>(2).capacity());
+	EXPECT_EQ(4u, SpscRing<int>(3).capacity());
+	EXPECT_EQ(64u, SpscRing<int>(64).capacity());
+	EXPECT_EQ(128u, SpscRing<int>(65).capacity());
+	EXPECT_EQ(8192u, SpscRing<int>(5000).capacity());
+
+	SpscRing<int> ring(5);
+	ring.reset(17);
+	EXPECT_EQ(32u, ring.capacity());
+}
+
+TEST(SpscRing, full_and_empty)
+{
+	SpscRing<int> ring(5);
+	int val = -1;
+	EXPECT_FALSE(ring.pop(val));
+	EXPECT_EQ(-1, val);
+
+	// Several rounds to wrap around the index mask
+	for (int round = 0; round < 5; round++) {
+		for (int i = 0; i < 8; i++) {
+			EXPECT_TRUE(ring.push(round * 8 + i));
+		}
+		EXPECT_FALSE(ring.push(-2));
+		for (int i = 0; i < 8; i++) {
+			EXPECT_TRUE(ring.pop(val));
+			EXPECT_EQ(round * 8 + i, val);
+		}
+		EXPECT_FALSE(ring.pop(val));
+	}
+
+	// Partially filled, a single pop frees exactly one slot
+	for (int i = 0; i < 8; i++) {
+		EXPECT_TRUE(ring.push(i));
+	}
+	EXPECT_TRUE(ring.pop(val));
+	EXPECT_EQ(0, val);
+	EXPECT_TRUE(ring.push(8));
+	EXPECT_FALSE(ring.push(9));
+
+	ring.reset(4);
+	EXPECT_FALSE(ring.pop(val));
+	EXPECT_TRUE(ring.push(1));
+}
+
+TEST(SpscRing, threads)
+{
+	SpscRing<size_t> ring(16);
+	const size_t n = 20000;
+	std::thread producer([&]() {
+		for (size_t i = 0; i < n; i++) {
+			while (!ring.push(i)) {
+				std::this_thread::yield();
+			}
+		}
+	});
+	size_t val, expected = 0;
+	while (expected < n) {
+		if (!ring.pop(val)) {
+			std::this_thread::yield();
+			continue;
+		}
+		ASSERT_EQ(expected, val);
+		expected++;
+	}
+	producer.join();
+	EXPECT_FALSE(ring.pop(val));
+}
+
+TEST(EnergyAccumulator, matches_record_scans)
+{
+	std::mt19937 gen(1234);
+	for (uint32_t thresh : {0u, 50u, 200u}) {
+		for (size_t size : {1, 2, 3, 10, 100, 1000}) {
+			for (size_t rep = 0; rep < 5; rep++) {
+				SCOPED_TRACE("threshold " + std::to_string(thresh) + ", size " +
+				             std::to_string(size));
+				compare_to_scans(random_record(gen, size, thresh), thresh);
+			}
+		}
+	}
+}
+
+TEST(EnergyAccumulator, single_sample)
+{
+	auto rec = std::vector<timed_record>({std::make_tuple(
+	    std::chrono::steady_clock::now(), 5000.0, 100.0, 500.0)});
+	compare_to_scans(rec, 0);
+	compare_to_scans(rec, 100);
+
+	EnergyAccumulator acc(0);
+	acc.add(rec[0]);
+	EXPECT_DOUBLE_EQ(0.0, acc.energy());
+	EXPECT_DOUBLE_EQ(500.0, acc.average_power_draw());
+	EXPECT_DOUBLE_EQ(500.0, acc.average_power_draw_last());
+	EXPECT_DOUBLE_EQ(100.0, acc.average_current());
+}
+
+TEST(EnergyAccumulator, segments)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto sample = [&](size_t ms, double current, double power) {
+		return std::make_tuple(start + std::chrono::milliseconds(ms), 5000.0,
+		                       current, power);
+	};
+	// Two segments above 10mA, the second one followed by a gap
+	std::vector<timed_record> rec = {
+	    sample(0, 20, 100),    sample(1000, 20, 100), sample(2000, 0, 0),
+	    sample(3000, 20, 300), sample(4000, 20, 300), sample(5000, 5, 0),
+	    sample(6000, 5, 0)};
+	EnergyAccumulator acc(10);
+	for (auto &i : rec) {
+		acc.add(i);
+	}
+	EXPECT_DOUBLE_EQ(700.0, acc.energy());
+	EXPECT_DOUBLE_EQ(600.0, acc.energy_last());
+	EXPECT_DOUBLE_EQ(200.0, acc.average_power_draw());
+	EXPECT_DOUBLE_EQ(300.0, acc.average_power_draw_last());
+	EXPECT_DOUBLE_EQ(20.0, acc.average_current());
+	compare_to_scans(rec, 10);
+
+	acc.reset(0);
+	EXPECT_EQ(0u, acc.samples());
+	EXPECT_EQ(0u, acc.threshold());
+	EXPECT_DOUBLE_EQ(0.0, acc.energy());
+}
+
+TEST(Multimeter, online_statistics)
+{
+	auto device = std::make_shared<FakeDevice>();
+	Multimeter multi(device);
+	EXPECT_THROW(multi.calculate_energy(), std::runtime_error);
+	multi.set_online_threshold(15);
+	multi.start_recording();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	auto &rec = multi.stop_recording();
+	ASSERT_GT(rec.size(), 1u);
+	EXPECT_EQ(rec.size(), multi.statistics().samples());
+
+	// Online threshold and any other one evaluated on the kept samples
+	for (uint32_t thresh : {15u, 0u, 45u}) {
+		EXPECT_DOUBLE_EQ(Multimeter::calculate_energy(rec, thresh),
+		                 multi.calculate_energy(thresh));
+		EXPECT_DOUBLE_EQ(Multimeter::calculate_energy_last(rec, thresh),
+		                 multi.calculate_energy_last(thresh));
+		EXPECT_DOUBLE_EQ(Multimeter::average_power_draw(rec, thresh),
+		                 multi.average_power_draw(thresh));
+		EXPECT_DOUBLE_EQ(Multimeter::average_power_draw_last(rec, thresh),
+		                 multi.average_power_draw_last(thresh));
+	}
+	EXPECT_DOUBLE_EQ(Multimeter::max_current(rec), multi.max_current());
+	EXPECT_DOUBLE_EQ(Multimeter::min_voltage(rec), multi.min_voltage());
+}
+
+TEST(Multimeter, keep_samples_off)
+{
+	auto device = std::make_shared<FakeDevice>();
+	Multimeter multi(device);
+	multi.set_online_threshold(15);
+	multi.set_keep_samples(false);
+	multi.start_recording();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_TRUE(multi.stop_recording().empty());
+	EXPECT_GT(multi.statistics().samples(), 1u);
+
+	EXPECT_NO_THROW(multi.calculate_energy(15));
+	EXPECT_NO_THROW(multi.calculate_energy_last(15));
+	EXPECT_NO_THROW(multi.average_power_draw(15));
+	EXPECT_NO_THROW(multi.average_power_draw_last(15));
+	EXPECT_DOUBLE_EQ(multi.statistics().energy(), multi.calculate_energy(15));
+	EXPECT_THROW(multi.calculate_energy(0), std::runtime_error);
+	EXPECT_THROW(multi.calculate_energy_last(20), std::runtime_error);
+	EXPECT_THROW(multi.average_power_draw(), std::runtime_error);
+	EXPECT_THROW(multi.average_power_draw_last(16), std::runtime_error);
+}
+
+TEST(Multimeter, sample_rate)
+{
+	auto device = std::make_shared<FakeDevice>();
+	// Device latency is part of the period, not added to it
+	device->latency = std::chrono::milliseconds(2);
+	Multimeter multi(device);
+	multi.set_sample_rate(200.0);
+	auto start = std::chrono::steady_clock::now();
+	multi.start_recording();
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	auto &rec = multi.stop_recording();
+	double duration = std::chrono::duration<double>(
+	                      std::chrono::steady_clock::now() - start)
+	                      .count();
+	double expected = 200.0 * duration;
+	EXPECT_EQ(device->reads, rec.size());
+	EXPECT_EQ(0u, multi.dropped_samples());
+	EXPECT_LE(double(rec.size()), expected + 2.0);
+	// The sampling thread may be starved on a loaded machine, only check
+	// that it is sampling at all
+	EXPECT_GE(rec.size(), 2u);
+	for (size_t i = 1; i < rec.size(); i++) {
+		EXPECT_LT(std::get<0>(rec[i - 1]), std::get<0>(rec[i]));
+	}
+}
+
+TEST(Multimeter, dropped_samples)
+{
+	auto device = std::make_shared<FakeDevice>();
+	Multimeter multi(device);
+	multi.set_buffer_size(2);
+	multi.start_recording();
+	EXPECT_THROW(multi.set_buffer_size(16), std::runtime_error);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	auto &rec = multi.stop_recording();
+
+	// Every sample was either consumed or counted as dropped
+	EXPECT_GT(multi.dropped_samples(), 0u);
+	EXPECT_EQ(size_t(device->reads), rec.size() + multi.dropped_samples());
+	EXPECT_EQ(rec.size(), multi.statistics().samples());
+
+	// Counter is reset by the next recording
+	multi.set_buffer_size(4096);
+	device->latency = std::chrono::milliseconds(1);
+	device->reads = 0;
+	multi.start_recording();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(size_t(device->reads), multi.stop_recording().size());
+	EXPECT_EQ(0u, multi.dropped_samples());
+}
+
+TEST(Multimeter, sync_lock)
+{
+	remove("sync_lock");
+	remove("sync_lock2");
+	auto device = std::make_shared<FakeDevice>();
+	Multimeter multi(device);
+	multi.set_block(true);
+	multi.start_recording();
+
+	// No samples before the external process opened the fifo
+	ASSERT_TRUE(wait_for([]() {
+		struct stat info;
+		return stat("sync_lock", &info) == 0 && S_ISFIFO(info.st_mode);
+	}));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(0u, device->reads);
+	int fd = open("sync_lock", O_WRONLY);
+	ASSERT_GE(fd, 0);
+	close(fd);
+	EXPECT_TRUE(wait_for([&]() { return device->reads > 0; }));
+
+	// Creating the second file stops the recording
+	std::ofstream("sync_lock2").close();
+	EXPECT_TRUE(wait_for([]() { return access("sync_lock2", F_OK) != 0; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	size_t reads = device->reads;
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(reads, device->reads);
+
+	auto &rec = multi.stop_recording();
+	EXPECT_EQ(reads, rec.size() + multi.dropped_samples());
+	remove("sync_lock");
+}
+}  // namespace Energy
@@ -0,0 +1,235 @@
+/*
+ *  SNABSuite -- Spiking Neural Architecture Benchmark Suite
+ *  Copyright (C) 2020 Christoph Ostrau
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "energy/energy_utils.hpp"
+
+#include <cypress/cypress.hpp>
+
+#include <array>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace Energy {
+namespace {
+template <typename T>
+void set_spikes(cypress::Population<T> &pop, const std::vector<size_t> &counts)
+{
+	for (size_t i = 0; i < counts.size(); i++) {
+		std::vector<Real> spikes;
+		for (size_t j = 0; j < counts[i]; j++) {
+			spikes.push_back(Real(j + 1));
+		}
+		pop[i].signals().data(0,
+		                      std::make_shared<cypress::Matrix<Real>>(spikes));
+	}
+}
+
+/**
+ * @brief Sources a, populations b, c recording spikes, d not recording
+ *
+ * a -> b: OneToOne           a -> c: AllToAll, STDP
+ * a -> d: FixedFanOut(2)     b -> c: FromList
+ * b -> c: OneToOne, STDP     c -> d: AllToAll
+ */
+cypress::Network activity_network()
+{
+	cypress::Network netw;
+	auto a = netw.create_population<SpikeSourceArray>(
+	    3, SpikeSourceArrayParameters(),
+	    SpikeSourceArraySignals().record_spikes(), "a");
+	auto b = netw.create_population<IfCondExp>(
+	    3, IfCondExpParameters(), IfCondExpSignals().record_spikes(), "b");
+	auto c = netw.create_population<IfCondExp>(
+	    3, IfCondExpParameters(), IfCondExpSignals().record_spikes(), "c");
+	auto d = netw.create_population<IfCondExp>(2, IfCondExpParameters(),
+	                                           IfCondExpSignals(), "d");
+	auto stdp = cypress::SpikePairRuleAdditive();
+	netw.add_connection(a, b, Connector::one_to_one(1.0));
+	netw.add_connection(a, c, Connector::all_to_all(stdp));
+	netw.add_connection(a, d, Connector::fixed_fan_out(2, 1.0));
+	std::vector<LocalConnection> list = {
+	    LocalConnection(0, 0, 1.0), LocalConnection(0, 1, 0.5),
+	    LocalConnection(2, 1, 1.0), LocalConnection(1, 2, 1.0)};
+	netw.add_connection(b, c, Connector::from_list(list));
+	netw.add_connection(b, c, Connector::one_to_one(stdp));
+	netw.add_connection(c, d, Connector::all_to_all(1.0));
+
+	set_spikes(a, {2, 0, 1});
+	set_spikes(b, {1, 3, 0});
+	set_spikes(c, {2, 2, 1});
+	return netw;
+}
+
+/**
+ * @brief Every error is a tenth of the value
+ */
+Json activity_model(bool stdp)
+{
+	Json model = {
+	    {"power",
+	     {{"idle", {2.0, 0.2}},
+	      {"idle_neurons", {0.5, 0.05}},
+	      {"idle_recorded_neurons", {1.0, 0.1}},
+	      {"idle_stdp", {0.01, 0.001}}}},
+	    {"energy",
+	     {{"spike", {3.0, 0.3}},
+	      {"InputSpike_O2O", {10.0, 1.0}},
+	      {"InputSpike_A2A", {20.0, 2.0}},
+	      {"InputSpike_random", {30.0, 3.0}},
+	      {"Transmission_O2O", {100.0, 10.0}},
+	      {"Transmission_S2A", {200.0, 20.0}},
+	      {"Transmission_random", {300.0, 30.0}},
+	      {"Transmission_STDP", {1000.0, 100.0}}}}};
+	if (stdp) {
+		model["stdp"] = true;
+	}
+	return model;
+}
+
+/**
+ * @brief Postsynaptic spikes of a connection counted on the expanded list
+ */
+size_t expanded_postsyn(const cypress::ConnectionDescriptor &descr,
+                        const std::vector<size_t> &spikes)
+{
+	std::vector<LocalConnection> connections;
+	descr.connect(connections);
+	size_t res = 0;
+	for (const auto &lc : connections) {
+		if (lc.valid()) {
+			res += spikes[lc.src];
+		}
+	}
+	return res;
+}
+
+std::vector<LocalConnection> random_list(std::mt19937 &gen, size_t n_src,
+                                         size_t n_tar, size_t n)
+{
+	std::vector<LocalConnection> res;
+	for (size_t i = 0; i < n; i++) {
+		res.emplace_back(gen() % n_src, gen() % n_tar,
+		                 Real(gen() % 4) * 0.25);
+	}
+	return res;
+}
+}  // namespace
+
+TEST(FanOutCache, from_list)
+{
+	std::mt19937 gen(42);
+	cypress::Network netw;
+	auto a = netw.create_population<SpikeSourceArray>(
+	    20, SpikeSourceArrayParameters(),
+	    SpikeSourceArraySignals().record_spikes(), "a");
+	auto b = netw.create_population<IfCondExp>(
+	    10, IfCondExpParameters(), IfCondExpSignals().record_spikes(), "b");
+	netw.add_connection(
+	    a, b, Connector::from_list(random_list(gen, 20, 10, 100)), "list");
+	std::vector<size_t> spikes;
+	for (size_t i = 0; i < 20; i++) {
+		spikes.push_back(gen() % 5);
+	}
+	set_spikes(a, spikes);
+
+	FanOutCache cache;
+	for (size_t rep = 0; rep < 3; rep++) {
+		size_t expected = expanded_postsyn(netw.connections()[0], spikes);
+		for (size_t threads : {1, 4}) {
+			NetworkActivity activity(netw, threads, &cache);
+			EXPECT_EQ(expected, activity.populations[0].postsyn[2]);
+		}
+		EXPECT_EQ(expected, std::get<2>(calc_postsyn_spikes(
+		                        netw.populations()[0], netw.connections(),
+		                        false)));
+		EXPECT_EQ(1u, cache.size());
+
+		// A replaced connector must not be answered from the cache
+		netw.update_connection(
+		    Connector::from_list(random_list(gen, 20, 10, 50 + 50 * rep)),
+		    "list");
+	}
+}
+
+TEST(NetworkActivity, populations)
+{
+	auto netw = activity_network();
+	for (size_t threads : {1, 4}) {
+		SCOPED_TRACE("threads " + std::to_string(threads));
+		FanOutCache cache;
+		NetworkActivity activity(netw, threads, &cache);
+		ASSERT_EQ(4u, activity.populations.size());
+		const auto &a = activity.populations[0], &b = activity.populations[1],
+		           &c = activity.populations[2], &d = activity.populations[3];
+
+		EXPECT_TRUE(a.source);
+		EXPECT_FALSE(b.source);
+		EXPECT_TRUE(c.recording);
+		EXPECT_FALSE(d.recording);
+		EXPECT_EQ(2u, d.size);
+		EXPECT_EQ(3u, a.spikes);
+		EXPECT_EQ(4u, b.spikes);
+		EXPECT_EQ(5u, c.spikes);
+		EXPECT_EQ(0u, d.spikes);
+
+		// 3 spikes: O2O to b, A2A (STDP) to 3 neurons of c, fan-out of 2 to d
+		EXPECT_EQ((std::array<size_t, 3>{{3, 9, 6}}), a.postsyn);
+		EXPECT_EQ((std::array<size_t, 3>{{0, 9, 0}}), a.postsyn_stdp);
+		// FromList fan-out {2, 1, 1} times spikes {1, 3, 0}, O2O (STDP)
+		EXPECT_EQ((std::array<size_t, 3>{{4, 0, 5}}), b.postsyn);
+		EXPECT_EQ((std::array<size_t, 3>{{4, 0, 0}}), b.postsyn_stdp);
+		EXPECT_EQ((std::array<size_t, 3>{{0, 10, 0}}), c.postsyn);
+		EXPECT_EQ((std::array<size_t, 3>{{0, 0, 0}}), c.postsyn_stdp);
+		EXPECT_EQ((std::array<size_t, 3>{{0, 0, 0}}), d.postsyn);
+
+		// A2A a -> c and O2O b -> c
+		EXPECT_EQ(12u, activity.stdp_synapses);
+		EXPECT_EQ(1u, cache.size());
+	}
+}
+
+TEST(NetworkActivity, calculate_energy)
+{
+	auto netw = activity_network();
+	for (size_t threads : {1, 4}) {
+		SCOPED_TRACE("threads " + std::to_string(threads));
+		NetworkActivity activity(netw, threads);
+
+		// idle 10ms * 2 + input of a (3 * 10 + 9 * 20 + 6 * 30)
+		// + b (idle 3 * 1 * 10, 4 spikes * 3, 4 * 100 + 5 * 300)
+		// + c (idle 3 * 1 * 10, 5 spikes * 3, 10 * 200)
+		// + d (not recorded, idle 2 * 0.5 * 10)
+		auto res = calculate_energy(
+		    activity, EnergyCoefficients(activity_model(false)), 10.0);
+		EXPECT_NEAR(4407.0, res.first, 1e-6);
+		EXPECT_NEAR(440.7, res.second, 1e-6);
+
+		// 12 STDP synapses * 0.01 + (9 + 4) STDP transmissions * 1000
+		res = calculate_energy(activity,
+		                       EnergyCoefficients(activity_model(true)), 10.0);
+		EXPECT_NEAR(17407.12, res.first, 1e-6);
+		EXPECT_NEAR(1740.712, res.second, 1e-6);
+	}
+	auto res = calculate_energy(netw, activity_model(true), 10.0);
+	EXPECT_NEAR(17407.12, res.first, 1e-6);
+	EXPECT_NEAR(1740.712, res.second, 1e-6);
+}
+}  // namespace Energy
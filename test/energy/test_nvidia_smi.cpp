@@ -0,0 +1,140 @@
+/*
+ *  SNABSuite -- Spiking Neural Architecture Benchmark Suite
+ *  Copyright (C) 2016  Christoph Jenzen
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "energy/nvidia-smi.hpp"
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace Energy {
+namespace {
+/**
+ * @brief Writes an executable shell script to a temporary file
+ */
+std::string write_script(const std::string &name, const std::string &body)
+{
+	std::string path = "nvidia_smi_test_" + name + ".sh";
+	std::ofstream file(path);
+	file << "#!/bin/sh\n" << body;
+	file.close();
+	chmod(path.c_str(), 0755);
+	return "./" + path;
+}
+
+/**
+ * @brief True if the process is gone or only a zombie waiting for init
+ */
+bool process_dead(pid_t pid)
+{
+	for (size_t i = 0; i < 100; i++) {
+		std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+		std::string dummy, state;
+		if (!(stat >> dummy >> dummy >> state) || state == "Z") {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+}  // namespace
+
+TEST(nvidiasmi, parse_csv)
+{
+	auto script = write_script("parse",
+	                           "echo 'power.draw [W]'\n"
+	                           "echo '12.5'\n"
+	                           "echo 'not a number'\n"
+	                           "echo '13.25 W'\n"
+	                           "echo ''\n"
+	                           "echo '14.75'\n");
+	nvidiasmi smi(script);
+	EXPECT_DOUBLE_EQ(12.5, smi.read());
+	EXPECT_DOUBLE_EQ(13.25, smi.read());
+	auto sample = smi.get_data_sample_timed();
+	EXPECT_DOUBLE_EQ(14750.0, std::get<3>(sample));
+	EXPECT_DOUBLE_EQ(12000.0, std::get<1>(sample));
+	EXPECT_DOUBLE_EQ(14750.0 / 12.0, std::get<2>(sample));
+
+	// The child exited, no samples left
+	EXPECT_THROW(smi.read(), std::runtime_error);
+	EXPECT_THROW(smi.get_data_sample_timed(), std::runtime_error);
+	remove(script.c_str() + 2);
+}
+
+TEST(nvidiasmi, ordered_timestamps)
+{
+	auto script = write_script(
+	    "ordered", "i=0\nwhile [ $i -lt 20 ]; do echo $i; i=$((i+1)); done\n");
+	nvidiasmi smi(script);
+	auto last = smi.get_data_sample_timed();
+	EXPECT_DOUBLE_EQ(0.0, std::get<3>(last));
+	for (size_t i = 1; i < 20; i++) {
+		auto sample = smi.get_data_sample_timed();
+		EXPECT_DOUBLE_EQ(double(i) * 1e3, std::get<3>(sample));
+		EXPECT_LE(std::get<0>(last), std::get<0>(sample));
+		last = sample;
+	}
+	remove(script.c_str() + 2);
+}
+
+TEST(nvidiasmi, discard_pending)
+{
+	auto script = write_script("discard",
+	                           "echo 1\necho 2\necho 3\n"
+	                           "sleep 0.3\necho 42\nsleep 10\n");
+	nvidiasmi smi(script);
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	smi.discard_pending();
+	EXPECT_DOUBLE_EQ(42.0, smi.read());
+	remove(script.c_str() + 2);
+}
+
+TEST(nvidiasmi, kills_process_group)
+{
+	std::string pid_file = "nvidia_smi_test_pids";
+	remove(pid_file.c_str());
+	auto script = write_script("kill", "sleep 100 &\necho $$ $! > " +
+	                                       pid_file +
+	                                       "\necho 1.0\nwhile true; do "
+	                                       "sleep 0.05; echo 2.0; done\n");
+	pid_t shell, child;
+	{
+		nvidiasmi smi(script);
+		EXPECT_DOUBLE_EQ(1.0, smi.read());
+		std::ifstream pids(pid_file);
+		ASSERT_TRUE(pids >> shell >> child);
+		EXPECT_EQ(0, kill(shell, 0));
+		EXPECT_EQ(0, kill(child, 0));
+	}
+	// The script was reaped by the destructor, the background child was
+	// killed as member of the same process group
+	EXPECT_TRUE(process_dead(shell));
+	EXPECT_TRUE(process_dead(child));
+	remove(pid_file.c_str());
+	remove(script.c_str() + 2);
+}
+}  // namespace Energy